@@ -130,6 +130,7 @@ sub Search   { 3953 }
 sub Get      { 3954 }
 sub DeleteRS { 3955 }
 sub Scan     { 3956 }
+sub Sort     { 3957 }
 package Net::Z3950;
 
 
@@ -211,6 +212,15 @@ sub Error      { 23955 }	# some other error (consult errno)
 package Net::Z3950;
 
 
+# Define the flags that may be passed to decodeAPDUs().  These must be
+# kept synchronised with the values #defined in "yazwrap/yazwrap.h"
+package Net::Z3950::DecodeFlags;
+sub Lazy { 1 }			# GRS-1 and OPAC records as lazy handles
+sub Shared { 2 }		# Opaque records share the decode buffer
+sub Stream { 4 }		# Present records passed to the callback
+package Net::Z3950;
+
+
 # Define the query-type enumeration.  This must be kept synchronised
 # with the values #defined in "yazwrap/yazwrap.h"
 package Net::Z3950::QueryType;
@@ -248,6 +258,24 @@ sub Failure  { 5 }
 package Net::Z3950;
 
 
+# Define the close-reason enumeration, used by the `closeReason' field
+# in the Net::Z3950::APDU::Close class and by makeCloseRequest().
+# This must be kept synchronised with the ASN.1 for the structure
+# described in section 3.2.11.1 of the Z39.50 standard itself.
+package Net::Z3950::CloseReason;
+sub Finished          { 0 }
+sub Shutdown          { 1 }
+sub SystemProblem     { 2 }
+sub CostLimit         { 3 }
+sub Resources         { 4 }
+sub SecurityViolation { 5 }
+sub ProtocolError     { 6 }
+sub LackOfActivity    { 7 }
+sub PeerAbort         { 8 }
+sub Unspecified       { 9 }
+package Net::Z3950;
+
+
 # Define the scan-status enumeration, used by the `scanStatus'
 # field in the Net::Z3950::APDU::ScanResponse class.  This must be
 # kept synchronised with the ASN.1 for the structure described in
@@ -263,13 +291,33 @@ sub Failure  { 6 }
 package Net::Z3950;
 
 
+# Define the sort-status and result-set-status enumerations, used by
+# the `sortStatus' and `resultSetStatus' fields in the
+# Net::Z3950::APDU::SortResponse class.  These must be kept
+# synchronised with the ASN.1 for the structure described in section
+# 3.2.7.1 of the Z39.50 standard itself.
+package Net::Z3950::SortStatus;
+sub Success  { 0 }
+sub Partial1 { 1 }
+sub Failure  { 2 }
+package Net::Z3950::SortResultSetStatus;
+sub Empty     { 1 }
+sub Interim   { 2 }
+sub Unchanged { 3 }
+sub None      { 4 }
+package Net::Z3950;
+
+
 # Include modules implementing Net::Z3950 classes
 use Net::Z3950::Manager;
 use Net::Z3950::Connection;
 use Net::Z3950::APDU;
 use Net::Z3950::ResultSet;
 use Net::Z3950::Record;
+use Net::Z3950::RecordStore;
 use Net::Z3950::ScanSet;
+use Net::Z3950::EventLoop;
+use Net::Z3950::Federation;
 
 
 =head1 FUNCTIONS
@@ -322,6 +370,7 @@ sub opstr {
     return "get" if $op == Net::Z3950::Op::Get;
     return "deleteRS" if $op == Net::Z3950::Op::DeleteRS;
     return "scan" if $op == Net::Z3950::Op::Scan;
+    return "sort" if $op == Net::Z3950::Op::Sort;
     return "unknown op " . $op;
 }
 
@@ -20,6 +20,37 @@ static databuf SVstar2databuf(SV* svp)
     return buf;
 }
 
+/*
+ * Used for converting intlist-type arguments, which are passed as
+ * references to arrays of integers.  The memory is freed when the
+ * calling XSUB returns.
+ */
+static intlist SVstar2intlist(SV* svp)
+{
+    intlist list;
+    AV *av;
+    int i;
+
+    list.vals = 0;
+    list.n = 0;
+    if (!SvROK(svp) || SvTYPE(SvRV(svp)) != SVt_PVAV)
+	return list;
+
+    av = (AV*) SvRV(svp);
+    list.n = av_len(av) + 1;
+    if (list.n == 0)
+	return list;
+
+    New(0, list.vals, list.n, int);
+    SAVEFREEPV(list.vals);
+    for (i = 0; i < list.n; i++) {
+	SV **svpp = av_fetch(av, i, 0);
+	list.vals[i] = (svpp != 0) ? SvIV(*svpp) : 0;
+    }
+
+    return list;
+}
+
 static char *SVstar2MNPV(SV* svp)
 {
     STRLEN dummy;
@@ -123,6 +154,74 @@ COMSTACK
 yaz_connect(addr)
 	char *addr
 
+int
+resolverFd()
+
+int
+resolveStart(host)
+	char *host
+
+SV *
+resolveNext()
+
+RECSTORE
+storeOpen(path)
+	char *path
+
+void
+storeClose(st)
+	RECSTORE st
+
+int
+storeSize(st)
+	RECSTORE st
+
+int
+storeClass(st, n)
+	RECSTORE st
+	int n
+
+SV *
+storeFetch(st, n, class)
+	RECSTORE st
+	int n
+	char *class
+
+EVLOOP
+evloopCreate()
+
+void
+evloopDestroy(loop)
+	EVLOOP loop
+
+int
+evloopAddConn(loop, cs, ctx, flags)
+	EVLOOP loop
+	COMSTACK cs
+	CONNCTX ctx
+	int flags
+
+int
+evloopAddFd(loop, fd)
+	EVLOOP loop
+	int fd
+
+int
+evloopRemove(loop, id)
+	EVLOOP loop
+	int id
+
+int
+evloopPoll(loop, id, events)
+	EVLOOP loop
+	int id
+	int events
+
+SV *
+evloopRun(loop, timeout)
+	EVLOOP loop
+	int timeout
+
 int
 yaz_socket(cs)
 	COMSTACK cs
@@ -131,12 +230,45 @@ int
 yaz_close(cs)
 	COMSTACK cs
 
+CONNCTX
+contextCreate()
+
+void
+contextDestroy(ctx)
+	CONNCTX ctx
+
+int
+contextPending(ctx)
+	CONNCTX ctx
+
+int
+contextRelease(ctx)
+	CONNCTX ctx
+
+QUERYCACHE
+queryCacheCreate(qualPath, max)
+	char *qualPath
+	int max
+
+void
+queryCacheDestroy(qc)
+	QUERYCACHE qc
+
+int
+queryCacheLoad(qc, qualPath, errmsg)
+	QUERYCACHE qc
+	char *qualPath
+	char *&errmsg
+	OUTPUT:
+	errmsg
+
 const char *
 diagbib1_str(errcode)
 	int errcode
 
-databuf
-makeInitRequest(referenceId, preferredMessageSize, maximumRecordSize, user, password, groupid, implementationId, implementationName, implementationVersion, charset, language, errmsg)
+int
+makeInitRequest(ctx, referenceId, preferredMessageSize, maximumRecordSize, user, password, groupid, implementationId, implementationName, implementationVersion, charset, language, errmsg)
+	CONNCTX ctx
 	databuf referenceId
 	int preferredMessageSize
 	int maximumRecordSize
@@ -152,8 +284,10 @@ makeInitRequest(referenceId, preferredMessageSize, maximumRecordSize, user, pass
 	OUTPUT:
 	errmsg
 
-databuf
-makeSearchRequest(referenceId, smallSetUpperBound, largeSetLowerBound, mediumSetPresentNumber, resultSetName, databaseName, smallSetElementSetName, mediumSetElementSetName, preferredRecordSyntax, queryType, query, errmsg)
+int
+makeSearchRequest(ctx, qc, referenceId, smallSetUpperBound, largeSetLowerBound, mediumSetPresentNumber, resultSetName, databaseName, smallSetElementSetName, mediumSetElementSetName, preferredRecordSyntax, queryType, query, errmsg)
+	CONNCTX ctx
+	QUERYCACHE qc
 	databuf referenceId
 	int smallSetUpperBound
 	int largeSetLowerBound
@@ -169,8 +303,10 @@ makeSearchRequest(referenceId, smallSetUpperBound, largeSetLowerBound, mediumSet
 	OUTPUT:
 	errmsg
 
-databuf
-makeScanRequest(referenceId, databaseName, stepSize, numberOfTermsRequested, preferredPositionInResponse, queryType, query, errmsg)
+int
+makeScanRequest(ctx, qc, referenceId, databaseName, stepSize, numberOfTermsRequested, preferredPositionInResponse, queryType, query, errmsg)
+    CONNCTX ctx
+    QUERYCACHE qc
     databuf referenceId
     char *databaseName
     int stepSize
@@ -182,26 +318,52 @@ makeScanRequest(referenceId, databaseName, stepSize, numberOfTermsRequested, pre
     OUTPUT:
     errmsg
 
-databuf
-makePresentRequest(referenceId, resultSetId, resultSetStartPoint, numberOfRecordsRequested, elementSetName, preferredRecordSyntax, errmsg)
+int
+makePresentRequest(ctx, referenceId, resultSetId, resultSetStartPoint, numberOfRecordsRequested, additionalRanges, elementSetName, preferredRecordSyntax, maxSegmentCount, maxRecordSize, maxSegmentSize, errmsg)
+	CONNCTX ctx
 	databuf referenceId
 	char *resultSetId
 	int resultSetStartPoint
 	int numberOfRecordsRequested
+	intlist additionalRanges
 	char *elementSetName
 	int preferredRecordSyntax
+	int maxSegmentCount
+	int maxRecordSize
+	int maxSegmentSize
 	char *&errmsg
 	OUTPUT:
 	errmsg
 
-databuf
-makeDeleteRSRequest(referenceId, resultSetId, errmsg)
+int
+makeDeleteRSRequest(ctx, referenceId, resultSetId, errmsg)
+	CONNCTX ctx
 	databuf referenceId
 	char *resultSetId
 	char *&errmsg
 	OUTPUT:
 	errmsg
 
+int
+makeSortRequest(ctx, referenceId, inputResultSetName, sortedResultSetName, sortSpec, errmsg)
+	CONNCTX ctx
+	databuf referenceId
+	char *inputResultSetName
+	char *sortedResultSetName
+	char *sortSpec
+	char *&errmsg
+	OUTPUT:
+	errmsg
+
+int
+makeCloseRequest(ctx, referenceId, closeReason, errmsg)
+	CONNCTX ctx
+	databuf referenceId
+	int closeReason
+	char *&errmsg
+	OUTPUT:
+	errmsg
+
 SV *
 decodeAPDU(cs, reason)
 	COMSTACK cs
@@ -209,7 +371,52 @@ decodeAPDU(cs, reason)
 	OUTPUT:
 	reason
 
+SV *
+decodeAPDUs(cs, flags, reason)
+	COMSTACK cs
+	int flags
+	int &reason
+	OUTPUT:
+	reason
+
+void
+decodeStream(cs, cb)
+	COMSTACK cs
+	SV *cb
+
+SV *
+lazyMaterialise(lr)
+	lazyRecord *lr
+
+int
+lazyCount(lr)
+	lazyRecord *lr
+
+void
+lazyFree(lr)
+	lazyRecord *lr
+
+int
+marcNFields(rec)
+	databuf rec
+
+SV *
+marcField(rec, tag)
+	databuf rec
+	char *tag
+
+SV *
+marcSubfield(rec, tag, code)
+	databuf rec
+	char *tag
+	char *code
+
+SV *
+marcRender(rec, mab)
+	databuf rec
+	int mab
+
 int
-yaz_write(cs, buf)
+yaz_write(cs, ctx)
 	COMSTACK cs
-	databuf buf
+	CONNCTX ctx
@@ -155,6 +155,11 @@ sub _fields { @FIELDS };
 	nextResultSetPosition()
 	presentStatus()
 	records()
+	streamed()
+
+(When the connection's C<streamRecords> option is set, the records
+are passed to their result set one by one as they are decoded, and
+are not in C<records()>: C<streamed()> is then the number passed.)
 
 =cut
 
@@ -162,7 +167,7 @@ package Net::Z3950::APDU::PresentResponse;
 use vars qw(@ISA @FIELDS);
 @ISA = qw(Net::Z3950::APDU);
 @FIELDS = qw(referenceId numberOfRecordsReturned nextResultSetPosition
-	     presentStatus records);
+	     presentStatus records streamed);
 sub _fields { @FIELDS };
 
 
@@ -185,6 +190,53 @@ use vars qw(@ISA @FIELDS);
 sub _fields { @FIELDS };
 
 
+=head2 Net::Z3950::APDU::SortResponse
+
+	referenceId()
+	sortStatus()
+	resultSetStatus()
+	resultCount()
+	diagnostics()
+
+(C<sortStatus()> is one of the C<Net::Z3950::SortStatus::*>
+constants C<Success>, C<Partial1> and C<Failure>; when it's not
+C<Success>, C<resultSetStatus()> may say what became of the sorted
+result set, as one of the C<Net::Z3950::SortResultSetStatus::*>
+constants C<Empty>, C<Interim>, C<Unchanged> and C<None>.
+C<diagnostics()>, if present, is a C<Net::Z3950::APDU::DiagRecs>.)
+
+=cut
+
+package Net::Z3950::APDU::SortResponse;
+use vars qw(@ISA @FIELDS);
+@ISA = qw(Net::Z3950::APDU);
+@FIELDS = qw(referenceId sortStatus resultSetStatus resultCount diagnostics);
+sub _fields { @FIELDS };
+
+
+=head2 Net::Z3950::APDU::Segment
+
+	referenceId()
+	numberOfRecordsReturned()
+	segmentRecords()
+	streamed()
+
+(Some of the records of a present response, sent ahead of it under
+segmentation.  C<segmentRecords()> is a
+C<Net::Z3950::APDU::NamePlusRecordList>, some of whose elements may
+be fragments of records; or, when the connection's C<streamRecords>
+option is set, C<streamed()> is the number of records passed to the
+result set instead.)
+
+=cut
+
+package Net::Z3950::APDU::Segment;
+use vars qw(@ISA @FIELDS);
+@ISA = qw(Net::Z3950::APDU);
+@FIELDS = qw(referenceId numberOfRecordsReturned segmentRecords streamed);
+sub _fields { @FIELDS };
+
+
 =head2 Net::Z3950::APDU::Close
 
 	referenceId()
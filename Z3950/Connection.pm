@@ -3,7 +3,8 @@
 package Net::Z3950::Connection;
 use IO::Handle;
 use Event;
-use Errno qw(ECONNREFUSED);
+use Errno qw(ETIMEDOUT);
+use Scalar::Util qw(weaken);
 use strict;
 
 
@@ -71,14 +72,20 @@ the manager structure.)  If the connection is asynchronous, then the
 new object is created and returned before the connection is forged;
 this will happen in parallel with subsequent actions.
 
-I<This is a lie: connecting is always done synchronously.>
+If the C<asyncResolve> option is set, the server's hostname is
+looked up in the background too, so that a slow nameserver does not
+hold up other connections.
 
 If a connection cannot be forged, then C<$!> contains an error code
 indicating what went wrong: this may be one of the usual system error
 codes such as ECONNREFUSED (if there is no server running at the
-specified address); alternatively, it may be set to the distinguished
-value -1 if the TCP/IP connection was correctly forged, but the Z39.50
-C<Init> failed.
+specified address) or ETIMEDOUT (if the C<connectTimeout> option is
+set and the connection took longer than that); alternatively, it may
+be set to the distinguished value -1 if the TCP/IP connection was
+correctly forged, but the Z39.50 C<Init> failed.  For an asynchronous
+connection, such a failure is reported when the manager's C<wait()>
+method returns the connection with its C<op()> set to
+C<Net::Z3950::Op::Error>, and C<addinfo()> describing the problem.
 
 Any of the standard options (including asynchronous
 mode) may be specified as additional arguments.  Specifically:
@@ -91,6 +98,7 @@ Works as expected.
 
 # PRIVATE to the new() method
 use vars qw($_default_manager);
+use vars qw(%_resolving %_resolveWatcher); # see _start_resolve()
 
 sub new {
     my $class = shift();
@@ -130,32 +138,104 @@ sub new {
 	resultSets => [],
 	options => { @_ },
 	refId2cb => {},		# maps reference IDs to callback functions
+	inbox => [],		# decoded APDUs not yet dispatched
+	held => [],		# refIds of requests queued but not released
+	wire => [],		# refIds of requests released, oldest first
+	inflight => {},		# maps refIds of unanswered requests to counts
+	ninflight => 0,		# total number of unanswered requests
+	deadlines => {},	# maps refIds to lists of request timers
+	expired => {},		# maps refIds of timed-out requests to counts
+	expiredHeld => {},	# and of those among them not yet released
     }, $class;
 
-    ###	It would be nice if we could find a way to do the DNS lookups
-    #	asynchronously, but even the major web browsers don't do it,
-    #	so either (A) it's hard, or (B) they're lazy.  Oh, or (C) of
-    #	course.
-    #
-    my $cs = Net::Z3950::yaz_connect($addr)
-	or return undef;	# caller should consult $!
+    # Re-use an idle session to the same server with the same
+    # credentials if the manager has one, saving the Init round trip
+    my $session;
+    if ($this->option('poolConnections')) {
+	$this->{poolKey} = $this->_pool_key();
+	$session = $mgr->_checkout($this->{poolKey});
+    }
 
-    $this->{cs} = $cs;
-    my $fd = Net::Z3950::yaz_socket($cs);
-    my $sock = new_from_fd IO::Handle($fd, "r+")
-	or die "can't make IO::Handle out of file descriptor";
-    $this->{sock} = $sock;
+    if (defined $session) {
+	$this->_adopt($session);
+	# Replay the session's Init response as though it had just arrived
+	my $apdu = $this->{initResponse};
+	push @{ $this->{inbox} }, bless { %$apdu, replayed => 1 }, ref $apdu;
+	$this->{drainWatcher}->start();
+    } else {
+	$this->_open($addr)
+	    or return undef;	# caller should consult $!
+    }
+
+    $this->{refId2cb}->{'init'} = $cb if defined $cb;
+    $mgr->_register($this);
 
-    $this->{readWatcher}  = Event->io(fd => $sock, poll => 'r', data => $this,
-    				cb => \&_ready_to_read)
-	or die "can't make read-watcher on socket to $addr";
+    if (!$this->option('async')) {
+	if (!$this->expect(Net::Z3950::Op::Init, "init")) {
+	    # e.g. ECONNREFUSED: keep $! from being clobbered by close()
+	    my $errno = $!;
+	    $this->close();
+	    $! = $errno;
+	    return undef;
+	}
 
-    $this->{writeWatcher} = Event->io(fd => $sock, poll => 'w', data => $this,
-				      parked => 1, cb => \&_ready_to_write)
-	or die "can't make write-watcher on socket to $addr";
+	if (!$this->initResponse()->result()) {
+	    warn "checking initResponse";
+	    $this->close();
+	    $! = -1;		# special errno value => init failed
+	    return undef;
+	}
+    }
+
+    return $this;
+}
+
+
+# PRIVATE to the new() method
+#
+# Sets up a new session: starts connecting to $addr, and queues the
+# Init request to be sent when the connection is forged.  Returns 1
+# on success; otherwise, sets $! and returns undef.
+#
+sub _open {
+    my $this = shift();
+    my($addr) = @_;
+    my $host = $this->{host};
+
+    $this->{ctx} = Net::Z3950::contextCreate()
+	or die "can't create encoder context for $addr";
+
+    # Hostnames are looked up in the background, so that a slow
+    # nameserver doesn't hold up every other connection; we connect
+    # when the lookup completes.  Numeric addresses, Unix-domain
+    # sockets and addresses in any scheme but plain TCP -- such as
+    # "ssl:" or "unix:", or an IPv6 literal -- are left to YAZ.
+    my $name;
+    if ($this->option('asyncResolve') && $host ne 'unix' &&
+	$host =~ /^(?:tcp:)?([^:\[\]\/]+)$/ && ($name = $1) !~ /^[\d.]+$/ &&
+	(my $id = _start_resolve($name, $this->{mgr}->_events()))) {
+	$_resolving{$id} = $this;
+	$this->{resolving} = $id;
+    } elsif (!$this->_connect($addr)) {
+	my $errno = $!;
+	Net::Z3950::contextDestroy(delete $this->{ctx});
+	$! = $errno;
+	return undef;
+    }
+
+    my $events = $this->{mgr}->_events();
+    my $timeout = $this->option('connectTimeout');
+    $this->{connectTimer} = $events->timer(after => $timeout, data => $this,
+					 cb => \&_connect_timed_out)
+	if $timeout;
+
+    # Deliver APDUs left over from a read that yielded more than one
+    $this->{drainWatcher} = $events->idle(data => $this, repeat => 1, parked => 1,
+					cb => \&_drain)
+	or die "can't make drain-watcher on socket to $addr";
 
     # Arrange to have result-sets on this connection ask for extra records
-    $this->{idleWatcher} = Event->idle(data => $this, repeat => 1, parked => 1,
+    $this->{idleWatcher} = $events->idle(data => $this, repeat => 1, parked => 1,
 				       cb => \&Net::Z3950::ResultSet::_idle)
 	or die "can't make idle-watcher on socket to $addr";
 
@@ -170,41 +250,235 @@ sub new {
     $pass = $this->option('password') if !defined $pass;
     my $group = $this->option('group');
     $group = $this->option('groupid') if !defined $group;
-    my $ir = Net::Z3950::makeInitRequest('init',
-				    $this->option('preferredMessageSize'),
-				    $this->option('maximumRecordSize'),
-				    $this->option('user'),
-				    $pass,
-				    $group,
-				    $this->option('implementationId'),
-				    $this->option('implementationName'),
-				    $this->option('implementationVersion'),
-				    $this->option('charset'),
-				    $this->option('language'),
-				    $errmsg);
-    die "can't make init request: $errmsg" if !defined $ir;
-
-    $this->_enqueue($ir);
-    $this->{refId2cb}->{'init'} = $cb if defined $cb;
-    $mgr->_register($this);
+    Net::Z3950::makeInitRequest($this->{ctx}, 'init',
+				$this->option('preferredMessageSize'),
+				$this->option('maximumRecordSize'),
+				$this->option('user'),
+				$pass,
+				$group,
+				$this->option('implementationId'),
+				$this->option('implementationName'),
+				$this->option('implementationVersion'),
+				$this->option('charset'),
+				$this->option('language'),
+				$errmsg)
+	or die "can't make init request: $errmsg";
+
+    $this->_enqueue('init');
+    return 1;
+}
 
-    if (!$this->option('async')) {
-	$this->expect(Net::Z3950::Op::Init, "init")
-	    or return undef;	# e.g. ECONNREFUSED
 
-	if (!$this->initResponse()->result()) {
-	    warn "checking initResponse";
-	    # Avoid having too many references hanging around, or we
-	    # end up closing the file twice, as various destructors
-	    # are called, and $! gets set to EBADF.
-	    undef $sock;
-	    $this->close();
-	    $! = -1;		# special errno value => init failed
-	    return undef;
+# PRIVATE to the new() method
+#
+# Returns the key under which sessions that can be shared with this
+# connection are pooled: they must be to the same server, and have
+# been initialised with the same credentials and character set, and
+# with the same message sizes and implementation details, since the
+# server may have negotiated any of these differently.
+#
+sub _pool_key {
+    my $this = shift();
+
+    return join("\0", $this->{host}, $this->{port}, $this->_credentials(),
+		map { defined $_ ? $_ : "" }
+		map { $this->option($_) } qw(preferredMessageSize
+					     maximumRecordSize
+					     implementationId
+					     implementationName
+					     implementationVersion));
+}
+
+
+# PRIVATE to the _pool_key() and _search_key() methods
+#
+# Returns the user, password, group, character set and language that
+# the connection's Init request carries, with "" for those not set.
+#
+sub _credentials {
+    my $this = shift();
+
+    my $pass = $this->option('pass');
+    $pass = $this->option('password') if !defined $pass;
+    my $group = $this->option('group');
+    $group = $this->option('groupid') if !defined $group;
+    return map { defined $_ ? $_ : "" } ($this->option('user'),
+					 $pass, $group,
+					 $this->option('charset'),
+					 $this->option('language'));
+}
+
+
+# PRIVATE to the new() and close() methods
+#
+# Takes over the session -- socket, encoder context, watchers and Init
+# response -- of the connection $from, which is left closed.
+#
+sub _adopt {
+    my $this = shift();
+    my($from) = @_;
+
+    foreach my $key (qw(cs ctx sock readWatcher writeWatcher drainWatcher
+			idleWatcher initResponse connected poolKey)) {
+	$this->{$key} = $from->{$key};
+    }
+    foreach my $key (qw(readWatcher writeWatcher drainWatcher idleWatcher)) {
+	$this->{$key}->data($this);
+    }
+
+    %$from = ();
+    $from->{closed} = 1;
+}
+
+
+# PRIVATE to the close() method
+#
+# A connection's session may be kept for re-use only if it was
+# successfully initialised and has nothing still going on.
+#
+sub _poolable {
+    my $this = shift();
+
+    return 0 if !$this->option('poolConnections') || $this->{retired};
+    return 0 if !$this->{connected} || $this->{failed};
+    return 0 if !defined $this->{initResponse} ||
+	!$this->{initResponse}->result();
+    return 0 if $this->{ninflight} || @{ $this->{held} } ||
+	@{ $this->{inbox} };
+    # A late response would reach the session's next user
+    return 0 if %{ $this->{expired} };
+    return 1;
+}
+
+
+# PRIVATE to the new() method and the _resolved() function
+#
+# Creates the connection's socket and starts connecting it to $addr,
+# without waiting for the connection to be forged.  Returns 1 on
+# success; otherwise, sets $! and returns undef.
+#
+sub _connect {
+    my $this = shift();
+    my($addr) = @_;
+
+    my $cs = Net::Z3950::yaz_connect($addr)
+	or return undef;
+
+    $this->{cs} = $cs;
+    Net::Z3950::decodeStream($cs, $this->_stream_callback());
+    my $fd = Net::Z3950::yaz_socket($cs);
+    my $sock = new_from_fd IO::Handle($fd, "r+")
+	or die "can't make IO::Handle out of file descriptor";
+    $this->{sock} = $sock;
+
+    my $events = $this->{mgr}->_events();
+    if (ref $events) {
+	# The native loop reads, decodes and writes by itself
+	($this->{readWatcher}, $this->{writeWatcher}) =
+	    $events->conn($cs, $this->{ctx}, $this->_decodeFlags(), $this);
+    } else {
+	$this->{readWatcher}  = Event->io(fd => $sock, poll => 'r', data => $this,
+					  cb => \&_ready_to_read)
+	    or die "can't make read-watcher on socket to $addr";
+
+	$this->{writeWatcher} = Event->io(fd => $sock, poll => 'w', data => $this,
+					  parked => 1, cb => \&_ready_to_write)
+	    or die "can't make write-watcher on socket to $addr";
+    }
+
+    # Requests may have been released while the name was being looked up
+    $this->{writeWatcher}->start()
+	if Net::Z3950::contextPending($this->{ctx});
+    return 1;
+}
+
+
+# PRIVATE to the new() method
+#
+# Starts looking up $host in the background, returning an identifier
+# for the lookup, or 0 if it couldn't be started (in which case the
+# caller should fall back to looking it up synchronously).  A single
+# watcher in each event loop, shared by all connections, hears about
+# completed lookups.
+#
+sub _start_resolve {
+    my($host, $events) = @_;
+
+    if (!defined $_resolveWatcher{$events}) {
+	my $fd = Net::Z3950::resolverFd();
+	return 0 if $fd < 0;
+	$_resolveWatcher{$events} = $events->io(fd => $fd, poll => 'r',
+						 cb => \&_resolved)
+	    or die "can't make watcher for resolver";
+    }
+
+    return Net::Z3950::resolveStart($host);
+}
+
+
+# PRIVATE to the _start_resolve() function, invoked as an Event->io
+# callback when one or more lookups have completed.  Lookups for
+# connections that have since been closed are ignored.
+#
+sub _resolved {
+    while (my $res = Net::Z3950::resolveNext()) {
+	my($id, $ip, $errmsg) = @$res;
+	my $conn = delete $_resolving{$id}
+	    or next;
+	delete $conn->{resolving};
+	my $addr = $conn->{host} . ":" . $conn->{port};
+	$ip = "[$ip]" if defined $ip && $ip =~ /:/; # IPv6, as YAZ wants it
+	if (!defined $ip) {
+	    $conn->_fail("can't resolve $addr: $errmsg");
+	} elsif (!$conn->_connect("$ip:$conn->{port}")) {
+	    $conn->_fail("can't connect to $addr: $!");
 	}
     }
+}
 
-    return $this;
+
+# PRIVATE to the new() method, invoked as an Event->timer callback
+sub _connect_timed_out {
+    my($event) = @_;
+    my $conn = $event->w()->data();
+    my $addr = $conn->{host} . ":" . $conn->{port};
+
+    $! = ETIMEDOUT;
+    $conn->_fail("timed out connecting to $addr");
+}
+
+
+# PRIVATE to the connection-forging functions above and below
+#
+# Abandons a connection that could not be forged, and reports this as
+# an error on the connection -- so that wait() returns it with op()
+# set to Net::Z3950::Op::Error -- rather than ending the wait() with
+# no connection, which would leave other connections' callers unable
+# to tell which of them had failed.  $! is left as it was.
+#
+sub _fail {
+    my $this = shift();
+    my($addinfo) = @_;
+
+    foreach my $name (qw(connectTimer readWatcher writeWatcher)) {
+	my $watcher = delete $this->{$name};
+	$watcher->cancel() if defined $watcher;
+    }
+    delete $_resolving{delete $this->{resolving}}
+	if defined $this->{resolving};
+    $this->_cancel_deadlines();
+
+    # Don't hold the socket open until the application gets round to
+    # closing the connection
+    Net::Z3950::yaz_close(delete $this->{cs}) if defined $this->{cs};
+    delete $this->{sock};
+
+    $this->{op} = Net::Z3950::Op::Error;
+    $this->{errcode} = 100;	# "Unknown error" is all BIB-1 offers
+    $this->{addinfo} = $addinfo;
+    $this->{errop} = Net::Z3950::Op::Init;
+    $this->{failed} = 1;
+    $this->{mgr}->_unloop($this);
 }
 
 
@@ -214,37 +488,54 @@ sub new {
 # reading of the rather opaque source code, it appears that the return
 # value of callbacks such as this one is ignored.
 #
+# A single readable event may deliver several complete APDUs if the
+# server is answering pipelined requests, so we decode all of them at
+# once and then dispatch them in order from the connection's inbox.
+#
 sub _ready_to_read {
     my($event) = @_;
     my $watcher = $event->w();
     my $conn = $watcher->data();
-    my $addr = $conn->{host} . ":" . $conn->{port};
 
     my $reason = 0;		# We need to give $reason a value to
 				# avoid a spurious "uninitialized"
 				# warning on the next line, even
 				# though $result is a pure-result
-				# parameter to decodeAPDU()
-    my $apdu = Net::Z3950::decodeAPDU($conn->{cs}, $reason);
-    if (defined $apdu) {
-	my $refId = $conn->_dispatch($apdu, $watcher);
-	if (!defined $refId) {
-	    # Unrecognised APDU -- nothing useful to do here, unless
-	    # we think die()ing might be helpful?
-	    return;
-	}
+				# parameter to decodeAPDUs()
+    my $apdus = Net::Z3950::decodeAPDUs($conn->{cs}, $conn->_decodeFlags(),
+					$reason);
+    $conn->_handle_read($apdus, $reason);
+}
 
-	my $cb = $conn->{refId2cb}->{$refId};
-	#warn ref($apdu). ": refId='$refId', cb='$cb'";
-	if (defined $cb) {
-	    # Application-level callback provided by caller
-	    &$cb($conn, $apdu);
-	} else {
-	    Event::unloop($conn);
-	}
+
+# PRIVATE to the _ready_to_read() function and the native event loop
+#
+# Deals with the result of decoding what was read from the socket:
+# $apdus and $reason are as returned from decodeAPDUs().
+#
+sub _handle_read {
+    my $conn = shift();
+    my($apdus, $reason) = @_;
+    my $watcher = $conn->{readWatcher};
+    my $addr = $conn->{host} . ":" . $conn->{port};
+
+    if ($conn->{pooled}) {
+	# Nothing but a Close or EOF should arrive on an idle session
+	$conn->{mgr}->_retire($conn);
 	return;
     }
 
+    if (defined $apdus) {
+	my $error = delete $conn->{streamError}; # see _streamed()
+	push @{ $conn->{inbox} }, @$apdus;
+	$conn->_drain_inbox();
+	die $error if defined $error;
+	# A callback may have closed the connection under our feet
+	return if $conn->{closed};
+	return if $reason == 0 || $reason == Net::Z3950::Reason::Incomplete;
+	# Otherwise, something went wrong after the APDUs we did get
+    }
+
     if ($reason == Net::Z3950::Reason::EOF) {
 	$conn->{errcode} = 100; # "Unknown error" is pathetic
 	$conn->{addinfo} = "server $addr rudely closed connection";
@@ -268,13 +559,17 @@ sub _ready_to_read {
 
     } elsif ($reason == Net::Z3950::Reason::BadAPDU) {
 	# This just means that although the APDU was well-formed, it's
-	# not one that we unrecognise -- for example, a Segment
-	# request.  It's tempting to paper over the crack, but I think
+	# not one that we unrecognise -- for example, a Resource
+	# Control request.  It's tempting to paper over the crack, but I think
 	# the honest thing to do at this point is croak.
 	$conn->{errcode} = 100; # "Unknown error" is a bit feeble
 	$conn->{addinfo} = "got APDU of unsupported type";
 	$watcher->cancel();
 
+    } elsif ($reason == Net::Z3950::Reason::Error && !$conn->{connected}) {
+	# A failed non-blocking connect may show up as readable
+	$conn->_fail("can't connect to $addr: $!");
+
     } elsif ($reason == Net::Z3950::Reason::Error) {
 	$watcher->cancel();
 	die "[$addr] system error ($!)\n";
@@ -287,6 +582,180 @@ sub _ready_to_read {
 
 
 # PRIVATE to the _ready_to_read() function
+sub _decodeFlags {
+    my $this = shift();
+
+    my $flags = 0;
+    $flags |= Net::Z3950::DecodeFlags::Lazy if $this->option('lazyRecords');
+    $flags |= Net::Z3950::DecodeFlags::Shared
+	if $this->option('sharedRecords');
+    $flags |= Net::Z3950::DecodeFlags::Stream
+	if $this->option('streamRecords');
+    return $flags;
+}
+
+
+# PRIVATE to the _connect() method
+#
+# Returns the callback to which the records of present responses are
+# passed as they are decoded, when the streamRecords option is set.
+# It holds only a weak reference to the connection, which the C code
+# would otherwise keep alive for as long as the socket is open.
+#
+sub _stream_callback {
+    my $this = shift();
+
+    my $conn = $this;
+    weaken($conn);
+    return sub { $conn->_streamed(@_) if defined $conn };
+}
+
+
+# PRIVATE to the callback made by _stream_callback(), which is invoked
+# from within decodeAPDUs()
+#
+# Hands $record, the ${i}th record (from zero) of the present response
+# to the request $refId, to its result set, before the rest of the
+# response has been decoded.
+#
+sub _streamed {
+    my $this = shift();
+    my($refId, $i, $record) = @_;
+
+    # The response to a timed-out request is thrown away by _late()
+    return if !defined $refId || $this->{expired}->{$refId};
+    my($which) = split /-/, $refId;
+    my $rs = $this->{resultSets}->[$which]
+	or return;
+
+    # If this dies -- most likely in the recordCallback -- the response
+    # must still be decoded and dispatched, or its request would never
+    # be answered and the records not yet passed never be asked for
+    # again.  So the error is kept for _handle_read() to rethrow once
+    # the response has been delivered.
+    eval { $rs->_stream_record($refId, $i, $record) };
+    $this->{streamError} = $@ if $@ && !defined $this->{streamError};
+}
+
+
+# PRIVATE to the _ready_to_read() function and the drain-watcher
+#
+# Dispatches decoded APDUs from the inbox, in the order they arrived.
+# Those whose requests nominated a callback are handled immediately;
+# but wait() can only report one event per call, so when we reach an
+# APDU that needs to be returned from wait(), we stop there and leave
+# the rest in the inbox for the drain-watcher to deal with when the
+# event loop is next entered.
+#
+sub _drain_inbox {
+    my $this = shift();
+
+    while (my $apdu = shift @{ $this->{inbox} }) {
+	$this->_match($apdu);
+	next if $this->_late($apdu);
+	my $refId = $this->_dispatch($apdu, $this->{readWatcher});
+	if (!defined $refId) {
+	    # Unrecognised APDU, or a segment of a response that's still
+	    # to come -- nothing useful to do here, unless we think
+	    # die()ing might be helpful?
+	    next;
+	}
+	$this->_answered($refId);
+
+	my $cb = $this->{refId2cb}->{$refId};
+	#warn ref($apdu). ": refId='$refId', cb='$cb'";
+	if (defined $cb) {
+	    # Application-level callback provided by caller
+	    &$cb($this, $apdu);
+	    return if $this->{closed};
+	} else {
+	    $this->{drainWatcher}->start() if @{ $this->{inbox} };
+	    $this->{mgr}->_unloop($this);
+	    return;
+	}
+    }
+}
+
+
+# PRIVATE to the _drain_inbox() method
+#
+# Matches $apdu with the request it answers, which is the oldest one
+# still awaiting a response, since responses come back in the order
+# the requests were sent.  Not every server echoes reference IDs --
+# some leave them out of the Init response, or of diagnostics -- so a
+# response whose reference ID is missing, or is not that of any
+# request awaiting a response, is taken to answer the oldest, and is
+# given its reference ID.  This way every response frees its
+# request's place in the window.  Responses replayed from the pool or
+# the search cache answer nothing that was sent.
+#
+sub _match {
+    my $this = shift();
+    my($apdu) = @_;
+
+    my $wire = $this->{wire};
+    return if !@$wire || $apdu->{replayed} ||
+	$apdu->isa('Net::Z3950::APDU::Close');
+
+    my $refId = $apdu->referenceId();
+    my $i = 0;
+    if (defined $refId) {
+	$i++ while $i < @$wire && $wire->[$i] ne $refId;
+    }
+    if ($i == @$wire || !defined $refId) {
+	$i = 0;
+	$apdu->{referenceId} = $wire->[0];
+    }
+
+    # Segments go too, but only the response itself answers the request
+    splice(@$wire, $i, 1) if !$apdu->isa('Net::Z3950::APDU::Segment');
+}
+
+
+# PRIVATE to the _drain_inbox() method
+#
+# Returns true if $apdu is the response to a request that has already
+# timed out, and so should be discarded: it has been reported as an
+# error, and the application may since have made a new request with
+# the same reference ID.  Responses arrive in the order the requests
+# were sent, so the first response with a given reference ID belongs
+# to the oldest request with that ID.  The request's place in the
+# window was given up when it timed out: see _request_timed_out().
+#
+sub _late {
+    my $this = shift();
+    my($apdu) = @_;
+
+    return 0 if $apdu->isa('Net::Z3950::APDU::Close');
+    my $refId = $apdu->referenceId();
+    return 0 if !defined $refId;
+    my $count = $this->{expired}->{$refId}
+	or return 0;
+    # Segments go too, but only the response itself answers the request
+    return 1 if $apdu->isa('Net::Z3950::APDU::Segment');
+
+    if ($count > 1) {
+	$this->{expired}->{$refId} = $count-1;
+    } else {
+	delete $this->{expired}->{$refId};
+    }
+    return 1;
+}
+
+
+# PRIVATE to the new() method, invoked as an Event->idle callback
+sub _drain {
+    my($event) = @_;
+    my $watcher = $event->w();
+    my $conn = $watcher->data();
+
+    # Don't fire again until more APDUs are left over
+    $watcher->stop();
+    $conn->_drain_inbox();
+}
+
+
+# PRIVATE to the _drain_inbox() method
 #
 # Return referenceId of returned APDU or undef if unsupported.
 #
@@ -306,19 +775,35 @@ sub _dispatch {
     } elsif ($apdu->isa('Net::Z3950::APDU::InitResponse')) {
 	$this->{op} = Net::Z3950::Op::Init;
 	$this->{initResponse} = $apdu;
-	return $apdu->referenceId();
+	# A replayed Init response may lack the reference ID: see _match()
+	my $refId = $apdu->referenceId();
+	return defined $refId ? $refId : 'init';
 
     } elsif ($apdu->isa('Net::Z3950::APDU::SearchResponse')) {
-	$this->{op} = Net::Z3950::Op::Search;
-	$this->{searchResponse} = $apdu;
 	my $which = $apdu->referenceId();
 	defined $which or die "no reference Id in search response";
-	my $rs = $this->{resultSets}->[$which]
-	    and die "reference to existing result set";
+	my $rs = $this->{resultSets}->[$which];
+	if ($rs && $rs->{researching}) {
+	    # Not a new search: see _research()
+	    $rs->_researched($apdu);
+	    return $which;
+	}
+	die "reference to existing result set" if $rs;
+
+	$this->{op} = Net::Z3950::Op::Search;
+	$this->{searchResponse} = $apdu;
 	$rs = _new Net::Z3950::ResultSet($this, $which, $apdu);
 	$this->{resultSets}->[$which] = $rs;
+	# Any piggy-backed records are already in $rs's cache
 	$this->{resultSet} = $rs;
-	### Should handle piggy-backed records and NSDs
+	if (my $entry = delete $this->{cachedSearches}->{$which}) {
+	    $rs->_adopt_cached($entry) if $rs;
+	} elsif ($rs && defined(my $key = $this->{searchKeys}->[$which])) {
+	    my $cached = $this->{mgr}->_search_cache_put($key, $apdu,
+					$this->option('searchCacheTTL'),
+					$this->option('searchCacheSize'));
+	    $rs->_snapshot_into($cached->{records});
+	}
 	return $which;
 
     } elsif ($apdu->isa('Net::Z3950::APDU::ScanResponse')) {
@@ -343,6 +828,31 @@ sub _dispatch {
 	$this->{resultSet} = $rs;
 	return $apdu->referenceId();
 
+    } elsif ($apdu->isa('Net::Z3950::APDU::Segment')) {
+	# Part of a present response, which is still to come: so its
+	# records are taken now, but the request is not yet answered
+	my $which = $apdu->referenceId();
+	defined $which or die "no reference Id in segment";
+	$which =~ s/-.*//;
+	my $rs = $this->{resultSets}->[$which]
+	    or die "reference to non-existent result set";
+	$rs->_add_segment($apdu);
+	return undef;
+
+    } elsif ($apdu->isa('Net::Z3950::APDU::SortResponse')) {
+	$this->{op} = Net::Z3950::Op::Sort;
+	$this->{sortResponse} = $apdu;
+	# refId is of the form <rsindex>-sort-<sorted rsindex>
+	my $refId = $apdu->referenceId();
+	defined $refId or die "no reference Id in sort response";
+	my($which, undef, $sorted) = split /-/, $refId;
+	my $rs = $this->{resultSets}->[$which]
+	    or die "reference to non-existent result set";
+	$rs = $rs->_sorted($sorted, $apdu);
+	$this->{resultSets}->[$sorted] = $rs;
+	$this->{resultSet} = $rs;
+	return $refId;
+
     } elsif ($apdu->isa('Net::Z3950::APDU::DeleteRSResponse')) {
 	$this->{op} = Net::Z3950::Op::DeleteRS;
 	$this->{deleteRSResponse} = $apdu;
@@ -367,18 +877,32 @@ sub _ready_to_write {
     my($event) = @_;
     my $watcher = $event->w();
     my $conn = $watcher->data();
-    my $addr = $conn->{host} . ":" . $conn->{port};
 
-    if (!$conn->{queued}) {
+    if (!Net::Z3950::contextPending($conn->{ctx})) {
 	die "Huh?  _ready_to_write() called with nothing queued\n";
     }
 
-    # We bung as much of the data down the socket as we can, and keep
-    # hold of whatever's left.
-    my $nwritten = Net::Z3950::yaz_write($conn->{cs}, $conn->{queued});
-    if ($nwritten < 0 && $! == ECONNREFUSED) {
-	$conn->_destroy();
-	Event::unloop(undef);
+    # We bung as much of the data down the socket as we can, and the
+    # context keeps hold of whatever's left.
+    my $nwritten = Net::Z3950::yaz_write($conn->{cs}, $conn->{ctx});
+    $conn->_handle_write($nwritten);
+}
+
+
+# PRIVATE to the _ready_to_write() function and the native event loop
+#
+# Deals with the result of writing $nwritten bytes to the socket, or
+# with the error if $nwritten is negative.
+#
+sub _handle_write {
+    my $conn = shift();
+    my($nwritten) = @_;
+    my $watcher = $conn->{writeWatcher};
+    my $addr = $conn->{host} . ":" . $conn->{port};
+
+    if ($nwritten < 0 && !$conn->{connected}) {
+	# Typically ECONNREFUSED from a failed non-blocking connect
+	$conn->_fail("can't connect to $addr: $!");
 	return;
     } elsif ($nwritten < 0) {
 	$watcher->cancel();
@@ -390,26 +914,43 @@ sub _ready_to_write {
 	die "[$addr] write zero bytes (shouldn't happen): never mind\n";
     }
 
-    $conn->{queued} = substr($conn->{queued}, $nwritten);
-    if (!$conn->{queued}) {
+    if (!$conn->{connected}) {
+	# The first successful write means the connection is forged
+	$conn->{connected} = 1;
+	my $timer = delete $conn->{connectTimer};
+	$timer->cancel() if defined $timer;
+    }
+
+    if (!Net::Z3950::contextPending($conn->{ctx})) {
 	# Don't bother me with select() hits when we have nothing to write
 	$watcher->stop();
     }
 }
 
 
-# PRIVATE to the _ready_to_write() function.
+# PRIVATE to the _say_goodbye() method and the ResultSet class's
+# _read_ahead() method
 #
-# Destroys a connection object when it turns out that the connection
-# didn't get forged after all (yaz_write() fails with ECONNREFUSED,
-# indicating a failed asynchronous connection.)
+# Writes as much of the outgoing queue as the socket will take right
+# now, rather than waiting until the event loop is next entered and
+# notices that the socket is writable.  Returns what yaz_write()
+# does, or 0 if there was nothing to write: a negative number means
+# an error, with $! set, which the write-watcher will also find and
+# report in the usual way if the caller leaves it to.
 #
-sub _destroy {
+sub _flush {
     my $this = shift();
 
-    # Do nothing for now: I'm not sure that this is the right thing.
+    return 0 if !defined $this->{cs} ||
+	!Net::Z3950::contextPending($this->{ctx});
+    my $nwritten = Net::Z3950::yaz_write($this->{cs}, $this->{ctx});
+    $this->{writeWatcher}->stop()
+	if $nwritten > 0 && !Net::Z3950::contextPending($this->{ctx});
+    return $nwritten;
 }
 
+
+
 =head2 option()
 
 	$value = $conn->option($type);
@@ -542,25 +1083,37 @@ sub startSearch {
     my $queryType = $_queryTypes{$type};
     die "undefined query type '$type'" if !defined $queryType;
 
-    # Generate the SEARCH request and queue it up for subsequent dispatch
+    # A fresh copy of the same search's response may be in the
+    # manager's search cache, in which case there's no need to ask
     my $rss = $this->{resultSets};
     my $nrss = @$rss;
-    my $errmsg = '';
-    my $sr = Net::Z3950::makeSearchRequest($nrss,
-				      $this->option('smallSetUpperBound'),
-				      $this->option('largeSetLowerBound'),
-				      $this->option('mediumSetPresentNumber'),
-				      $this->option('namedResultSets') ?
-					$nrss : 'default', # result-set name
-				      $this->option('databaseName'),
-				      $this->option('smallSetElementSetName'),
-				      $this->option('mediumSetElementSetName'),
-				      $this->preferredRecordSyntax(),
-				      $queryType, $value, $errmsg);
-    die "can't make search request: $errmsg" if !defined $sr;
     $rss->[$nrss] = 0;		# placeholder
+    $this->{searches}->[$nrss] = [ $queryType, $value ];
+    my $ttl = $this->option('searchCacheTTL');
+    my $entry;
+    if ($ttl) {
+	my $key = $this->_search_key($queryType, $value);
+	$entry = $this->{mgr}->_search_cache_get($key);
+	$this->{searchKeys}->[$nrss] = $key if !defined $entry;
+    }
 
-    $this->_enqueue($sr);
+    if (defined $entry) {
+	# Replay the cached response as though it had just arrived --
+	# but without its piggy-backed records, which may not be in the
+	# record syntax and element set now wanted.  Those are in the
+	# entry's record caches, under the right keys, for
+	# _adopt_cached() to copy.
+	my $apdu = $entry->{searchResponse};
+	push @{ $this->{inbox} }, bless { %$apdu, referenceId => $nrss,
+					 numberOfRecordsReturned => 0,
+					 records => undef,
+					 replayed => 1 }, ref $apdu;
+	$this->{cachedSearches}->{$nrss} = $entry;
+	$this->{drainWatcher}->start();
+    } else {
+	# Generate the SEARCH request and queue it up for dispatch
+	$this->_send_searchRequest($nrss, 1);
+    }
 
     # Callback for asynchronous notification
     my $cb = shift();
@@ -569,6 +1122,90 @@ sub startSearch {
 }
 
 
+# PRIVATE to the startSearch() and _research() methods
+#
+# Sends the search recorded for result set $nrss.  Records are
+# piggy-backed on the response only if $piggyback is true.
+#
+sub _send_searchRequest {
+    my $this = shift();
+    my($nrss, $piggyback) = @_;
+
+    my($queryType, $value) = @{ $this->{searches}->[$nrss] };
+    my $errmsg = '';
+    Net::Z3950::makeSearchRequest($this->{ctx},
+				  $this->{mgr}->_query_cache(), $nrss,
+				  $piggyback ?
+				    ($this->option('smallSetUpperBound'),
+				     $this->option('largeSetLowerBound'),
+				     $this->option('mediumSetPresentNumber')) :
+				    (0, 1, 0),
+				  $this->option('namedResultSets') ?
+				    $nrss : 'default', # result-set name
+				  $this->option('databaseName'),
+				  $this->option('smallSetElementSetName'),
+				  $this->option('mediumSetElementSetName'),
+				  $this->preferredRecordSyntax(),
+				  $queryType, $value, $errmsg)
+	or die "can't make search request: $errmsg";
+
+    $this->_enqueue($nrss);
+}
+
+
+# PRIVATE to the startSearch() method
+#
+# Returns the key under which the search for the query $value, of
+# type $queryType, is kept in the manager's search cache.  The server
+# may show different users different records, so the credentials and
+# character set of the Init are part of the key, as are the record
+# syntax and element sets in which records are piggy-backed; runs of
+# white space in the query are insignificant.
+#
+sub _search_key {
+    my $this = shift();
+    my($queryType, $value) = @_;
+
+    (my $query = $value) =~ s/\s+/ /g;
+    $query =~ s/^ //;
+    $query =~ s/ $//;
+    return join("\0", lc($this->{host}), $this->{port},
+		$this->_credentials(),
+		$this->option('databaseName'),
+		$this->preferredRecordSyntax(),
+		map({ lc $this->option($_) } qw(smallSetElementSetName
+						mediumSetElementSetName)),
+		$queryType, $query);
+}
+
+
+# PRIVATE to the Net::Z3950::ResultSet class's _checkRequired1() method
+#
+# The result set $nrss was created from a cached Search response, so
+# the server has never heard of it: search again, without piggy-backed
+# records, so that the records that weren't cached can be fetched.
+# The response is consumed by _dispatch() and not reported as an
+# event.
+#
+sub _research {
+    my $this = shift();
+    my($nrss) = @_;
+
+    $this->_send_searchRequest($nrss, 0);
+    $this->{refId2cb}->{$nrss} = \&_researched;
+}
+
+
+# PRIVATE to the _research() method, invoked as a refId2cb callback
+sub _researched {
+    my($conn, $apdu) = @_;
+
+    # _dispatch() or _request_timed_out() has already told the result
+    # set, and there's no event for the application
+    delete $conn->{refId2cb}->{$apdu->referenceId()} if defined $apdu;
+}
+
+
 =head2 startScan()
 
 	$conn->startScan($scan);
@@ -610,17 +1247,18 @@ sub startScan {
 
     # Generate the SCAN request and queue it up for subsequent dispatch
     my $errmsg = '';
-    my $sr = Net::Z3950::makeScanRequest("scan",
-					 $this->option('databaseName'),
-					 $this->option('stepSize'),
-					 $this->option('numberOfEntries'),
-					 $this->option('responsePosition'),
-					 $queryType,
-					 $value,
-					 $errmsg);
-    die "can't make scan request: $errmsg" if !defined $sr;
-
-    $this->_enqueue($sr);
+    Net::Z3950::makeScanRequest($this->{ctx},
+				$this->{mgr}->_query_cache(), "scan",
+				$this->option('databaseName'),
+				$this->option('stepSize'),
+				$this->option('numberOfEntries'),
+				$this->option('responsePosition'),
+				$queryType,
+				$value,
+				$errmsg)
+	or die "can't make scan request: $errmsg";
+
+    $this->_enqueue("scan");
 
     # Callback for asynchronous notification
     my $cb = shift();
@@ -646,13 +1284,280 @@ sub preferredRecordSyntax {
 }
 
 
-# PRIVATE to the new(), startSearch() and startScan() methods
+# PRIVATE to the new(), startSearch() and startScan() methods, and
+# to ResultSet.pm.  The request whose reference ID is $refId has
+# already been encoded onto the end of the connection's outgoing queue
+# by one of the make*Request() functions, where it's held until the
+# pipelining window has room for it.
+#
 sub _enqueue {
     my $this = shift();
-    my($msg) = @_;
+    my($refId) = @_;
+
+    push @{ $this->{held} }, $refId;
+    my $timeout = $this->option('requestTimeout');
+    push @{ $this->{deadlines}->{$refId} },
+	$this->{mgr}->_events()->timer(after => $timeout,
+				       data => [ $this, $refId ],
+				       cb => \&_request_timed_out)
+	if $timeout;
+    $this->_release();
+}
+
+
+# PRIVATE to the _enqueue() and _answered() methods
+#
+# Releases held requests to be written, in the order they were made,
+# for as long as there are fewer than the window's worth of requests
+# awaiting responses.  A request that timed out while it was held is
+# written all the same, since it can't be taken back out of the
+# queue, but takes no place in the window.
+#
+sub _release {
+    my $this = shift();
+
+    my $window = $this->_window();
+    my $released = 0;
+    while (@{ $this->{held} } && $this->{ninflight} < $window) {
+	my $refId = shift @{ $this->{held} };
+	Net::Z3950::contextRelease($this->{ctx})
+	    or die "Huh?  request '$refId' was not in the queue\n";
+	$released = 1;
+	push @{ $this->{wire} }, $refId;
+	my $expired = $this->{expiredHeld}->{$refId};
+	if ($expired) {
+	    if ($expired > 1) {
+		$this->{expiredHeld}->{$refId} = $expired-1;
+	    } else {
+		delete $this->{expiredHeld}->{$refId};
+	    }
+	    next;
+	}
+	$this->{inflight}->{$refId}++;
+	$this->{ninflight}++;
+    }
+
+    # Not if we're still waiting to find out where to connect to
+    $this->{writeWatcher}->start() if $released && $this->{writeWatcher};
+}
+
+
+# PRIVATE to the _release() method
+#
+# Returns the number of requests that may be awaiting responses at
+# once.  Nothing may follow the Init request until it's been answered,
+# and servers that can't cope with pipelined requests must be spoken
+# to in strict lockstep.
+#
+sub _window {
+    my $this = shift();
+
+    return 1 if !defined $this->{initResponse};
+    return 1 if !$this->option('pipelining');
+    my $max = $this->option('maxOutstanding');
+    return $max < 1 ? 1 : $max;
+}
+
+
+# PRIVATE to the _drain_inbox() method and _request_timed_out()
+#
+# Notes that the request whose reference ID is $refId has been
+# answered, making room in the window for another, and stops its
+# timer -- unless $late, in which case the timer has already gone off
+# and there will be no answer.  Responses to requests we don't know
+# about are ignored.
+#
+sub _answered {
+    my $this = shift();
+    my($refId, $late) = @_;
 
-    $this->{queued} .= $msg;
-    $this->{writeWatcher}->start();
+    if (!$late && (my $deadlines = $this->{deadlines}->{$refId})) {
+	my $timer = shift @$deadlines;
+	$timer->cancel() if defined $timer;
+	delete $this->{deadlines}->{$refId} if !@$deadlines;
+    }
+
+    my $count = $this->{inflight}->{$refId}
+	or return;
+    if ($count > 1) {
+	$this->{inflight}->{$refId} = $count-1;
+    } else {
+	delete $this->{inflight}->{$refId};
+    }
+    $this->{ninflight}--;
+    $this->_release();
+}
+
+
+# PRIVATE to the _enqueue() method, invoked as an Event->timer callback
+#
+# The request whose reference ID is $refId has had no response within
+# the requestTimeout: report this as an error on that operation alone,
+# as though the server had failed it, and arrange to discard the
+# response if it ever arrives.  Depending on the requestTimeoutAction
+# option, the connection may also be dropped.
+#
+sub _request_timed_out {
+    my($event) = @_;
+    my $timer = $event->w();
+    my($conn, $refId) = @{ $timer->data() };
+    my $addr = $conn->{host} . ":" . $conn->{port};
+    my $timeout = $conn->option('requestTimeout');
+
+    my $deadlines = $conn->{deadlines}->{$refId};
+    @$deadlines = grep { $_ != $timer } @$deadlines;
+    delete $conn->{deadlines}->{$refId} if !@$deadlines;
+    $timer->cancel();
+
+    if ($refId eq 'init') {
+	# A connection that hasn't been initialised is no use to anyone
+	$! = ETIMEDOUT;
+	$conn->_fail("timed out waiting for init response from $addr");
+	return;
+    }
+
+    # The response, if it ever comes, will be discarded by _late(); but
+    # the request gives up its place in the window now, so that a
+    # server that has stopped answering doesn't hold back all the
+    # requests after it.  Requests are released in the order they were
+    # made, so if any with this reference ID is in flight, the oldest
+    # -- the one timed out -- is.
+    $conn->{expired}->{$refId}++;
+    if ($conn->{inflight}->{$refId}) {
+	$conn->_answered($refId, 1);
+    } else {
+	$conn->{expiredHeld}->{$refId}++;
+    }
+    my $op = _refId_op($refId);
+    if ($op == Net::Z3950::Op::Get) {
+	# Let the records be asked for again
+	(my $which = $refId) =~ s/-.*//;
+	my $rs = $conn->{resultSets}->[$which];
+	$rs->_expire_records($refId) if ref $rs;
+    } elsif ($op == Net::Z3950::Op::Search) {
+	# A result set's second search is retried when next needed
+	my $rs = $conn->{resultSets}->[$refId];
+	$rs->_researched(undef) if ref $rs;
+    }
+
+    my $addinfo = "no response from $addr within $timeout seconds";
+    my $action = $conn->option('requestTimeoutAction');
+    if ($action eq 'close' || $action eq 'abandon') {
+	my $errmsg = $conn->_abandon($action eq 'close');
+	$addinfo .= "; $errmsg" if defined $errmsg;
+    } elsif ($action ne 'error') {
+	die "unknown requestTimeoutAction '$action'\n";
+    }
+
+    $conn->{op} = Net::Z3950::Op::Error;
+    $conn->{errcode} = 100;	# BIB-1 has nothing better
+    $conn->{addinfo} = $addinfo;
+    $conn->{errop} = $op;
+
+    my $cb = delete $conn->{refId2cb}->{$refId};
+    if (defined $cb) {
+	&$cb($conn, undef);
+    } else {
+	$conn->{mgr}->_unloop($conn);
+    }
+}
+
+
+# PRIVATE to the _fail() and close() methods
+sub _cancel_deadlines {
+    my $this = shift();
+
+    my $deadlines = delete $this->{deadlines}
+	or return;
+    foreach my $list (values %$deadlines) {
+	$_->cancel() foreach @$list;
+    }
+    $this->{deadlines} = {};
+}
+
+
+# PRIVATE to the _request_timed_out() function
+#
+# Returns the operation that made the request whose reference ID is
+# $refId: see startSearch(), startScan() and the ResultSet class's
+# _bind_refId(), delete() and sort() for how these are formed.
+#
+sub _refId_op {
+    my($refId) = @_;
+
+    return Net::Z3950::Op::Init if $refId eq 'init';
+    return Net::Z3950::Op::Scan if $refId eq 'scan';
+    return Net::Z3950::Op::Search if $refId =~ /^\d+$/;
+    return Net::Z3950::Op::DeleteRS if $refId =~ /-delete-/;
+    return Net::Z3950::Op::Sort if $refId =~ /-sort-/;
+    return Net::Z3950::Op::Get;
+}
+
+
+# PRIVATE to the _request_timed_out() function
+#
+# Drops the connection to the server -- after sending it a Close
+# request, if $sayGoodbye is true -- so that nothing more can arrive
+# on it.  The connection object itself stays around, reporting the
+# error, until the application closes it.  Returns undef, or a message
+# saying why the Close request couldn't be sent.
+#
+sub _abandon {
+    my $this = shift();
+    my($sayGoodbye) = @_;
+
+    return undef if $this->{failed};
+    $this->{failed} = 1;
+
+    my $errmsg;
+    $errmsg = $this->_say_goodbye()
+	if $sayGoodbye && $this->{connected};
+
+    foreach my $name (qw(connectTimer readWatcher writeWatcher)) {
+	my $watcher = delete $this->{$name};
+	$watcher->cancel() if defined $watcher;
+    }
+    $this->{drainWatcher}->stop();
+    $this->{idleWatcher}->stop();
+    Net::Z3950::yaz_close(delete $this->{cs}) if defined $this->{cs};
+
+    # Nothing more will arrive, so responses partly taken from
+    # segments or streamed records will never be finished
+    foreach my $rs (grep { ref } @{ $this->{resultSets} }) {
+	$rs->{streams} = {};
+    }
+    return $errmsg;
+}
+
+
+# PRIVATE to the _abandon() method
+#
+# Queues a Close request behind any requests still held, releases
+# them all whatever the window, since the server won't answer them
+# now, and writes as much as the socket will take.  The socket is
+# about to be closed, so whatever can't be written at once is lost.
+# Returns undef, or a message saying why the Close wasn't all sent.
+#
+sub _say_goodbye {
+    my $this = shift();
+
+    my $errmsg = '';
+    Net::Z3950::makeCloseRequest($this->{ctx}, 'close',
+				 Net::Z3950::CloseReason::LackOfActivity,
+				 $errmsg)
+	or return "can't make close request: $errmsg";
+    push @{ $this->{held} }, 'close';
+    while (@{ $this->{held} }) {
+	my $refId = shift @{ $this->{held} };
+	Net::Z3950::contextRelease($this->{ctx})
+	    or die "Huh?  request '$refId' was not in the queue\n";
+    }
+
+    return "can't send close request: $!"
+	if $this->_flush() < 0;
+    return "close request not fully sent"
+	if Net::Z3950::contextPending($this->{ctx});
+    return undef;
 }
 
 
@@ -717,37 +1622,45 @@ sub scan {
 
 # Private method, shared with ResultSet.pm but not available to client
 # code.  Used to implement synchronous operations on top of async
-# ones: waits for something to happen on $conn's manager, checks that
-# the event is on the right connection, and is the expected kind of
-# operation.  Return 1 or undef for success or failure.
+# ones: waits for the expected kind of operation to complete on $conn,
+# setting aside any other events that happen on $conn's manager in the
+# mean time.  Return 1 or undef for success or failure.
 #
 sub expect {
     my $this = shift();
     my($op, $opname) = @_;
-
-    my $conn = $this->manager()->wait();
-    # Error not associated with a connection, e.g. ECONNREFUSED
-    return undef
-	if !defined $conn;
-
-    ###	We would prefer just to ignore any events on connections other
-    #	than this one, but there isn't a way to do this (unless we
-    #	invent one, storing other-connection events until they're
-    #	requested); so, for now, you shouldn't mix synchronous and
-    #	asynchronous calls unless the async ones nominate a callback.
-    die "expect() returned wrong connection!"
-	if $conn != $this;
+    my $mgr = $this->manager();
+
+    # Events on other connections, and for other operations on this
+    # one, are stashed in the manager for wait() to deliver later.
+    # An error counts as ours if it's in this operation or so bad
+    # that it's taken the whole connection down.
+    my $ours = sub {
+	my($conn, $state) = @_;
+	return 0 if $conn != $this;
+	return 1 if $state->{op} == $op;
+	return $state->{op} == Net::Z3950::Op::Error &&
+	    ($state->{errop} == $op || $state->{errop} == Net::Z3950::Op::Init);
+    };
+
+    # The event we want may already have been stashed by someone else
+    my $conn = $mgr->_unstash($ours);
+    while (!defined $conn) {
+	$conn = $mgr->_wait();
+	# Error not associated with a connection, e.g. wait() timed out
+	return undef
+	    if !defined $conn;
+
+	if (!&$ours($conn, $conn)) {
+	    $mgr->_stash($conn);
+	    $conn = undef;
+	}
+    }
 
     # Error code and addinfo are already available from $this
     return undef
 	if $this->op == Net::Z3950::Op::Error;
 
-    ###	Again, we'd like to ignore this event, leaving it lying around
-    #	for later; but there's no way to do it, so this has to be a
-    #	fatal error.
-    die "expect() got wrong op (expected $opname)"
-	if $this->op() != $op;
-
     return 1;
 }
 
@@ -792,6 +1705,13 @@ A scan response was received.  The scan-set may be obtained via the
 C<scanSet()> method described below, or the raw APDU object may be
 obtained via C<scanResponse()>.
 
+=item C<Net::Z3950::Op::Sort>
+
+A sort response was received, for a sort requested by the
+C<Net::Z3950::ResultSet> class's C<sort()> method.  The sorted result
+set may be obtained via the C<resultSet()> method described below, or
+the raw APDU object may be obtained via C<sortResponse()>.
+
 =back
 
 =cut
@@ -892,11 +1812,33 @@ sub searchResponse {
 
 sub resultSet {
     my $this = shift();
-    die "not search response" if $this->op() != Net::Z3950::Op::Search;
+    die "not search or sort response"
+	if $this->op() != Net::Z3950::Op::Search &&
+	    $this->op() != Net::Z3950::Op::Sort;
     return $this->{resultSet};
 }
 
 
+=head2 sortResponse()
+
+	if ($op == Net::Z3950::Op::Sort) {
+		$sr = $conn->sortResponse();
+		$rs = $conn->resultSet();
+
+When a connection is known to have received a sort response, the
+response may be accessed via the connection's C<sortResponse()>
+method, and the sorted result set, which is undefined if the sort
+failed, via C<resultSet()>.
+
+=cut
+
+sub sortResponse {
+    my $this = shift();
+    die "not sort response" if $this->op() != Net::Z3950::Op::Sort;
+    return $this->{sortResponse};
+}
+
+
 =head2 scanResponse(), scanSet()
 
 	if ($op == Net::Z3950::Op::Scan) {
@@ -975,17 +1917,52 @@ connection is not destroyed because its manager still holds a
 reference to it.  So use C<$conn->close()> (just before the close
 brace in the example above) to let the connection know it's done with.
 
+If the C<poolConnections> option is set, and nothing is still going
+on, the underlying session is not closed but handed to the manager,
+which gives it to the next connection made to the same server with
+the same credentials, so that connection needs no Init round trip.
+Either way, C<$conn> itself may not be used again.
+
 =cut
 
 sub close {
     my $this = shift();
 
+    my $poolable = defined $this->{mgr} && !$this->{pooled} &&
+	$this->_poolable();
     my $mgr = delete $this->{mgr};
     $mgr->forget($this) if defined $mgr; ### but it should always be!
 
+    if ($poolable) {
+	# Hand the session over to the manager for re-use
+	my $session = bless {
+	    mgr => $mgr,
+	    host => $this->{host},
+	    port => $this->{port},
+	    resultSets => [],
+	    options => {},
+	    refId2cb => {},
+	    inbox => [],
+	    held => [],
+	    wire => [],
+	    inflight => {},
+	    ninflight => 0,
+	    deadlines => {},
+	    expired => {},
+	    expiredHeld => {},
+	}, ref $this;
+	$session->_adopt($this);
+	$mgr->_checkin($session);
+	return;
+    }
+
     $this->{idleWatcher}->cancel() if defined $this->{idleWatcher};
+    $this->{drainWatcher}->cancel() if defined $this->{drainWatcher};
     $this->{readWatcher}->cancel() if defined $this->{readWatcher};
     $this->{writeWatcher}->cancel() if defined $this->{writeWatcher};
+    $this->{connectTimer}->cancel() if defined $this->{connectTimer};
+    $this->_cancel_deadlines();
+    delete $_resolving{$this->{resolving}} if defined $this->{resolving};
 
     # ### for a V.3 connection, we should really send a closeRequest
     # and await a closeResponse, but thats a lot of extra coding effort
@@ -996,6 +1973,9 @@ sub close {
     if (defined $this->{cs}) {
 	Net::Z3950::yaz_close($this->{cs});
     }
+    if (defined $this->{ctx}) {
+	Net::Z3950::contextDestroy($this->{ctx});
+    }
 
     # lots of the elements of %$this directly or indirectly contain
     # copies of $this. By deleting all elements from the hash, we hope
@@ -0,0 +1,357 @@
+# $Id$
+
+package Net::Z3950::EventLoop;
+use Time::HiRes qw(time);
+use strict;
+use warnings;
+
+
+=head1 NAME
+
+Net::Z3950::EventLoop - native epoll-based event loop for Net::Z3950
+
+=head1 SYNOPSIS
+
+	$mgr = new Net::Z3950::Manager(eventLoop => 'epoll');
+	# Then use $mgr and its connections exactly as usual
+
+=head1 DESCRIPTION
+
+By default, Net::Z3950 uses the C<Event> module to multiplex between
+connections, calling back into Perl whenever a socket becomes
+readable or writable.  With many connections open at once, those
+callbacks can dominate the cost of a search.  A manager created with
+the C<eventLoop> option set to C<epoll> instead uses an event loop
+written in C, on top of Linux's epoll interface, which writes
+requests and reads and decodes responses by itself, and passes only
+the decoded responses back to Perl.
+
+Applications never use this class directly.  It implements the small
+part of the C<Event> module's interface that Net::Z3950 itself uses -
+I/O, idle and timer watchers with C<start()>, C<stop()>, C<cancel()>
+and C<data()> methods, and C<loop()> and C<unloop()> - so the rest of
+the module works the same way with either loop.  But other C<Event>
+watchers that an application registers are not run while a manager
+that uses this loop is waiting, and nor is the manager's
+C<die_handler>: exceptions thrown in callbacks simply propagate out
+of C<wait()>.
+
+The native loop is not available on systems other than Linux.
+
+=cut
+
+
+# Kinds of result returned from evloopRun(): see "yazwrap/evloop.c"
+sub DECODED  { 1 }
+sub WRITTEN  { 2 }
+sub READABLE { 3 }
+
+# Bits for evloopPoll()
+sub READ  { 1 }
+sub WRITE { 2 }
+
+
+# PRIVATE to the Net::Z3950::Manager class's _events() method
+sub new {
+    my $class = shift();
+
+    my $loop = Net::Z3950::evloopCreate()
+	or return undef;	# caller should consult $!
+
+    return bless {
+	loop => $loop,
+	conns => {},		# maps entry IDs to connections' read-watchers
+	fds => {},		# maps entry IDs to plain I/O watchers
+	idle => {},		# started idle watchers
+	timers => {},		# started timers
+	pending => [],		# results from evloopRun() not yet delivered
+    }, $class;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _connect() method
+#
+# Registers the connection $conn, whose COMSTACK is $cs and whose
+# outgoing queue is in $ctx, and returns a pair of watchers standing
+# in for its read- and write-watchers.  Responses are decoded
+# according to $flags.
+#
+sub conn {
+    my $this = shift();
+    my($cs, $ctx, $flags, $conn) = @_;
+
+    my $id = Net::Z3950::evloopAddConn($this->{loop}, $cs, $ctx, $flags);
+    die "can't add connection to event loop: $!" if $id < 0;
+
+    # The two watchers share the entry, and so what it's polled for
+    my $entry = { id => $id, bits => READ };
+    my $r = $this->_watcher(conn => { entry => $entry, bit => READ,
+				      data => $conn, active => 1 });
+    my $w = $this->_watcher(conn => { entry => $entry, bit => WRITE,
+				      data => $conn });
+    $this->{conns}->{$id} = $r;
+    return ($r, $w);
+}
+
+
+# The following three methods have the same interface as the Event
+# module's constructors of the same names, but recognise only those
+# arguments that Net::Z3950 uses.
+
+sub io {
+    my $this = shift();
+    my %args = @_;
+
+    my $fd = ref $args{fd} ? fileno($args{fd}) : $args{fd};
+    my $id = Net::Z3950::evloopAddFd($this->{loop}, $fd);
+    die "can't add file descriptor to event loop: $!" if $id < 0;
+
+    my $w = $this->_watcher(io => { entry => { id => $id, bits => READ },
+				    bit => READ, active => 1, %args });
+    $this->{fds}->{$id} = $w;
+    $w->stop() if $args{parked};
+    return $w;
+}
+
+sub idle {
+    my $this = shift();
+    my %args = @_;
+
+    my $w = $this->_watcher(idle => { %args });
+    $w->start() if !$args{parked};
+    return $w;
+}
+
+sub timer {
+    my $this = shift();
+    my %args = @_;
+
+    my $w = $this->_watcher(timer => { %args });
+    $w->start() if !$args{parked};
+    return $w;
+}
+
+
+# PRIVATE to the constructors above
+sub _watcher {
+    my $this = shift();
+    my($kind, $fields) = @_;
+
+    return bless { %$fields, kind => $kind, loop => $this },
+	'Net::Z3950::EventLoop::Watcher';
+}
+
+
+=head2 loop(), unloop()
+
+These behave like C<Event::loop()> and C<Event::unloop()>.  Calls to
+C<loop()> may be nested, in which case C<unloop()> ends the innermost.
+
+=cut
+
+sub loop {
+    my $this = shift();
+    my($timeout) = @_;
+
+    my $end = defined $timeout ? time() + $timeout : undef;
+    local $this->{exit};
+    while (!$this->{exit}) {
+	if (my $res = shift @{ $this->{pending} }) {
+	    $this->_deliver(@$res);
+	    next;
+	}
+
+	my $now = time();
+	return undef if defined $end && $now >= $end;
+
+	my $res = Net::Z3950::evloopRun($this->{loop},
+					$this->_wait_ms($now, $end));
+	die "epoll_wait() failed: $!\n" if !defined $res;
+	push @{ $this->{pending} }, @$res;
+
+	# Idle watchers get a go only if nothing else happened
+	my $ntimers = $this->_run_timers();
+	$this->_run_idle() if !@$res && !$ntimers;
+    }
+
+    return $this->{exit}->[0];
+}
+
+sub unloop {
+    my $this = shift();
+    my($result) = @_;
+
+    $this->{exit} = [ $result ];
+}
+
+
+# PRIVATE to the loop() method
+#
+# Returns the number of milliseconds to wait for I/O: none if there
+# are idle watchers waiting to run, otherwise until the next timer is
+# due or the loop's own timeout expires, or -1 to wait for ever.
+#
+sub _wait_ms {
+    my $this = shift();
+    my($now, $end) = @_;
+
+    return 0 if %{ $this->{idle} };
+    my $next = $end;
+    foreach my $w (values %{ $this->{timers} }) {
+	$next = $w->{at} if !defined $next || $w->{at} < $next;
+    }
+
+    return -1 if !defined $next;
+    return 0 if $next <= $now;
+    return int(($next - $now) * 1000) + 1;
+}
+
+
+# PRIVATE to the loop() method
+sub _deliver {
+    my $this = shift();
+    my($id, $type, @args) = @_;
+
+    if ($type == READABLE) {
+	my $w = $this->{fds}->{$id};
+	&{ $w->{cb} }($w) if defined $w && $w->{active};
+	return;
+    }
+
+    # Results for connections closed since they were produced were
+    # dropped when the connection's watcher was cancelled
+    my $r = $this->{conns}->{$id}
+	or return;
+    my $conn = $r->data();
+    if ($type == DECODED) {
+	my($apdus, $reason, $errno) = @args;
+	$! = $errno;
+	$conn->_handle_read($apdus, $reason);
+    } elsif ($type == WRITTEN) {
+	my($nwritten, $errno) = @args;
+	$! = $errno;
+	$conn->_handle_write($nwritten);
+    }
+}
+
+
+# PRIVATE to the loop() method
+#
+# Timers are one-shot, like the Event module's timers without an
+# interval.  Returns the number of timers run.
+#
+sub _run_timers {
+    my $this = shift();
+
+    my $now = time();
+    my @due = grep { $_->{at} <= $now } values %{ $this->{timers} };
+    foreach my $w (sort { $a->{at} <=> $b->{at} } @due) {
+	next if !$w->{active};	# stopped by an earlier callback
+	$w->stop();
+	&{ $w->{cb} }($w);
+    }
+
+    return scalar @due;
+}
+
+
+# PRIVATE to the loop() method
+sub _run_idle {
+    my $this = shift();
+
+    foreach my $w (values %{ $this->{idle} }) {
+	next if !$w->{active};	# stopped by an earlier callback
+	$w->stop() if !$w->{repeat};
+	&{ $w->{cb} }($w);
+    }
+}
+
+
+sub DESTROY {
+    my $this = shift();
+
+    Net::Z3950::evloopDestroy($this->{loop}) if defined $this->{loop};
+}
+
+
+# Watchers are passed to their own callbacks in place of the Event
+# module's event objects, so they provide a w() method returning
+# themselves.
+#
+package Net::Z3950::EventLoop::Watcher;
+use Time::HiRes ();
+
+sub w { return $_[0] }
+
+sub data {
+    my $this = shift();
+
+    $this->{data} = shift() if @_;
+    return $this->{data};
+}
+
+sub start {
+    my $this = shift();
+
+    my $loop = $this->{loop};
+    $this->{active} = 1;
+    if ($this->{kind} eq 'idle') {
+	$loop->{idle}->{$this} = $this;
+    } elsif ($this->{kind} eq 'timer') {
+	$this->{at} = Time::HiRes::time() + $this->{after};
+	$loop->{timers}->{$this} = $this;
+    } else {
+	$this->_poll();
+    }
+}
+
+sub stop {
+    my $this = shift();
+
+    my $loop = $this->{loop};
+    $this->{active} = 0;
+    if ($this->{kind} eq 'idle') {
+	delete $loop->{idle}->{$this};
+    } elsif ($this->{kind} eq 'timer') {
+	delete $loop->{timers}->{$this};
+    } else {
+	$this->_poll();
+    }
+}
+
+# A connection's entry goes when its read-watcher is cancelled, and
+# with it any results for it not yet delivered: the entry's id may be
+# given to a new connection before the loop gets round to them.
+sub cancel {
+    my $this = shift();
+
+    $this->stop();
+    my $loop = $this->{loop};
+    if ($this->{kind} eq 'io' ||
+	($this->{kind} eq 'conn' && $this->{bit} == Net::Z3950::EventLoop::READ)) {
+	my $id = delete $this->{entry}->{id};
+	return if !defined $id;
+	delete $loop->{fds}->{$id};
+	delete $loop->{conns}->{$id};
+	@{ $loop->{pending} } = grep { $_->[0] != $id } @{ $loop->{pending} };
+	Net::Z3950::evloopRemove($loop->{loop}, $id);
+    }
+    delete $this->{cb};
+}
+
+# PRIVATE to the start() and stop() methods
+sub _poll {
+    my $this = shift();
+
+    my $entry = $this->{entry};
+    if ($this->{active}) {
+	$entry->{bits} |= $this->{bit};
+    } else {
+	$entry->{bits} &= ~$this->{bit};
+    }
+    Net::Z3950::evloopPoll($this->{loop}->{loop}, $entry->{id}, $entry->{bits})
+	if defined $entry->{id};
+}
+
+
+1;
@@ -0,0 +1,467 @@
+# $Id$
+
+package Net::Z3950::Federation;
+use Time::HiRes qw(time);
+use strict;
+use warnings;
+
+
+=head1 NAME
+
+Net::Z3950::Federation - one search run concurrently against many servers
+
+=head1 SYNOPSIS
+
+	$fed = $mgr->federated_search([ 'z3950.loc.gov:7090/Voyager',
+					[ 'bagel.indexdata.dk', 210,
+					  databaseName => 'gils' ] ],
+				      'computer',
+				      count => 20, deadline => 10);
+	while (my($rec, $target, $n) = $fed->next()) {
+		print $target->name(), " record $n:\n", $rec->render();
+	}
+	foreach my $target ($fed->targets()) {
+		print $target->name(), ": ", $target->state(), "\n";
+	}
+
+=head1 DESCRIPTION
+
+A Federation object represents a single search sent to several
+servers at once.  It connects to all of them concurrently, searches
+each as soon as its Init response arrives, asks each for the first
+few records as soon as its Search response arrives, and hands the
+records back to the caller as they come in, so that slow servers do
+not hold back fast ones.  A server that cannot be reached, refuses
+the Init, fails the search or misses its deadline does not affect the
+others: it simply contributes whatever records it had sent by then.
+
+There is no public constructor for this class.  Federation objects
+are created by the C<Net::Z3950::Manager> class's
+C<federated_search()> method.
+
+The federation drives its connections with its manager's event loop.
+Events on other connections that arrive in the mean time are kept for
+the manager's C<wait()> method to return later, so other synchronous
+or asynchronous work can go on under the same manager.
+
+=head1 METHODS
+
+=cut
+
+
+# Federation-specific options, which are not passed to connections
+my %_ownOptions = map { $_ => 1 } qw(count deadline order);
+
+# PRIVATE to the Net::Z3950::Manager class's federated_search() method
+sub _new {
+    my $class = shift();
+    my($mgr, $targets, $query, %opts) = @_;
+
+    my $order = $opts{order} || 'arrival';
+    die "unknown federated-search order '$order'\n"
+	if $order ne 'arrival' && $order ne 'roundrobin';
+
+    my $this = bless {
+	mgr => $mgr,
+	query => ref $query eq 'ARRAY' ? $query : [ $query ],
+	order => $order,
+	targets => [],
+	byConn => {},		# maps connections to their targets
+	queue => [],		# [ record, target, position ] in arrival order
+	rr => 0,		# index of next target to take from, roundrobin
+    }, $class;
+
+    my $start = time();
+    foreach my $spec (@$targets) {
+	my($host, $port, %options) = _parse_target($spec);
+	$port ||= getservbyname('z3950', 'tcp') || 210;
+	my %own = map { $_ => delete $options{$_} } keys %_ownOptions;
+	my $deadline = defined $own{deadline} ? $own{deadline} :
+	    $opts{deadline};
+	my $count = defined $own{count} ? $own{count} : $opts{count};
+
+	my $target = bless {
+	    name => "$host:$port",
+	    state => 'connecting',
+	    count => defined $count ? $count : 10,
+	    deadline => defined $deadline ? $start + $deadline : undef,
+	    fetched => 0,	# number of records handed to the caller
+	    ndiag => 0,		# number of records that were diagnostics
+	    queue => [],	# records not yet returned, for roundrobin
+	}, 'Net::Z3950::Federation::Target';
+	push @{ $this->{targets} }, $target;
+
+	my %connopts = (map { $_ => $opts{$_} }
+			grep { !$_ownOptions{$_} } keys %opts);
+	my $conn = Net::Z3950::Connection->new($mgr, $host, $port,
+					       %connopts, %options,
+					       async => 1);
+	if (!defined $conn) {
+	    $this->_fail($target, 100, "can't connect: $!");
+	    next;
+	}
+	$target->{conn} = $conn;
+	$this->{byConn}->{$conn} = $target;
+    }
+
+    return $this;
+}
+
+
+# PRIVATE to the _new() method
+#
+# A target is either a string of the form "host:port/database", in
+# which the port and database are optional, or a reference to an
+# array of host, port and connection options.
+#
+sub _parse_target {
+    my($spec) = @_;
+
+    return @$spec if ref $spec eq 'ARRAY';
+
+    my($host, $port, $db) = ($spec =~ m@^([^:/]+)(?::(\d+))?(?:/(.*))?$@)
+	or die "bad federated-search target '$spec'\n";
+    return ($host, $port, defined $db ? (databaseName => $db) : ());
+}
+
+
+=head2 next()
+
+	($rec, $target, $n) = $fed->next();
+
+Returns the next record retrieved by the federated search I<$fed>,
+together with the C<Net::Z3950::Federation::Target> it came from and
+its position in that target's result set, waiting for one to arrive
+if necessary.  Returns an empty list when every target has finished,
+whether successfully or not.
+
+If the C<order> option was C<arrival> (the default), records are
+returned in the order they arrive.  If it was C<roundrobin>, they
+are taken from each target in turn, skipping those that have nothing
+waiting, so that a target that returns many records quickly does not
+crowd out the others.
+
+=cut
+
+sub next {
+    my $this = shift();
+
+    while (1) {
+	my $item = $this->_dequeue();
+	return @$item if defined $item;
+	return () if $this->finished();
+	$this->_pump();
+    }
+}
+
+
+# PRIVATE to the next() method
+sub _dequeue {
+    my $this = shift();
+
+    if ($this->{order} eq 'arrival') {
+	my $item = shift @{ $this->{queue} }
+	    or return undef;
+	$item->[1]->{fetched}++;
+	return $item;
+    }
+
+    my $targets = $this->{targets};
+    for (my $i = 0; $i < @$targets; $i++) {
+	my $index = ($this->{rr} + $i) % @$targets;
+	my $item = shift @{ $targets->[$index]->{queue} }
+	    or next;
+	$this->{rr} = $index + 1;
+	$item->[1]->{fetched}++;
+	return $item;
+    }
+
+    return undef;
+}
+
+
+# PRIVATE to the next() method
+#
+# Waits for one event on the manager, no longer than until the
+# earliest deadline, and acts on it.
+#
+sub _pump {
+    my $this = shift();
+    my $mgr = $this->{mgr};
+
+    my $timeout = $mgr->option('timeout');
+    my $deadline;
+    foreach my $target ($this->_active()) {
+	$deadline = $target->{deadline}
+	    if defined $target->{deadline} &&
+		(!defined $deadline || $target->{deadline} < $deadline);
+    }
+    my $fromDeadline = defined $deadline &&
+	(!defined $timeout || $deadline - time() < $timeout);
+    if ($fromDeadline) {
+	$timeout = $deadline - time();
+	$timeout = 0 if $timeout < 0;
+    }
+
+    # Our events may have been stashed by a synchronous call elsewhere
+    my $byConn = $this->{byConn};
+    my $conn = $mgr->_unstash(sub { exists $byConn->{$_[0]} });
+    if (!defined $conn) {
+	local $mgr->{options}->{timeout} = $timeout;
+	$conn = $mgr->_wait();
+    }
+
+    if (!defined $conn) {
+	if ($fromDeadline) {
+	    $this->_expire();
+	} else {
+	    # The manager's own timeout: give up on everyone
+	    $this->_expire(1);
+	}
+	return;
+    }
+
+    # Events on connections outside the federation are kept for wait()
+    my $target = $byConn->{$conn};
+    if (!defined $target) {
+	$mgr->_stash($conn);
+	return;
+    }
+    $this->_handle($target, $conn);
+    $this->_expire();
+}
+
+
+# PRIVATE to the _pump() method
+sub _handle {
+    my $this = shift();
+    my($target, $conn) = @_;
+
+    my $op = $conn->op();
+    if ($op == Net::Z3950::Op::Error) {
+	$this->_fail($target, $conn->errcode(), $conn->addinfo());
+
+    } elsif ($op == Net::Z3950::Op::Init) {
+	if (!$conn->initResponse()->result()) {
+	    $this->_fail($target, 100, "init refused");
+	    return;
+	}
+	$target->{state} = 'searching';
+	$conn->startSearch(@{ $this->{query} });
+
+    } elsif ($op == Net::Z3950::Op::Search) {
+	my $rs = $conn->resultSet();
+	if (!defined $rs) {
+	    $this->_fail($target, $conn->errcode(), $conn->addinfo());
+	    return;
+	}
+	my $size = $rs->size();
+	$target->{rs} = $rs;
+	$target->{size} = $size;
+	$target->{n} = $size < $target->{count} ? $size : $target->{count};
+	$target->{next} = 1;
+	$target->{state} = 'fetching';
+	$rs->present(1, $target->{n}) if $target->{n} > 0;
+	# Some or all of the records may have been piggy-backed
+	$this->_harvest($target);
+
+    } elsif ($op == Net::Z3950::Op::Get) {
+	$this->_harvest($target);
+    }
+}
+
+
+# PRIVATE to the _handle() method
+#
+# Queues whatever records have arrived in order since we last looked,
+# and finishes the target when it has sent all those we wanted.
+# Diagnostics in place of records are counted but not returned.
+#
+sub _harvest {
+    my $this = shift();
+    my($target) = @_;
+
+    my $rs = $target->{rs};
+    while ($target->{next} <= $target->{n}) {
+	my $rec = $rs->_cached($target->{next})
+	    or last;
+	if ($rec->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
+	    $target->{ndiag}++;
+	} else {
+	    my $item = [ $rec, $target, $target->{next} ];
+	    if ($this->{order} eq 'arrival') {
+		push @{ $this->{queue} }, $item;
+	    } else {
+		push @{ $target->{queue} }, $item;
+	    }
+	}
+	$target->{next}++;
+    }
+
+    $this->_finish($target, 'done')
+	if $target->{next} > $target->{n};
+}
+
+
+# PRIVATE to the _pump() method
+#
+# Times out every active target whose deadline has passed, or every
+# active target at all if $all is true.
+#
+sub _expire {
+    my $this = shift();
+    my($all) = @_;
+
+    my $now = time();
+    foreach my $target ($this->_active()) {
+	next if !$all &&
+	    !(defined $target->{deadline} && $target->{deadline} <= $now);
+	$target->{errcode} = 100;
+	$target->{addinfo} = "timed out";
+	$this->_finish($target, 'timedout');
+    }
+}
+
+
+# PRIVATE to this class
+sub _fail {
+    my $this = shift();
+    my($target, $errcode, $addinfo) = @_;
+
+    $target->{errcode} = $errcode;
+    $target->{addinfo} = $addinfo;
+    $this->_finish($target, 'failed');
+}
+
+
+# PRIVATE to this class
+#
+# Records already received stay queued: only the connection goes.
+#
+sub _finish {
+    my $this = shift();
+    my($target, $state) = @_;
+
+    $target->{state} = $state;
+    my $conn = delete $target->{conn};
+    delete $target->{rs};
+    if (defined $conn) {
+	delete $this->{byConn}->{$conn};
+	$conn->close();
+    }
+}
+
+
+# PRIVATE to this class
+sub _active {
+    my $this = shift();
+
+    return grep { !$_->finished() } @{ $this->{targets} };
+}
+
+
+=head2 targets()
+
+	@targets = $fed->targets();
+
+Returns a list of C<Net::Z3950::Federation::Target> objects, one for
+each of the targets passed to C<federated_search()>, in the same
+order.  Each has the following methods:
+
+=over 4
+
+=item name()
+
+The target's name, in the form I<host>C<:>I<port>.
+
+=item state()
+
+One of C<connecting>, C<searching> and C<fetching> while the target
+is in progress; then C<done> if it has sent all the records asked for
+(or found none), C<failed> if it could not be connected to, refused
+the Init or failed the search, or C<timedout> if it missed its
+deadline.
+
+=item size()
+
+The number of records the target found, or an undefined value if its
+Search response has not arrived.
+
+=item fetched()
+
+The number of its records that have been returned by C<next()>.
+
+=item errcode(), addinfo(), errmsg()
+
+Why a C<failed> or C<timedout> target stopped, in the same form as
+the connection methods of the same names.
+
+=back
+
+=cut
+
+sub targets {
+    my $this = shift();
+
+    return @{ $this->{targets} };
+}
+
+
+=head2 finished()
+
+	if ($fed->finished()) { ... }
+
+Returns true once every target has finished.  There may still be
+records waiting to be returned by C<next()>.
+
+=cut
+
+sub finished {
+    my $this = shift();
+
+    return !$this->_active();
+}
+
+
+=head2 close()
+
+	$fed->close();
+
+Closes the connections to all targets that have not yet finished,
+which are then marked as timed out.  This happens anyway when every
+target has finished, so it's only needed when abandoning a federated
+search early.
+
+=cut
+
+sub close {
+    my $this = shift();
+
+    $this->_expire(1);
+    $this->{queue} = [];
+    $_->{queue} = [] foreach @{ $this->{targets} };
+}
+
+
+package Net::Z3950::Federation::Target;
+
+sub name { shift()->{name} }
+sub state { shift()->{state} }
+sub size { shift()->{size} }
+sub fetched { shift()->{fetched} }
+sub errcode { shift()->{errcode} }
+sub addinfo { shift()->{addinfo} }
+
+sub errmsg {
+    my $this = shift();
+    return Net::Z3950::errstr($this->errcode());
+}
+
+sub finished {
+    my $this = shift();
+    my $state = $this->{state};
+    return $state eq 'done' || $state eq 'failed' || $state eq 'timedout';
+}
+
+
+1;
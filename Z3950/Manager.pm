@@ -80,6 +80,10 @@ sub new {
 
     my $this = bless {
 	connections => [],
+	pool => {},		# maps pool keys to lists of idle sessions
+	stash => [],		# events put aside by expect(), oldest first
+	searchCache => {},	# maps search keys to cached searches
+	searchCacheStamp => 0,	# last stamp given to a cached search
 	options => { @_ },
     }, $class;
     $this->warnconns("creation");
@@ -175,9 +179,62 @@ sub _default {
     return 0 if $type eq 'stepSize';
     return 20 if $type eq 'numberOfEntries';
 
+    # Used in Net::Z3950::Connection::_ready_to_read()
+    return 0 if $type eq 'lazyRecords';
+    return 0 if $type eq 'sharedRecords';
+    return 0 if $type eq 'streamRecords';
+
     # Used in Net::Z3950::ResultSet::makePresentRequest()
     return 'B' if $type eq 'elementSetName';
 
+    # Used in Net::Z3950::ResultSet::_send_presentRequest()
+    return 0 if $type eq 'maxSegmentCount';
+    return 0 if $type eq 'maxSegmentSize';
+    return 0 if $type eq 'maxRecordSize';
+
+    # Used in Net::Z3950::ResultSet::_checkRequired()
+    return 16 if $type eq 'presentRanges';
+
+    # Used in Net::Z3950::ResultSet::_window()
+    return 1 if $type eq 'adaptivePrefetch';
+
+    # Used in Net::Z3950::ResultSet::_cache_evict()
+    return undef if $type eq 'cacheMaxRecords';
+    return undef if $type eq 'cacheMaxBytes';
+
+    # Used in Net::Z3950::Connection::startSearch() and _dispatch()
+    return undef if $type eq 'searchCacheTTL';
+    return 100 if $type eq 'searchCacheSize';
+
+    # Used in Net::Z3950::Manager::_query_cache()
+    return 'ccl.qual' if $type eq 'cclQualifiers';
+    return 256 if $type eq 'queryCacheSize';
+
+    # Used in Net::Z3950::ResultSet::_record_store()
+    return undef if $type eq 'recordStore';
+
+    # Used in Net::Z3950::ResultSet::_insert_context()
+    return undef if $type eq 'recordCallback';
+
+    # Used in Net::Z3950::Connection::_window()
+    return 0 if $type eq 'pipelining';
+    return 8 if $type eq 'maxOutstanding';
+
+    # Used in Net::Z3950::Connection::_enqueue()
+    return undef if $type eq 'requestTimeout';
+    return 'error' if $type eq 'requestTimeoutAction';
+
+    # Used in Net::Z3950::Connection::new()
+    return 0 if $type eq 'asyncResolve';
+    return undef if $type eq 'connectTimeout';
+    return 0 if $type eq 'poolConnections';
+
+    # Used in Net::Z3950::Manager::_checkin()
+    return 60 if $type eq 'poolIdleTimeout';
+
+    # Used in Net::Z3950::Manager::_events()
+    return 'Event' if $type eq 'eventLoop';
+
     # Assume the server's not brain-dead unless we're told otherwise
     return 1 if $type eq 'namedResultSets';
 
@@ -220,6 +277,56 @@ sub connect {
 }
 
 
+=head2 federated_search()
+
+	$fed = $mgr->federated_search(\@targets, $query, %options);
+
+Sends the search I<$query> to every server in I<@targets> at once,
+and returns a C<Net::Z3950::Federation> object whose C<next()> method
+returns the records as they arrive.  Each target is either a string
+of the form I<host>C<:>I<port>C</>I<database>, in which the port and
+database are optional, or a reference to an array of host, port and
+connection options.  I<$query> is a query string, or a reference to
+an array of arguments for C<startSearch()>, such as
+C<[ -prefix =E<gt> '@attr 1=4 fish' ]>.
+
+The following options are recognised, and may also be given for an
+individual target among its connection options; any others are
+passed to the connections:
+
+=over 4
+
+=item count
+
+The maximum number of records to fetch from each target (default 10).
+
+=item deadline
+
+The number of seconds, from now, that each target has to return its
+records.  A target that misses its deadline is closed, but the
+records it had already sent are still returned.  There is no
+deadline by default.
+
+=item order
+
+C<arrival> (the default) to return records in the order they arrive,
+or C<roundrobin> to take them from each target in turn.
+
+=back
+
+The connections are always asynchronous, whatever the manager's
+C<async> option.  See L<Net::Z3950::Federation> for details.
+
+=cut
+
+sub federated_search {
+    my $this = shift();
+    my($targets, $query, %options) = @_;
+
+    return Net::Z3950::Federation->_new($this, $targets, $query, %options);
+}
+
+
 =head2 wait()
 
 	$conn = $mgr->wait();
@@ -236,11 +343,31 @@ with its C<op()> and related methods.
 If the wait times out (only possible if the manager's C<timeout>
 option has been set), then C<wait()> returns an undefined value.
 
+Synchronous calls on one connection may be made while asynchronous
+requests are outstanding on others under the same manager (or on the
+same connection): any events that arrive for them in the mean time
+are kept, and returned by subsequent calls to C<wait()>, oldest first,
+before it waits for anything new.
+
 =cut
 
 sub wait {
     my $this = shift();
 
+    my $conn = $this->_unstash(sub { 1 });
+    return $conn if defined $conn;
+    return $this->_wait();
+}
+
+
+# PRIVATE to the wait() method, Net::Z3950::Connection::expect() and
+# Net::Z3950::Federation
+#
+# Waits for a new event, ignoring any that have been stashed.
+#
+sub _wait {
+    my $this = shift();
+
     # The next line prevents the Event module from catching our die()
     # calls and turning them into warnings sans bathtub.  By
     # installing this handler, we can get proper death back.
@@ -254,12 +381,107 @@ sub wait {
 	\&Event::verbose_exception_handler;
 
     my $timeout = $this->option("timeout");
-    # Stupid Event::loop() makes a distinction between undef and not there
-    my $conn = defined $timeout ? Event::loop($timeout) : Event::loop();
+    my $events = $this->_events();
+    my $conn;
+    if (ref $events) {
+	$conn = $events->loop($timeout);
+    } else {
+	# Stupid Event::loop() makes a distinction between undef and not there
+	$conn = defined $timeout ? Event::loop($timeout) : Event::loop();
+    }
     return ref $conn ? $conn : undef;
 }
 
 
+# The fields of a connection that describe its most recent event
+my @_eventFields = qw(op errcode addinfo errop searchResponse resultSet
+		      presentResponse scanResponse scanSet deleteRSResponse
+		      deleteStatus sortResponse);
+
+# PRIVATE to Net::Z3950::Connection::expect() and Net::Z3950::Federation
+#
+# Puts aside the event that _wait() has just returned on $conn, so
+# that it can be delivered later, even though more events may arrive
+# on $conn in the mean time.
+#
+sub _stash {
+    my $this = shift();
+    my($conn) = @_;
+
+    my %state;
+    @state{@_eventFields} = @$conn{@_eventFields};
+    push @{ $this->{stash} }, [ $conn, \%state ];
+}
+
+
+# PRIVATE to the wait() method, Net::Z3950::Connection::expect() and
+# Net::Z3950::Federation
+#
+# Finds the oldest stashed event for which &$match($conn, $state)
+# returns true, where $state is a reference to a hash of the event's
+# connection fields; restores those fields into the connection, and
+# returns the connection.  Returns undef if there is no such event.
+#
+sub _unstash {
+    my $this = shift();
+    my($match) = @_;
+
+    my $stash = $this->{stash};
+    for (my $i = 0; $i < @$stash; $i++) {
+	my($conn, $state) = @{ $stash->[$i] };
+	next if !&$match($conn, $state);
+	splice @$stash, $i, 1;
+	@$conn{keys %$state} = values %$state;
+	return $conn;
+    }
+
+    return undef;
+}
+
+
+# PRIVATE to this class, Net::Z3950::Connection and Net::Z3950::ResultSet
+#
+# Returns the event loop used by this manager's connections: either
+# the name of the Event module, whose class methods make watchers, or
+# a Net::Z3950::EventLoop object, whose methods of the same names make
+# watchers for the native loop.  Changing the eventLoop option after
+# connections have been made does not move them to the other loop.
+#
+sub _events {
+    my $this = shift();
+
+    return $this->{events} if defined $this->{events};
+    my $type = $this->option('eventLoop');
+    if ($type eq 'Event') {
+	$this->{events} = 'Event';
+    } elsif ($type eq 'epoll') {
+	$this->{events} = new Net::Z3950::EventLoop()
+	    or die "can't create native event loop: $!\n";
+    } else {
+	die "unknown eventLoop '$type'\n";
+    }
+
+    return $this->{events};
+}
+
+
+# PRIVATE to Net::Z3950::Connection and Net::Z3950::ResultSet
+#
+# Makes the innermost wait() return $result.
+#
+sub _unloop {
+    my $this = shift();
+    my($result) = @_;
+
+    my $events = $this->_events();
+    if (ref $events) {
+	$events->unloop($result);
+    } else {
+	Event::unloop($result);
+    }
+}
+
+
 # PRIVATE to the Net::Z3950::Connection module's new() method
 sub _register {
     my $this = shift();
@@ -309,6 +531,49 @@ sub resultSets {
 }
 
 
+=head2 clearSearchCache()
+
+	$mgr->clearSearchCache();
+
+Empties I<$mgr>'s search cache (see the C<searchCacheTTL> option), so
+that subsequent searches are all sent to their servers.  Result sets
+already made from the cache are unaffected.
+
+=cut
+
+sub clearSearchCache {
+    my $this = shift();
+
+    $this->{searchCache} = {};
+}
+
+
+=head2 loadQualifiers()
+
+	$mgr->loadQualifiers($file)
+		or die "can't load CCL qualifiers: $!";
+
+Loads the CCL qualifiers used by I<$mgr>'s connections to compile
+C<ccl2rpn> queries from I<$file>, replacing those loaded before, and
+watches that file rather than the one named by the C<cclQualifiers>
+option from now on.  Returns true on success; otherwise an undefined
+value, in which case C<$!> says why and the old qualifiers are kept.
+
+It's not usually necessary to call this: the qualifier file is loaded
+when first needed, and reloaded whenever it changes.
+
+=cut
+
+sub loadQualifiers {
+    my $this = shift();
+    my($file) = @_;
+
+    my $errmsg;
+    return Net::Z3950::queryCacheLoad($this->_query_cache(), $file, $errmsg)
+	|| undef;		# caller should consult $!
+}
+
+
 ### PRIVATE to the Net::Z3950::Connection::close() method.
 sub forget {
     my $this = shift();
@@ -321,6 +586,8 @@ sub forget {
 	if (defined $connections->[$i] && $connections->[$i] eq $conn) {
 	    $this->warnconns("pre-splice", "forgetting $i of $n");
 	    splice @{ $this->{connections} }, $i, 1;
+	    # Nobody wants the connection's stashed events any more
+	    @{ $this->{stash} } = grep { $_->[0] ne $conn } @{ $this->{stash} };
 	    $this->warnconns("post-splice", "forgot $i of $n");
 	    return;
 	}
@@ -331,10 +598,173 @@ sub forget {
 }
 
 
+# PRIVATE to the Net::Z3950::Connection::startSearch() method
+#
+# Returns the search cache's entry for the search key $key, if there
+# is one and it has not expired, or undef otherwise.  Each entry holds
+# the Search response; copies of the records fetched into the result
+# set it made, in record caches of their own (see the ResultSet
+# class's _snapshot_into() method); the time it expires; and a stamp
+# recording when it was last used.
+#
+sub _search_cache_get {
+    my $this = shift();
+    my($key) = @_;
+
+    my $entry = $this->{searchCache}->{$key}
+	or return undef;
+    if ($entry->{expires} <= time()) {
+	delete $this->{searchCache}->{$key};
+	return undef;
+    }
+
+    $entry->{used} = ++$this->{searchCacheStamp};
+    return $entry;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection::_dispatch() method
+#
+# Caches, for $ttl seconds, the Search response $apdu to the search
+# whose key is $key, and returns the new entry, whose record caches
+# are at first empty.  Expired entries are dropped, and then the
+# least recently used until there are no more than $max.
+#
+sub _search_cache_put {
+    my $this = shift();
+    my($key, $apdu, $ttl, $max) = @_;
+
+    my $cache = $this->{searchCache};
+    my $now = time();
+    my $entry = $cache->{$key} = {
+	searchResponse => $apdu,
+	records => {},
+	expires => $now + $ttl,
+	used => ++$this->{searchCacheStamp},
+    };
+
+    foreach my $k (keys %$cache) {
+	delete $cache->{$k} if $cache->{$k}->{expires} <= $now;
+    }
+    while ($max && keys %$cache > $max) {
+	my($oldest) = sort { $cache->{$a}->{used} <=> $cache->{$b}->{used} }
+			   keys %$cache;
+	delete $cache->{$oldest};
+    }
+
+    return $entry;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _send_searchRequest()
+# and startScan() methods, and to loadQualifiers()
+#
+# Returns the manager's query cache, which holds its CCL qualifiers
+# and its recently compiled queries: see "yazwrap/query.c".
+#
+sub _query_cache {
+    my $this = shift();
+
+    return $this->{queryCache} if defined $this->{queryCache};
+    $this->{queryCache} =
+	Net::Z3950::queryCacheCreate($this->option('cclQualifiers'),
+				     $this->option('queryCacheSize'))
+	or die "can't create query cache";
+
+    return $this->{queryCache};
+}
+
+
+# PRIVATE to the Net::Z3950::Connection::close() method
+#
+# Keeps an idle session, in the form of a connection object with no
+# user, for re-use by a subsequent connection with the same pool key.
+# It's retired if it's not re-used within the idle timeout.
+#
+sub _checkin {
+    my $this = shift();
+    my($session) = @_;
+
+    $session->{pooled} = 1;
+    $session->{idleTimer} = $this->_events()->timer(after =>
+				$this->option('poolIdleTimeout'),
+				data => $session, cb => \&_idle_timeout)
+	or die "can't make idle-timer for pooled session";
+    push @{ $this->{pool}->{$session->{poolKey}} }, $session;
+}
+
+
+# PRIVATE to the _checkin() method, invoked as an Event->timer callback
+sub _idle_timeout {
+    my($event) = @_;
+    my $session = $event->w()->data();
+
+    $session->{mgr}->_retire($session);
+}
+
+
+# PRIVATE to the Net::Z3950::Connection::new() method
+#
+# Returns the most recently used idle session with the pool key $key,
+# or undef if there is none.  Sessions that have gone bad -- that is,
+# whose sockets have become readable, which can only mean a Close
+# request or EOF from the server -- are retired along the way.
+#
+sub _checkout {
+    my $this = shift();
+    my($key) = @_;
+
+    my $sessions = $this->{pool}->{$key}
+	or return undef;
+    while (my $session = pop @$sessions) {
+	my $rin = '';
+	vec($rin, fileno($session->{sock}), 1) = 1;
+	if (select($rin, undef, undef, 0) != 0) {
+	    $this->_retire($session);
+	    next;
+	}
+
+	$session->{idleTimer}->cancel();
+	delete $session->{idleTimer};
+	delete $session->{pooled};
+	delete $this->{pool}->{$key} if !@$sessions;
+	return $session;
+    }
+
+    delete $this->{pool}->{$key};
+    return undef;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection::_ready_to_read() function and
+# the _checkout() and _idle_timeout() methods
+#
+# Removes the idle session $session from the pool and closes it.
+#
+sub _retire {
+    my $this = shift();
+    my($session) = @_;
+
+    my $sessions = $this->{pool}->{$session->{poolKey}};
+    @$sessions = grep { $_ != $session } @$sessions if defined $sessions;
+    delete $this->{pool}->{$session->{poolKey}}
+	if defined $sessions && !@$sessions;
+
+    $session->{idleTimer}->cancel() if defined $session->{idleTimer};
+    $session->{retired} = 1;
+    # A pooled session was never registered, so close() mustn't try
+    # to forget() it
+    delete $session->{mgr};
+    $session->close();
+}
+
+
 sub DESTROY {
     my $this = shift();
 
     #warn "destroying Net::Z3950 Connection $this";
+    Net::Z3950::queryCacheDestroy($this->{queryCache})
+	if defined $this->{queryCache};
 }
 
 
@@ -70,6 +70,28 @@ sub rawdata {
 }
 
 
+=head2 rawdata_ref()
+
+	$ref = $rec->rawdata_ref();
+	print length($$ref);
+
+Returns a reference to the raw form of the data in the record.  For
+record syntaxes whose raw data is a single opaque string (those
+derived from C<Net::Z3950::Record::Opaque>: SUTRS, the MARC family,
+XML, HTML, MAB), this is a reference to the record's own string, so
+that the data need not be copied as it would be by C<rawdata()>; the
+string must be treated as read-only.  For other syntaxes, it is a
+reference to a new copy of what C<rawdata()> returns.
+
+=cut
+
+sub rawdata_ref {
+    my $this = shift();
+    my $data = $this->rawdata();
+    return \$data;
+}
+
+
 #   ###	Should each subclass be implemented in a file of its own?
 #	Perhaps that will prove more appropriate as the number of
 #	supported record syntaxes, and the number of methods defined
@@ -81,6 +103,31 @@ sub rawdata {
 =cut
 
 
+=head2 Net::Z3950::Record::Opaque
+
+The common base class of the record syntaxes whose data is a single
+opaque string held in the record itself: SUTRS, the MARC family, XML,
+HTML and MAB.  It provides their C<rawdata()>, which returns a copy of
+that string, and their C<rawdata_ref()>, which returns a reference to
+the record's own string without copying it.
+
+=cut
+
+package Net::Z3950::Record::Opaque;
+use vars qw(@ISA);
+@ISA = qw(Net::Z3950::Record);
+
+sub rawdata {
+    my $this = shift();
+    return $$this;
+}
+
+sub rawdata_ref {
+    my $this = shift();
+    return \$$this;
+}
+
+
 =head2 Net::Z3950::Record::SUTRS
 
 Represents a a record using the Simple Unstructured Text Record
@@ -95,7 +142,7 @@ Z39.50 Standard for more information.
 
 package Net::Z3950::Record::SUTRS;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
+@ISA = qw(Net::Z3950::Record::Opaque);
 
 sub nfields {
     return 1;			# by definition
@@ -106,11 +153,6 @@ sub render {
     return $$this;
 }
 
-sub rawdata {
-    my $this = shift();
-    return $$this;
-}
-
 
 =head2 Net::Z3950::Record::GRS1
 
@@ -181,7 +223,8 @@ sub _render_content {
 	#	naughty (if not particularly malignant) side-effect of
 	#	permanently changing the type of a part of the tree.
 	my $sub = $val->subtree();
-	bless $sub, 'Net::Z3950::Record::GRS1';
+	bless $sub, 'Net::Z3950::Record::GRS1'
+	    if !$sub->isa('Net::Z3950::Record::GRS1');
 	return "{\n" . $sub->_render1($level+1) . '    ' x $level . "}\n";
     } else {
 	use Data::Dumper;
@@ -195,79 +238,144 @@ sub rawdata {
 }
 
 
-=head2 Net::Z3950::Record::USMARC, Net::Z3950::Record::UKMARC, Net::Z3950::Record::NORMARC, Net::Z3950::Record::LIBRISMARC, Net::Z3950::Record::DANMARC, Net::Z3950::Record::UNIMARC
+# When the connection's "lazyRecords" option is set, GRS-1 records
+# (and their subtrees) arrive as handles on the decoded-but-untranslated
+# C structure.  They behave exactly like ordinary GRS1 objects, since
+# dereferencing one as an array translates the record (once only); but
+# nfields() can be answered without doing so.
+#
+package Net::Z3950::Record::GRS1::Lazy;
+use vars qw(@ISA);
+@ISA = qw(Net::Z3950::Record::GRS1);
+use overload '@{}' => sub { Net::Z3950::lazyMaterialise(${ $_[0] }) },
+    fallback => 1;
 
-Represents a record using the appropriate MARC (MAchine Readable
-Catalogue) format - binary formats used extensively in libraries.
+sub nfields {
+    my $this = shift();
+    return Net::Z3950::lazyCount($$this);
+}
 
-For further information on the MARC formats, see the Library of
-Congress Network Development and MARC Standards Office web page at
-http://lcweb.loc.gov/marc/ and the MARC module in Ed Summers's
-directory at CPAN,
-http://cpan.valueclick.com/authors/id/E/ES/ESUMMERS/
+sub DESTROY {
+    my $this = shift();
+    Net::Z3950::lazyFree($$this);
+}
+
+
+=head2 Net::Z3950::Record::MARC
+
+The base class of all the MARC-family record classes below, and of
+C<Net::Z3950::Record::MAB>.  It is never itself instantiated, but
+provides for all of them the following methods, which parse the
+underlying ISO 2709 record directly, so that it's cheap to pull out a
+few fields without building a whole C<MARC::Record> object.
+
+=over 4
+
+=item nfields()
+
+Returns the number of fields in the record, not counting the leader.
+
+=item field($tag)
+
+	@isbns = $rec->field('020');
+
+Returns the contents of each field tagged I<$tag>, in the order they
+occur.  Data fields are returned as raw strings, beginning with the
+indicators and including the subfield delimiters (C<\x1F>).  In
+scalar context, returns only the first such field, or undef if there
+is none.
+
+=item subfield($tag, $code)
+
+	$title = $rec->subfield('245', 'a');
+
+Returns the values of each subfield coded I<$code> in each field
+tagged I<$tag>.  In scalar context, returns only the first such
+value, or undef if there is none.
+
+=item render()
+
+Returns a human-readable rendering of the record, in the same format
+as C<MARC::Record>'s C<as_formatted()> method.
+
+=back
 
 =cut
 
-package Net::Z3950::Record::USMARC;
+package Net::Z3950::Record::MARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
+@ISA = qw(Net::Z3950::Record::Opaque);
 
 sub nfields {
-    return 1;			# This is not really true - a record
-				# is made up of several fields, but
-				# here we perpetrate the illusion of a
-				# single flat block, so that it can
-				# easily be fed to external MARC-aware
-				# software.
+    my $this = shift();
+    my $n = Net::Z3950::marcNFields($$this);
+    return $n < 0 ? 0 : $n;
 }
 
-# Thanks to Dave Burgess <burgess@mitre.org> for supplying this code.
-# We pull in the MARC module with "require" rather than "use" so that
-# there's no dependency for non-MARC clients.
-#
-sub render {
+sub field {
     my $this = shift();
+    my($tag) = @_;
 
-    require MARC::Record;
-    my $rec = MARC::Record->new_from_usmarc($this->rawdata());
-    return $rec->as_formatted();
+    my $fields = Net::Z3950::marcField($$this, $tag);
+    return wantarray() ? @$fields : $fields->[0];
 }
 
-sub rawdata {
+sub subfield {
+    my $this = shift();
+    my($tag, $code) = @_;
+
+    my $values = Net::Z3950::marcSubfield($$this, $tag, $code);
+    return wantarray() ? @$values : $values->[0];
+}
+
+sub render {
     my $this = shift();
-    return $$this;		# Return the whole record ``as is''.
+    my $text = Net::Z3950::marcRender($$this, 0);
+    return "[can't render a malformed MARC record]\n"
+	if !defined $text;
+    return $text;
 }
 
 
+=head2 Net::Z3950::Record::USMARC, Net::Z3950::Record::UKMARC, Net::Z3950::Record::NORMARC, Net::Z3950::Record::LIBRISMARC, Net::Z3950::Record::DANMARC, Net::Z3950::Record::UNIMARC
+
+Represents a record using the appropriate MARC (MAchine Readable
+Catalogue) format - binary formats used extensively in libraries.  All
+of these inherit their methods from C<Net::Z3950::Record::MARC>; for
+more elaborate processing, the C<rawdata()> of any of them can be fed
+to C<MARC::Record-E<gt>new_from_usmarc()>.
+
+For further information on the MARC formats, see the Library of
+Congress Network Development and MARC Standards Office web page at
+http://lcweb.loc.gov/marc/ and the MARC module in Ed Summers's
+directory at CPAN,
+http://cpan.valueclick.com/authors/id/E/ES/ESUMMERS/
+
+=cut
+
+package Net::Z3950::Record::USMARC;
+use vars qw(@ISA);
+@ISA = qw(Net::Z3950::Record::MARC);
+
 package Net::Z3950::Record::UKMARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-sub nfields { return 1 }
-sub rawdata { return ${ shift() } }
+@ISA = qw(Net::Z3950::Record::MARC);
 
 package Net::Z3950::Record::NORMARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-sub nfields { return 1 }
-sub rawdata { return ${ shift() } }
+@ISA = qw(Net::Z3950::Record::MARC);
 
 package Net::Z3950::Record::LIBRISMARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-sub nfields { return 1 }
-sub rawdata { return ${ shift() } }
+@ISA = qw(Net::Z3950::Record::MARC);
 
 package Net::Z3950::Record::DANMARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-sub nfields { return 1 }
-sub rawdata { return ${ shift() } }
+@ISA = qw(Net::Z3950::Record::MARC);
 
 package Net::Z3950::Record::UNIMARC;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-sub nfields { return 1 }
-sub rawdata { return ${ shift() } }
+@ISA = qw(Net::Z3950::Record::MARC);
 
 
 =head2 Net::Z3950::Record::XML
@@ -283,7 +391,7 @@ For more information about XML, see http://www.w3.org/XML/
 
 package Net::Z3950::Record::XML;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
+@ISA = qw(Net::Z3950::Record::Opaque);
 
 sub nfields {
     return 1;			### not entirely true
@@ -294,11 +402,6 @@ sub render {
     return $$this;
 }
 
-sub rawdata {
-    my $this = shift();
-    return $$this;
-}
-
 
 =head2 Net::Z3950::Record::HTML
 
@@ -313,7 +416,7 @@ For more information about HTML, see http://www.w3.org/MarkUp/
 
 package Net::Z3950::Record::HTML;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
+@ISA = qw(Net::Z3950::Record::Opaque);
 
 sub nfields {
     return 1;			### not entirely true
@@ -323,11 +426,6 @@ sub render {
     return "[can't render a Net::Z3950::Record::HTML - not yet implemented]\n";
 }
 
-sub rawdata {
-    my $this = shift();
-    return $$this;
-}
-
 
 =head2 Net::Z3950::Record::OPAC
 
@@ -413,52 +511,43 @@ sub rawdata {
 }
 
 
+# The lazy OPAC record is to OPAC as the lazy GRS-1 record is to GRS1
+package Net::Z3950::Record::OPAC::Lazy;
+use vars qw(@ISA);
+@ISA = qw(Net::Z3950::Record::OPAC);
+use overload '%{}' => sub { Net::Z3950::lazyMaterialise(${ $_[0] }) },
+    fallback => 1;
+
+sub DESTROY {
+    my $this = shift();
+    Net::Z3950::lazyFree($$this);
+}
+
+
 =head2 Net::Z3950::Record::MAB
 
 Represents a record using the MAB record syntax (Maschinelles
 Austauschformat fuer Bibliotheken, ftp://ftp.ddb.de/pub/mab/); an
 interchange format defined by Die Deutsche Bibliothek (German National
-Library).
+Library).  Inherits its methods from C<Net::Z3950::Record::MARC>, except
+that C<render()> uses a simpler format of its own.
 
 =cut
 
 package Net::Z3950::Record::MAB;
 use vars qw(@ISA);
-@ISA = qw(Net::Z3950::Record);
-
-sub nfields {
-    my $this = shift();
-    return $$this =~ tr/\x1E/\x1E/;
-}
+@ISA = qw(Net::Z3950::Record::MARC);
 
+# MAB records are sometimes sent without an ISO 2709 directory, in
+# which case the field accessors fall back to splitting on the field
+# separator.  Rendering is in our own traditional format.
+#
 sub render {
     my $this = shift();
-    my $in = $$this;
-
-    # Chop off 24-character preface
-    my $out = "### " . substr($in, 0, 24) . "\n";
-    $in = substr($in, 24);
-
-    # \x1D is the record separator: discard it
-    $in =~ s/\x1D$//;
-
-    # \x1E is the field separator
-    my @fields = split /\x1E/, $in;
-
-    foreach my $field (@fields) {
-	# If a database uses two $ instead of the correct subfield
-	# separator code \x1F we reset this.
-	$field =~ s/\$\$/\x1F/g;
-	$field =~ s/\x1F/\$/g;
-	$out .= "$field\n";
-    }
-
-    return $out;
-}
-
-sub rawdata {
-    my $this = shift();
-    return $$this;
+    my $text = Net::Z3950::marcRender($$this, 1);
+    return "[can't render a malformed MAB record]\n"
+	if !defined $text;
+    return $text;
 }
 
 
@@ -0,0 +1,303 @@
+# $Id$
+
+package Net::Z3950::RecordStore;
+use Fcntl qw(O_RDWR O_WRONLY O_CREAT O_APPEND SEEK_SET SEEK_END
+	     LOCK_EX LOCK_UN);
+use Errno qw(EINVAL);
+use strict;
+use warnings;
+
+
+=head1 NAME
+
+Net::Z3950::RecordStore - result-set records kept in a file for later runs
+
+=head1 SYNOPSIS
+
+	# Harvesting: every record fetched is also written to the store
+	$rs = $conn->search('@attr 1=4 dinosaur');
+	$rs->option(recordStore => '/var/harvest/dinosaur');
+	$rs->present(1, $rs->size());
+	$rs->record($_) foreach 1 .. $rs->size();
+
+	# Later, with no connection
+	$store = Net::Z3950::RecordStore->open('/var/harvest/dinosaur')
+		or die "can't open store: $!";
+	foreach my $i (1 .. $store->size()) {
+		my $rec = $store->record($i) or next;
+		print $rec->render();
+	}
+
+=head1 DESCRIPTION
+
+When a result set's C<recordStore> option is set to the name of a
+file, the raw data of each record fetched into the result set -
+exactly as sent by the server - is appended to that file, and its
+position, offset, length and class are noted in an index file of the
+same name with C<.idx> added.  Running the same harvest into an
+existing store adds to it; a record already in the store is not
+written again.  If a result set fetches the same record in more than
+one record syntax or element set, only the first is stored.
+
+Only opaque records - those in the MARC syntaxes, MAB, SUTRS, XML and
+HTML - can be stored.  GRS-1 and OPAC records are structures rather
+than octets, and are skipped.
+
+A record store can later be opened read-only by the C<open()>
+method, which maps both files into memory.  The object returned has
+the same C<size()>, C<record()>, C<present()>, C<errcode()>,
+C<addinfo()> and C<errmsg()> methods as a C<Net::Z3950::ResultSet>,
+so code that reads records from result sets can read them from a
+store instead.  Fetching a record takes the same time wherever it is
+in the store, and the record's data is not copied out of the map.
+Records added to a store after it was opened are not seen.
+
+=head1 METHODS
+
+=cut
+
+
+# The class of each stored record is recorded by its index in this
+# table, which must therefore only ever be added to.  Zero means that
+# no record is stored.  See "yazwrap/store.c" for the file formats.
+my @_classes = map { "Net::Z3950::Record::$_" }
+    qw(SUTRS USMARC UKMARC NORMARC LIBRISMARC DANMARC UNIMARC MAB XML HTML);
+my %_classNumbers = map { $_classes[$_] => $_+1 } 0 .. $#_classes;
+
+my $_magic = "NZ3950RS";
+my $_version = 1;
+my $_entrySize = 16;		# size of the header and of each entry
+
+
+=head2 open()
+
+	$store = Net::Z3950::RecordStore->open($name);
+
+Opens the record store whose data file is called I<$name>, and
+returns an object representing it, or an undefined value if it
+cannot be opened, in which case C<$!> says why.
+
+=cut
+
+sub open {
+    my $class = shift();
+    my($name) = @_;
+
+    my $st = Net::Z3950::storeOpen($name)
+	or return undef;	# caller should consult $!
+    return bless {
+	st => $st,
+	name => $name,
+	errcode => 0,
+	addinfo => undef,
+    }, $class;
+}
+
+
+=head2 size()
+
+	$n = $store->size();
+
+Returns the number of records in the result set that was harvested
+into I<$store>, whether or not they were all stored.
+
+=cut
+
+sub size {
+    my $this = shift();
+
+    return Net::Z3950::storeSize($this->{st});
+}
+
+
+=head2 record()
+
+	$rec = $store->record($n);
+
+Returns the I<$n>th record of the result set harvested into
+I<$store>, or an undefined value if that record was never stored, in
+which case the C<errcode()> and C<addinfo()> methods say so.
+
+=cut
+
+sub record {
+    my $this = shift();
+    my($which) = @_;
+
+    my $number = Net::Z3950::storeClass($this->{st}, $which);
+    my $class = $number ? $_classes[$number-1] : undef;
+    if (!defined $class) {
+	$this->{errcode} = 14;	# System error in presenting records
+	$this->{addinfo} = "record $which is not in store '$this->{name}'";
+	return undef;
+    }
+
+    return Net::Z3950::storeFetch($this->{st}, $which, $class);
+}
+
+
+=head2 present()
+
+	$store->present($start, $count) or die "failed: $store->{errcode}\n";
+
+Does nothing, since every stored record is already to hand: provided
+only so that a store can stand in for a result set.  Returns 1.
+
+=cut
+
+sub present {
+    return 1;
+}
+
+
+=head2 errcode(), addinfo(), errmsg()
+
+These are the same as the C<Net::Z3950::ResultSet> methods of the
+same names, and describe why the last call to C<record()> returned an
+undefined value.
+
+=cut
+
+sub errcode {
+    my $this = shift();
+    return $this->{errcode};
+}
+
+sub addinfo {
+    my $this = shift();
+    return $this->{addinfo};
+}
+
+sub errmsg {
+    my $this = shift();
+    return Net::Z3950::errstr($this->errcode());
+}
+
+
+sub DESTROY {
+    my $this = shift();
+
+    Net::Z3950::storeClose($this->{st}) if defined $this->{st};
+}
+
+
+# PRIVATE to the Net::Z3950::ResultSet class's _record_store() method
+#
+# Opens the record store $name for writing, creating it if it doesn't
+# exist, for a result set of $size records.  Returns undef if either
+# file can't be opened, or the index isn't a record-store index.
+#
+sub _create {
+    my $class = shift();
+    my($name, $size) = @_;
+
+    my($data, $idx, $header);
+    sysopen($data, $name, O_WRONLY|O_CREAT|O_APPEND)
+	or return undef;
+    sysopen($idx, "$name.idx", O_RDWR|O_CREAT)
+	or return undef;
+    binmode $data;
+    binmode $idx;
+
+    my $n = sysread($idx, $header, $_entrySize);
+    return undef if !defined $n;
+    if ($n == 0) {
+	$header = $_magic . pack("VV", $_version, $size);
+    } elsif ($n < $_entrySize || substr($header, 0, 8) ne $_magic ||
+	     unpack("V", substr($header, 8, 4)) != $_version) {
+	$! = EINVAL;
+	return undef;
+    } else {
+	# A larger result set this time round: keep the larger size
+	my $old = unpack("V", substr($header, 12, 4));
+	$header = $_magic . pack("VV", $_version, $size > $old ? $size : $old);
+    }
+    _write_at($idx, 0, $header)
+	or return undef;
+
+    return bless {
+	name => $name,
+	data => $data,
+	idx => $idx,
+    }, $class;
+}
+
+
+# PRIVATE to the Net::Z3950::ResultSet class
+#
+# Appends $rec, the record at position $which of the result set, to
+# the store unless it's there already or is not an opaque record.
+# Another process may be harvesting into the same store, so the data
+# file is locked while the record and its index entry are written, and
+# the record's offset is wherever the end of the file is by then.
+#
+sub _store {
+    my $this = shift();
+    my($which, $rec) = @_;
+
+    my $number = $_classNumbers{ref $rec}
+	or return;
+    flock($this->{data}, LOCK_EX)
+	or die "can't lock record store '$this->{name}': $!";
+    eval {
+	$this->_append($which, $number, $rec->rawdata_ref());
+    };
+    my $err = $@;
+    flock($this->{data}, LOCK_UN);
+    die $err if $err;
+}
+
+
+# PRIVATE to the _store() method, which holds the lock
+sub _append {
+    my $this = shift();
+    my($which, $number, $data) = @_;
+
+    my $entry;
+    my $n = sysseek($this->{idx}, $which * $_entrySize, SEEK_SET) &&
+	sysread($this->{idx}, $entry, $_entrySize);
+    die "can't read record store '$this->{name}.idx': $!" if !defined $n;
+    return if $n == $_entrySize && unpack("V", substr($entry, 12, 4)) != 0;
+
+    my $end = sysseek($this->{data}, 0, SEEK_END);
+    my $len = length($$data);
+    defined $end && _write_all($this->{data}, $data) &&
+	_write_all($this->{data}, \"\0")
+	or die "can't write record store '$this->{name}': $!";
+
+    # The index entry goes last, so that a store never claims a record
+    # that's not all there
+    $entry = pack("VVVV", $end % 2**32, int($end / 2**32), $len, $number);
+    _write_at($this->{idx}, $which * $_entrySize, $entry)
+	or die "can't write record store '$this->{name}.idx': $!";
+}
+
+
+# PRIVATE to the _create() and _append() methods
+sub _write_at {
+    my($fh, $offset, $buf) = @_;
+
+    return sysseek($fh, $offset, SEEK_SET) && _write_all($fh, \$buf);
+}
+
+
+# PRIVATE to the _append() and _write_at() methods
+#
+# Writes all of $$buf to $fh, carrying on after short writes.  $buf is
+# a reference so that records needn't be copied.  Returns true on
+# success, or false with $! set.
+#
+sub _write_all {
+    my($fh, $buf) = @_;
+
+    my $len = length($$buf);
+    for (my $off = 0; $off < $len; ) {
+	my $n = syswrite($fh, $$buf, $len-$off, $off);
+	return 0 if !defined $n;
+	$off += $n;
+    }
+    return 1;
+}
+
+
+1;
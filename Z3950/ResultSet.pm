@@ -1,6 +1,7 @@
 # $Header: /home/cvsroot/NetZ3950/Z3950/ResultSet.pm,v 1.22 2005/04/21 11:41:23 mike Exp $
 
 package Net::Z3950::ResultSet;
+use Scalar::Util qw(reftype);
 use strict;
 
 
@@ -32,9 +33,10 @@ via the C<Net::Z3950::Connection> class's C<resultSet()> method.
 
 
 # The key data member of Result Sets is $this->{records}, which is a
-# hash mapping element-set names to caches of records represented in
-# that element set.  Each such cache is an array, the elements of
-# which may contain any of the following values:
+# hash mapping cache keys to caches of records represented in that
+# element set and record syntax: see _cache_key().  Each such cache is
+# an array, the elements of which may contain any of the following
+# values:
 #	an undefined value (or not there at all -- off the end of the
 #		array) if we don't have the record, and it's not been
 #		requested yet.
@@ -49,6 +51,12 @@ via the C<Net::Z3950::Connection> class's C<resultSet()> method.
 #		unsuccessfully.
 # We use the slots in $this->{records} corresponding to 1-based record
 # numbers; that is, slot zero is not used at all.
+#
+# If the cacheMaxRecords or cacheMaxBytes option is set, the records
+# themselves (but not diagnostics or the requested markers) are also
+# listed, least recently used first, in $this->{lru}; and when there
+# are too many, the oldest are dropped, leaving their slots undefined
+# so that they're fetched again if they're wanted.  See _cache_add().
 sub CALLER_REQUESTED { 1 }
 sub RS_REQUESTED { 2 }
 
@@ -81,14 +89,60 @@ sub _new {
 	rsName => $rsName,
 	searchResponse => $searchResponse,
 	records => {},
+	cacheKeys => [],	# keys of {records}, in order of creation
+	keyIndex => {},		# maps keys to their indexes in {cacheKeys}
+	lru => [],		# [ key, slot, stamp ], oldest first
+	cacheInfo => {},	# maps keys to [ stamp, bytes ] for each slot
+	cacheStamp => 0,	# last stamp given to a cached record
+	cacheRecords => 0,	# number of records listed in {lru}
+	cacheBytes => 0,	# and their total size
+	streams => {},		# maps refIds of present responses whose
+				# records are arriving ahead of them
+				# to their _insert_context()s
+	cacheHits => 0,
+	cacheMisses => 0,
+	cacheEvictions => 0,
+	piggyback => undef,	# key of the cache holding records that
+				# came with the search response
     }, $class;
 
+    $this->_add_piggyback($searchResponse);
+    return $this;
+}
+
+
+# PRIVATE to the _new() method
+#
+# Depending on the size of the result set and the smallSetUpperBound,
+# largeSetLowerBound and mediumSetPresentNumber options, the server
+# may have returned the first few records along with the search
+# response, in which case we put them in the cache for the element
+# set that they were requested in, and remember that cache's key so
+# that record() can serve them when elementSetName is different, as
+# it is by default.  A non-surrogate diagnostic here
+# just means that the server couldn't return them, which is no reason
+# to fail the search, so we ignore it: the records will be fetched
+# with a Present request if they're wanted.
+#
+sub _add_piggyback {
+    my $this = shift();
+    my($searchResponse) = @_;
+
     ### Should also check presentStatus where relevant
     my $rawrecs = $searchResponse->records();
-    $this->_insert_records($searchResponse, 1, 1)
-	if defined $rawrecs;
-
-    return $this;
+    return if !defined $rawrecs ||
+	!$rawrecs->isa('Net::Z3950::APDU::NamePlusRecordList');
+
+    my $n = $searchResponse->numberOfRecordsReturned();
+    $n = @$rawrecs if !$n || $n > @$rawrecs;
+    return if !$n;
+
+    my $esn = $this->size() <= $this->option('smallSetUpperBound') ?
+	$this->option('smallSetElementSetName') :
+	$this->option('mediumSetElementSetName');
+    $this->{piggyback} = $this->_cache_key($esn);
+    $this->_insert_records($searchResponse, [ 1 .. $n ],
+			   $this->{piggyback});
 }
 
 
@@ -168,12 +222,24 @@ already been queued.
 sub present {
     my ($this, $start, $count) = @_;
 
-    my $esn = $this->option('elementSetName');
-    ### Shouldn't this cache also have a record-syntax dimension?
-    if (!defined $this->{records}->{$esn}) {
-	$this->{records}->{$esn} = [];
-    }
-    my $records = $this->{records}->{$esn};
+    my $last = $this->_request($start, $count);
+    return undef
+	if $this->option('async');
+
+    return $this->_await($start, $last);
+}
+
+
+# PRIVATE to the present() and record() methods
+#
+# Marks for retrieval those records in the specified range that have
+# not already been requested, and returns the number of the last
+# record in the range.
+#
+sub _request {
+    my ($this, $start, $count) = @_;
+
+    my $records = $this->{records}->{$this->_cache_key()};
 
     # quietly ignore presents past the last record - this stops
     # prefetch causing errors
@@ -191,18 +257,37 @@ sub present {
 	}
     }
     $this->{conn}->{idleWatcher}->start() if $seen_new;
-    return undef
-	if $this->option('async');
+    return $last;
+}
 
-    # Synchronous-mode request for a record that we don't yet have.
-    # As soon as we're idle -- in the wait() call -- the _idle()
-    # watcher will send a presentRequest; we then wait for its
-    # response to arrive.
-    if (!$this->{conn}->expect(Net::Z3950::Op::Get, "get")) {
-	# Error code and addinfo are in the connection: copy them across
-	$this->{errcode} = $this->{conn}->{errcode};
-	$this->{addinfo} = $this->{conn}->{addinfo};
-	return 0;
+
+# PRIVATE to the present() and record() methods
+#
+# Synchronous-mode wait for records that we don't yet have.  As soon
+# as we're idle -- in the wait() call -- the _idle() watcher will send
+# a presentRequest; we then wait for responses to arrive until we have
+# all the records from $start to $last.  There may be more than one,
+# since the records may have been asked for in several requests, some
+# of them (e.g. read-aheads) sent before this call.  Records in the
+# range are not evicted from the cache while we wait, or those that
+# arrived first could be dropped by the later responses, and never be
+# asked for again.
+#
+sub _await {
+    my ($this, $start, $last) = @_;
+
+    my $key = $this->_cache_key();
+    my $records = $this->{records}->{$key};
+    my $conn = $this->{conn};
+    local $conn->{waiting} = 1;
+    local $this->{pinned} = [ $key, $start, $last ];
+    while (grep { !ref $records->[$_] } $start..$last) {
+	if (!$conn->expect(Net::Z3950::Op::Get, "get")) {
+	    # Error code and addinfo are in the connection: copy them across
+	    $this->{errcode} = $conn->{errcode};
+	    $this->{addinfo} = $conn->{addinfo};
+	    return 0;
+	}
     }
     return 1;
 }
@@ -233,18 +318,29 @@ sub record {
     my $this = shift();
     my($which) = @_;
 
-    # autovivifies if necessary
-    my $rec = $this->{records}{$this->option('elementSetName')}[$which];
+    my $key = $this->_cache_key();
+    my $rec = $this->{records}{$key}[$which];
+    my $sequential = $this->_sequential($which);
+    ($key, $rec) = $this->_piggybacked($key, $which) if !ref $rec;
+
+    if (ref $rec) {
+	$this->{cacheHits}++;
+	$this->_cache_touch($key, $which);
+    } else {
+	$this->{cacheMisses}++;
+    }
 
     if (!defined $rec or not ref $rec) {
 	# Record not in place yet
 
-	my $status = $this->present($which, $this->option('prefetch') || 1);
+	# Ask for as many records as seems sensible, but wait only for
+	# the one we need
+	$this->_request($which, $this->_window($sequential));
 	if ($this->option('async')) {
 	    # request was merely queued
 	    $this->{errcode} = 0;
 	    return undef;
-	} elsif (!$status) {
+	} elsif (!$this->_await($which, $which)) {
 	    # An actual error: the code/addInfo have already been set
 	    return undef;
 	}
@@ -252,7 +348,7 @@ sub record {
 	# The _add_records() callback invoked by the event loop should now
 	# have inserted the requested record into our array, so we should
 	# just be able to return it.  Sanity-check first, though.
-	$rec = $this->{records}{$this->option('elementSetName')}[$which];
+	$rec = $this->{records}{$key}[$which];
 	if (!defined $rec) {
 	    die "record(): impossible: didn't get record";
 	} elsif (!ref $rec) {
@@ -268,6 +364,9 @@ sub record {
 	}
     }
 
+    $this->_read_ahead($which)
+	if $sequential && !$this->option('async');
+
     if (ref $rec && $rec->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
 	# Set error information from record into the result set
 	### $rec->diagnosticSetId() is not used
@@ -280,6 +379,381 @@ sub record {
 }
 
 
+# PRIVATE to this class and the Net::Z3950::Federation class
+#
+# Records in different element sets or record syntaxes are cached
+# separately, so that switching between them needn't mean searching
+# again.  Returns the key of the cache for element set $esn and the
+# current record syntax, creating it if necessary; $esn defaults to
+# the current element set.
+#
+sub _cache_key {
+    my $this = shift();
+    my($esn) = @_;
+
+    $esn = $this->option('elementSetName') if !defined $esn;
+    my $key = $this->preferredRecordSyntax() . ":$esn";
+    $this->_register_key($key);
+    return $key;
+}
+
+
+# PRIVATE to the _cache_key() and _adopt_cached() methods
+sub _register_key {
+    my $this = shift();
+    my($key) = @_;
+
+    return if defined $this->{records}->{$key};
+    $this->{records}->{$key} = [];
+    push @{ $this->{cacheKeys} }, $key;
+    $this->{keyIndex}->{$key} = $#{ $this->{cacheKeys} };
+}
+
+
+# PRIVATE to this class: the inverse of _cache_key()
+sub _split_key {
+    my($key) = @_;
+
+    return split /:/, $key, 2;
+}
+
+
+# PRIVATE to the Net::Z3950::Federation class's _harvest() method
+#
+# Returns what's in the cache for record $which -- a record or a
+# surrogate diagnostic -- without requesting it; or undef if it hasn't
+# arrived.
+#
+sub _cached {
+    my $this = shift();
+    my($which) = @_;
+
+    my $key = $this->_cache_key();
+    my $rec = $this->{records}->{$key}->[$which];
+    (undef, $rec) = $this->_piggybacked($key, $which) if !ref $rec;
+    return ref $rec ? $rec : undef;
+}
+
+
+# PRIVATE to the record() and _cached() methods
+#
+# Record $which is not in the cache for key $key, but it may have
+# come with the search response in a different element set: if so,
+# and the record syntax is the same, a record in that element set
+# will do rather than fetching it again.  (Surrogate diagnostics
+# won't, since the other element set might not fail.)  Returns the
+# key and contents of the cache slot to use.
+#
+sub _piggybacked {
+    my $this = shift();
+    my($key, $which) = @_;
+
+    my $rec = $this->{records}->{$key}->[$which];
+    my $pkey = $this->{piggyback};
+    return ($key, $rec)
+	if !defined $pkey || $pkey eq $key ||
+	    (_split_key($pkey))[0] ne (_split_key($key))[0];
+
+    my $prec = $this->{records}->{$pkey}->[$which];
+    return ($key, $rec)
+	if !ref $prec || $prec->isa('Net::Z3950::APDU::DefaultDiagFormat');
+    return ($pkey, $prec);
+}
+
+
+# PRIVATE to the record() method
+#
+# Returns true if the caller is reading the result set sequentially,
+# i.e. has just asked for the record after the one asked for last.
+#
+sub _sequential {
+    my $this = shift();
+    my($which) = @_;
+
+    my $last = $this->{lastRecord};
+    $this->{lastRecord} = $which;
+    return defined $last && $which == $last+1;
+}
+
+
+# PRIVATE to the record() and _read_ahead() methods
+#
+# Returns the number of records to ask for in the next Present
+# request.  If the "prefetch" option is set, that's what we use;
+# otherwise, unless the "adaptivePrefetch" option is turned off, we
+# double the number each time while the caller is reading
+# sequentially, up to a limit based on the sizes of the records we've
+# seen so far, and drop back to one when the caller jumps about.
+#
+sub _window {
+    my $this = shift();
+    my($sequential) = @_;
+
+    my $prefetch = $this->option('prefetch');
+    return $prefetch if $prefetch;
+    return 1 if !$this->option('adaptivePrefetch');
+
+    if (!$sequential) {
+	$this->{window} = 1;
+    } else {
+	my $window = 2 * ($this->{window} || 1);
+	my $max = $this->_max_window();
+	$this->{window} = $window > $max ? $max : $window;
+    }
+
+    return $this->{window};
+}
+
+
+# PRIVATE to the _window() method
+#
+# Aim to keep each Present response within half the preferred message
+# size, so that a response and the read-ahead request following it
+# can both be in flight without either being cut short by the server.
+# Until we've seen some records whose size we can measure, we assume
+# they're a few kilobytes each.
+#
+sub _max_window {
+    my $this = shift();
+
+    my $avg = $this->_average_size();
+    my $maxrec = $this->option('maximumRecordSize');
+    $avg = $maxrec if $maxrec && $avg > $maxrec;
+    $avg = 1 if $avg < 1;
+
+    my $max = int($this->option('preferredMessageSize') / (2 * $avg));
+    return $max < 1 ? 1 : $max;
+}
+
+
+# PRIVATE to the _max_window() and _note_size() methods
+#
+# Until we've seen some records whose size we can measure, we assume
+# they're a few kilobytes each.
+#
+sub _average_size {
+    my $this = shift();
+
+    return $this->{sizeCount} ?
+	$this->{sizeTotal} / $this->{sizeCount} : 4096;
+}
+
+
+# PRIVATE to the _insert_record() method
+#
+# Keeps a running total of the sizes of records whose raw data is a
+# string, so that _max_window() knows how many will fit in a message.
+# Returns the record's size, or for a structured record (which can't
+# easily be measured) the average so far.
+#
+sub _note_size {
+    my $this = shift();
+    my($rec) = @_;
+
+    my $data = $rec->rawdata_ref();
+    return int($this->_average_size()) if ref $$data;
+    $this->{sizeTotal} += length($$data);
+    $this->{sizeCount}++;
+    return length($$data);
+}
+
+
+# PRIVATE to the _insert_context() method
+sub _cache_limited {
+    my $this = shift();
+
+    return $this->option('cacheMaxRecords') || $this->option('cacheMaxBytes');
+}
+
+
+# PRIVATE to the _insert_context() and _adopt_cached() methods
+#
+# Returns the Net::Z3950::RecordStore that records are to be written
+# to, opening it the first time it's wanted, or undef if the
+# recordStore option is not set.
+#
+sub _record_store {
+    my $this = shift();
+
+    my $name = $this->option('recordStore')
+	or return undef;
+    my $store = $this->{store};
+    return $store if defined $store && $store->{name} eq $name;
+
+    $store = Net::Z3950::RecordStore->_create($name, $this->size())
+	or die "can't open record store '$name': $!";
+    return $this->{store} = $store;
+}
+
+
+# PRIVATE to the _insert_record() method
+#
+# Lists the newly arrived record in slot $slot of the cache $key,
+# whose size is $bytes, as the most recently used.
+#
+sub _cache_add {
+    my $this = shift();
+    my($key, $slot, $bytes) = @_;
+
+    my $stamp = ++$this->{cacheStamp};
+    $this->{cacheInfo}->{$key}->[$slot] = [ $stamp, $bytes ];
+    push @{ $this->{lru} }, [ $key, $slot, $stamp ];
+    $this->{cacheRecords}++;
+    $this->{cacheBytes} += $bytes;
+}
+
+
+# PRIVATE to the record() method
+#
+# Moves the record in slot $slot of the cache $key to the most
+# recently used end of the list.  Rather than finding and removing
+# its old entry, we give it a new stamp, so that the old entry is
+# recognised as stale and skipped when it reaches the front.
+#
+sub _cache_touch {
+    my $this = shift();
+    my($key, $slot) = @_;
+
+    my $info = $this->{cacheInfo}->{$key}
+	or return;
+    $info = $info->[$slot]
+	or return;
+    $info->[0] = ++$this->{cacheStamp};
+    push @{ $this->{lru} }, [ $key, $slot, $info->[0] ];
+}
+
+
+# PRIVATE to the _insert_records() method
+#
+# Drops least recently used records until the cache is within the
+# cacheMaxRecords and cacheMaxBytes limits -- except that records with
+# stamps of $keep or more, which arrived in the response just
+# inserted, are never dropped, since the caller is about to ask for
+# at least one of them; nor are those in the range that _await() is
+# waiting for.  The slots of those dropped are marked as never
+# requested.
+#
+sub _cache_evict {
+    my $this = shift();
+    my($keep) = @_;
+
+    my $maxRecords = $this->option('cacheMaxRecords');
+    my $maxBytes = $this->option('cacheMaxBytes');
+    my $lru = $this->{lru};
+    my $pinned = $this->{pinned};
+    my @pinned;			# entries skipped, in order
+    while (($maxRecords && $this->{cacheRecords} > $maxRecords) ||
+	   ($maxBytes && $this->{cacheBytes} > $maxBytes)) {
+	my $entry = $lru->[0];
+	last if !defined $entry || $entry->[2] >= $keep;
+	shift @$lru;
+
+	my($key, $slot, $stamp) = @$entry;
+	my $info = $this->{cacheInfo}->{$key}->[$slot];
+	next if !defined $info || $info->[0] != $stamp;	# stale entry
+	if (defined $pinned && $key eq $pinned->[0] &&
+	    $slot >= $pinned->[1] && $slot <= $pinned->[2]) {
+	    push @pinned, $entry;
+	    next;
+	}
+
+	$this->{cacheInfo}->{$key}->[$slot] = undef;
+	$this->{records}->{$key}->[$slot] = undef;
+	$this->{cacheRecords}--;
+	$this->{cacheBytes} -= $info->[1];
+	$this->{cacheEvictions}++;
+    }
+    unshift @$lru, @pinned;
+
+    # Don't let stale entries pile up if records are read repeatedly
+    if (@$lru > 2 * $this->{cacheRecords} + 64) {
+	@$lru = grep {
+	    my $info = $this->{cacheInfo}->{$_->[0]}->[$_->[1]];
+	    defined $info && $info->[0] == $_->[2];
+	} @$lru;
+    }
+}
+
+
+=head2 cacheStats()
+
+	$stats = $rs->cacheStats();
+	print "hit rate: ", $stats->{hits} / ($stats->{hits} + $stats->{misses});
+
+Returns a reference to a hash of statistics about I<$rs>'s record
+cache: C<hits> and C<misses>, the number of calls to C<record()> that
+did and did not find the record already in the cache; C<evictions>,
+the number of records dropped from the cache to keep it within the
+C<cacheMaxRecords> and C<cacheMaxBytes> limits; and C<records> and
+C<bytes>, the number and approximate total size of the records now
+held subject to those limits.  (When neither limit is set, records
+are not counted, since none are ever dropped.)
+
+=cut
+
+sub cacheStats {
+    my $this = shift();
+
+    return {
+	hits => $this->{cacheHits},
+	misses => $this->{cacheMisses},
+	evictions => $this->{cacheEvictions},
+	records => $this->{cacheRecords},
+	bytes => $this->{cacheBytes},
+    };
+}
+
+
+# PRIVATE to the record() method
+#
+# When a synchronous caller is reading sequentially and has consumed
+# half of the records most recently asked for, send a request for the
+# next chunk straight away, so that it's in flight while the caller
+# works through the rest of this one.  Its response is delivered by a
+# callback, which returns control to the caller only if it's waiting.
+#
+sub _read_ahead {
+    my $this = shift();
+    my($which) = @_;
+
+    return if $this->option('prefetch') || !$this->option('adaptivePrefetch');
+    my $records = $this->{records}->{$this->_cache_key()};
+    my $window = $this->{window} || 1;
+    return if $window < 2;
+
+    # Find the first record not yet asked for, unless it's more than
+    # half a window ahead, in which case it's too soon to read ahead
+    my $limit = $which + int($window/2);
+    my $next = $which + 1;
+    while (defined $records->[$next]) {
+	return if ++$next > $limit;
+    }
+    return if $next > $this->size();
+
+    my $count = $this->_window(1);
+    my $last = $next + $count - 1;
+    $last = $this->size() if $last > $this->size();
+    for (my $i = $next; $i <= $last; $i++) {
+	$records->[$i] = CALLER_REQUESTED;
+    }
+
+    local $this->{readAhead} = 1;
+    $this->_checkRequired();
+    $this->{conn}->_flush();
+}
+
+
+# PRIVATE to the _send_presentRequest() method: the callback for the
+# response to a read-ahead request.  $apdu is undefined if the request
+# timed out, in which case the callback has already been forgotten.
+sub _read_ahead_done {
+    my($conn, $apdu) = @_;
+
+    delete $conn->{refId2cb}->{$apdu->referenceId()} if defined $apdu;
+    $conn->manager()->_unloop($conn) if $conn->{waiting};
+}
+
+
 # PRIVATE to the Net::Z3950::Connection module's new() method, invoked as
 # an Event->idle callback
 sub _idle {
@@ -298,73 +772,90 @@ sub _idle {
 
 
 # PRIVATE to the _request_records() method
+#
+# Gathers all the runs of records that the caller has asked for but
+# which have not yet been requested from the server, and asks for them
+# using as few Present requests as possible: each request can carry
+# up to "presentRanges" runs, using the APDU's additionalRanges.
+#
 sub _checkRequired {
     my $this = shift();
 
-    my $esn = $this->option('elementSetName');
-    my $records = $this->{records}->{$esn};
-    return unless defined $records;
-    my $n = @$records;
+    # Each cache is fetched in its own element set and record syntax
+    foreach my $key (@{ $this->{cacheKeys} }) {
+	$this->_checkRequired1($key);
+    }
+}
+
+
+# PRIVATE to the _checkRequired() method
+sub _checkRequired1 {
+    my $this = shift();
+    my($key) = @_;
 
-    ###	If our interface to the C function makePresentRequest allowed
-    #	us to generate multiple ranges (using the Present Request
-    #	APDU's additionalRange parameter), we could consider using
-    #	that and making a single big present request instead of
-    #	(potentially) several little ones; but it's slightly tricky to
-    #	do, and it's not clear that it would be more efficient, so
-    #	let's not lose any sleep over it for now.
+    my $records = $this->{records}->{$key};
+    my $n = @$records;
 
-    my($first, $howmany);
+    my @ranges;			# (first, howmany) pairs
+    my $first;
     for (my $i = 1; $i <= $n; $i++) {
 	my $rec = $records->[$i];
-	if (!defined $first) {
-	    # We've not yet seen a record we want to fetch
-	    if (defined $rec && $rec == CALLER_REQUESTED) {
-		# ... but now we have!  Start a new range
-		$first = $i;
-		$records->[$i] = RS_REQUESTED;
-	    }
-	} else {
-	    # We're already gathering a range
-	    if (defined $rec && $rec == CALLER_REQUESTED) {
-		# Range continues: mark that we're requesting this record
-		$records->[$i] = RS_REQUESTED;
-	    } else {
-		# This record is one past the end of the range we want
-		$howmany = $i-$first;
-		$this->_send_presentRequest($first, $i-$first);
-		$first = undef;	# prepare for next range
-	    }
+	if (defined $rec && $rec == CALLER_REQUESTED) {
+	    # Start or continue a range: mark that we're requesting it
+	    $first = $i if !defined $first;
+	    $records->[$i] = RS_REQUESTED;
+	} elsif (defined $first) {
+	    # This record is one past the end of the range we want
+	    push @ranges, $first, $i-$first;
+	    $first = undef;	# prepare for next range
 	}
     }
+
+    # The server knows nothing of a result set made from a cached
+    # search, so the search must go first
+    if (@ranges && $this->{detached}) {
+	$this->{detached} = 0;
+	$this->{researching} = 1;
+	$this->{conn}->_research($this->{rsName});
+    }
+
+    my $max = $this->{conn}->{noRanges} ? 1 : $this->option('presentRanges');
+    $max = 1 if $max < 1;
+    while (@ranges) {
+	$this->_send_presentRequest($key, splice(@ranges, 0, 2*$max));
+    }
 }
 
 
 # PRIVATE to the _checkRequired() method
 #
-#   ###	Instead of sending these out immediately, we should put them
-#	on a queue to be sent out when the connection is quiet (which
-#	may be immediately): in this way we work with broken (but
-#	compliant!) servers which may throw away anything after the
-#	first APDU in their connection's input queue.  In Real Life,
-#	the current version will Nearly Always(tm) work, but this is a
-#	good place to look if we get bug reports in this area.
+# The request is not necessarily sent at once: the connection holds
+# it back until there's room in its pipelining window, which for
+# servers that throw away anything after the first APDU in their
+# input queue should be set to a single request.
 #
 sub _send_presentRequest {
     my $this = shift();
-    my($first, $howmany) = @_;
+    my($key, $first, $howmany, @more) = @_;
 
-    my $refId = _bind_refId($this->{rsName}, $first, $howmany);
+    my $refId = _bind_refId($this->{rsName}, $this->{keyIndex}->{$key},
+			    $first, $howmany, @more);
+    my($syntax, $esn) = _split_key($key);
     my $errmsg = '';
-    my $pr = Net::Z3950::makePresentRequest($refId,
-				       $this->option('namedResultSets') ?
-					$this->{rsName} : 'default',
-				       $first, $howmany,
-				       $this->option('elementSetName'),
-				       $this->preferredRecordSyntax(),
-				       $errmsg);
-    die "can't make present request: $errmsg" if !defined $pr;
-    $this->{conn}->_enqueue($pr);
+    my $conn = $this->{conn};
+    Net::Z3950::makePresentRequest($conn->{ctx}, $refId,
+				   $this->option('namedResultSets') ?
+				    $this->{rsName} : 'default',
+				   $first, $howmany, \@more,
+				   $esn, $syntax,
+				   $this->option('maxSegmentCount'),
+				   $this->option('maxRecordSize'),
+				   $this->option('maxSegmentSize'),
+				   $errmsg)
+	or die "can't make present request: $errmsg";
+    $conn->{refId2cb}->{$refId} = \&_read_ahead_done
+	if $this->{readAhead};
+    $conn->_enqueue($refId);
 }
 
 
@@ -373,11 +864,16 @@ sub _add_records {
     my $this = shift();
     my($presentResponse) = @_;
 
-    my($rsName, $first, $howmany) =
+    my($rsName, $index, @ranges) =
 	_unbind_refId($presentResponse->referenceId());
-    ### Should check presentStatus
+    my $key = $this->{cacheKeys}->[$index];
+    ### Should check presentStatus (other than for additionalRanges)
     my $n = $presentResponse->numberOfRecordsReturned();
 
+    # The records of all the ranges come back as a single list
+    my @slots = _range_slots(@ranges);
+    my $howmany = @slots;
+
     # Sanity checks
     if ($rsName ne $this->{rsName}) {
 	die "rs '" . $this->{rsName} . "' was sent records for '$rsName'";
@@ -386,9 +882,13 @@ sub _add_records {
 	die "rs '$rsName' got $n records but only asked for $howmany";
     }
 
-    if ($this->_insert_records($presentResponse, $first, $howmany)) {
-	my $esn = $this->option('elementSetName');
-	my $records = $this->{records}->{$esn};
+    # Under segmentation, $n counts the records in the segments too,
+    # some of which may have been fragments; so we go by the number
+    # of slots actually filled.
+    my $filled = $this->_insert_records($presentResponse, \@slots, $key);
+    if (defined $filled) {
+	$n = $filled;
+	my $records = $this->{records}->{$key};
 	for (my $i = $n; $i < $howmany; $i++) {
 	    # We asked for this record but didn't get it, for whatever
 	    # reason.  Mark the record down to "requested by the user
@@ -397,15 +897,27 @@ sub _add_records {
 	    ###	This might not always be The Right Thing -- if the
 	    #	error is a permanent one, we'll end up looping, asking
 	    #	for it again and again.  We could further overload the
-	    #	meaning of numbers in the {records}->{$esn} array to
+	    #	meaning of numbers in the {records}->{$key} array to
 	    #	count how many times we've tried, and bomb out after
 	    #	"too many" tries.
-	    $this->_check_slot($records->[$first+$i], $first+$i);
-	    $records->[$first+$i] = CALLER_REQUESTED;
+	    $this->_check_slot($records->[$slots[$i]], $slots[$i]);
+	    $records->[$slots[$i]] = CALLER_REQUESTED;
 	}
     }
 
     if ($n < $howmany) {
+	# Many servers ignore additionalRanges and return only the
+	# first range.  If that's what seems to have happened -- all
+	# of the first range came back, nothing more, and the server
+	# says that's everything -- then stop sending them to this
+	# connection's server; at worst, this just means we go back
+	# to one range per request.  A response cut short for any
+	# other reason (by the message size, say) proves nothing.
+	$this->{conn}->{noRanges} = 1
+	    if @ranges > 2 && $n == $ranges[1] &&
+		$presentResponse->presentStatus() ==
+		    Net::Z3950::PresentStatus::Success;
+
 	# We're missing at least one record, which we've marked
 	# CALLER_REQUESTED; restart the idle watcher so it issues a
 	# new present request at an appropriate point.
@@ -414,82 +926,275 @@ sub _add_records {
 }
 
 
-# PRIVATE to the _new() and _add_record() methods
-sub _insert_records {
+# PRIVATE to the Net::Z3950::Connection class's _dispatch() method
+#
+# Inserts the records of $segment, one of the Segment APDUs that may
+# precede a present response.  They go in the slots following those
+# filled by the segments before.
+#
+sub _add_segment {
     my $this = shift();
-    my($apdu, $first, $howmany) = @_;
-    # $first is 1-based; $howmany is used only when storing NSDs.
+    my($segment) = @_;
 
-    my $esn = $this->option('elementSetName'); ### might this have changed?
-    my $records = $this->{records}->{$esn};
-    my $rawrecs = $apdu->records();
+    # Streamed records are in already: see _stream_record()
+    return if defined $segment->streamed();
 
-    # Some badly-behaved servers claim records but don't include any.
-    # Fake up an error in this case.
-    unless (defined $rawrecs) {
-	$rawrecs = bless {
-	    diagnosticSetId => '1.2.840.10003.4.1', # BIB-1 diagnostic set
-	    condition => 14, # System error in presenting records
-	    addinfo => 'No records supplied by server',
-	}, 'Net::Z3950::APDU::DefaultDiagFormat';
+    my $context = $this->_response_context($segment->referenceId());
+    my $rawrecs = $segment->segmentRecords();
+    foreach my $record (@$rawrecs) {
+	$this->_insert_record($context, $record, 1);
     }
+}
 
-    if ($rawrecs->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
-	# Now what?  We want to report the error back to the caller,
-	# but we got here from a callback from the event loop, and
-	# we're now miles away from any notional "flow of control"
-	# where we could pop up with an error.  Instead, we lodge a
-	# copy of this error in the slots for each record requested,
-	# so that when the caller invokes record(), we can arrange
-	# that we set appropriate error information.
-	for (my $i = 0; $i < $howmany; $i++) {
-	    $records->[$first+$i] = $rawrecs;
-	}
-	return 0;
-    }
 
-    {
-	#   ###	Should deal more gracefully with multiple
-	#	non-surrogate diagnostics (Z_Records_multipleNSD)
-	my $type = 'Net::Z3950::APDU::NamePlusRecordList';
-	if (!$rawrecs->isa($type)) {
-	    die "expected $type, got " . ref($rawrecs);
+# PRIVATE to the _add_piggyback() and _add_records() methods
+#
+# Returns the number of the requested slots filled, counting those
+# filled by any segments or streamed records before, or undef if the
+# response carried a non-surrogate diagnostic instead of records.
+#
+sub _insert_records {
+    my $this = shift();
+    my($apdu, $slots, $key) = @_;
+    # $slots is a reference to a list of the 1-based positions, in
+    # order, of the records we asked for.  $key is that of the cache
+    # for the element set and record syntax they were requested in.
+
+    my $present = $apdu->isa('Net::Z3950::APDU::PresentResponse');
+    my $context = $present ?
+	delete $this->{streams}->{$apdu->referenceId()} : undef;
+    $context = $this->_insert_context($key, $slots) if !defined $context;
+
+    if (!$present || !defined $apdu->streamed()) {
+	my $rawrecs = $apdu->records();
+
+	# Some badly-behaved servers claim records but don't include any.
+	# Fake up an error in this case.
+	unless (defined $rawrecs) {
+	    $rawrecs = bless {
+		diagnosticSetId => '1.2.840.10003.4.1', # BIB-1 diagnostic set
+		condition => 14, # System error in presenting records
+		addinfo => 'No records supplied by server',
+	    }, 'Net::Z3950::APDU::DefaultDiagFormat';
 	}
-    }
 
-    my $n = @$rawrecs;
-    for (my $i = 0; $i < $n; $i++) {
-	$this->_check_slot($records->[$first+$i], $first+$i)
-	    if $first > 1;		# > 1 => it's a present response
+	if ($rawrecs->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
+	    # Now what?  We want to report the error back to the caller,
+	    # but we got here from a callback from the event loop, and
+	    # we're now miles away from any notional "flow of control"
+	    # where we could pop up with an error.  Instead, we lodge a
+	    # copy of this error in the slots for each record requested
+	    # (and not already filled by segments), so that when the
+	    # caller invokes record(), we can arrange that we set
+	    # appropriate error information.
+	    my $records = $this->{records}->{$key};
+	    foreach my $slot (@$slots[$context->{next} .. $#$slots]) {
+		$records->[$slot] = $rawrecs;
+	    }
+	    $this->_cache_evict($context->{batch}) if $context->{limited};
+	    return undef;
+	}
 
-	my $record = $rawrecs->[$i];
 	{
-	    # Merely a redundant sanity check
-	    my $type = 'Net::Z3950::APDU::NamePlusRecord';
-	    if (!$record->isa($type)) {
-		die "expected $type, got " . ref($record);
+	    #   ###	Should deal more gracefully with multiple
+	    #	non-surrogate diagnostics (Z_Records_multipleNSD)
+	    my $type = 'Net::Z3950::APDU::NamePlusRecordList';
+	    if (!$rawrecs->isa($type)) {
+		die "expected $type, got " . ref($rawrecs);
 	    }
 	}
 
-	### We're ignoring databaseName -- do we have any use for it?
-	my $which = $record->which();
-	if ($which == Net::Z3950::NamePlusRecord::DatabaseRecord) {
-	    $records->[$first+$i] = $this->_tweak($record->databaseRecord());
-	} elsif ($which == Net::Z3950::NamePlusRecord::SurrogateDiagnostic) {
-	    $records->[$first+$i] = $record->surrogateDiagnostic();
+	foreach my $record (@$rawrecs) {
+	    $this->_insert_record($context, $record, $present);
+	}
+    }
+
+    # A record whose final fragment never came is treated as missing
+    delete $context->{fragment};
+    $this->_cache_evict($context->{batch}) if $context->{limited};
+    return $context->{next};
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _streamed() method
+#
+# Inserts $record, a record of the present response to the request
+# $refId (or of a segment preceding it), while that response is still
+# being decoded.  The rest of the work is done when the response
+# itself is dispatched to _add_records().
+#
+sub _stream_record {
+    my $this = shift();
+    my($refId, $i, $record) = @_;
+
+    # $i is not used: fragments mean that it's not necessarily the
+    # index of the slot
+    $this->_insert_record($this->_response_context($refId), $record, 1);
+}
+
+
+# PRIVATE to the _add_segment() and _stream_record() methods
+#
+# Returns the context in which the records of the present response
+# to the request $refId are being inserted, before the response
+# itself arrives, making it when the first of them does.
+#
+sub _response_context {
+    my $this = shift();
+    my($refId) = @_;
+
+    my $context = $this->{streams}->{$refId};
+    return $context if defined $context;
+
+    my($rsName, $index, @ranges) = _unbind_refId($refId);
+    $context = $this->_insert_context($this->{cacheKeys}->[$index],
+				      [ _range_slots(@ranges) ]);
+    return $this->{streams}->{$refId} = $context;
+}
+
+
+# PRIVATE to the _add_records() and _response_context() methods
+#
+# Returns the slots of the records asked for by a present request for
+# the ranges @ranges, which are (start, count) pairs.
+#
+sub _range_slots {
+    my(@ranges) = @_;
+
+    my @slots;
+    for (my $i = 0; $i < @ranges; $i += 2) {
+	push @slots, $ranges[$i] .. $ranges[$i]+$ranges[$i+1]-1;
+    }
+    return @slots;
+}
+
+
+# PRIVATE to the _insert_records() and _response_context() methods
+#
+# Returns what _insert_record() needs to know to insert the records of
+# a single response into the cache $key, in order, into the slots
+# listed in @$slots.  This includes how many have been inserted so far,
+# and any record being reassembled from fragments.
+#
+sub _insert_context {
+    my $this = shift();
+    my($key, $slots) = @_;
+
+    return {
+	key => $key,
+	slots => $slots,
+	next => 0,		# index in @$slots of the next slot to fill
+	fragment => undef,	# [ class, data so far ] when reassembling
+	syntax => (_split_key($key))[0],
+	limited => $this->_cache_limited(),
+	batch => $this->{cacheStamp} + 1,
+	store => $this->_record_store(),
+	callback => $this->option('recordCallback'),
+    };
+}
+
+
+# Classes of records reassembled from fragments that aren't
+# externally tagged, and so don't say what they are
+my %_fragmentClasses = (
+    Net::Z3950::RecordSyntax::USMARC() => 'Net::Z3950::Record::USMARC',
+    Net::Z3950::RecordSyntax::UKMARC() => 'Net::Z3950::Record::UKMARC',
+    Net::Z3950::RecordSyntax::NORMARC() => 'Net::Z3950::Record::NORMARC',
+    Net::Z3950::RecordSyntax::LIBRISMARC() => 'Net::Z3950::Record::LIBRISMARC',
+    Net::Z3950::RecordSyntax::DANMARC() => 'Net::Z3950::Record::DANMARC',
+    Net::Z3950::RecordSyntax::UNIMARC() => 'Net::Z3950::Record::UNIMARC',
+    Net::Z3950::RecordSyntax::MAB() => 'Net::Z3950::Record::MAB',
+    Net::Z3950::RecordSyntax::SUTRS() => 'Net::Z3950::Record::SUTRS',
+    Net::Z3950::RecordSyntax::TEXT_HTML() => 'Net::Z3950::Record::HTML',
+    Net::Z3950::RecordSyntax::TEXT_XML() => 'Net::Z3950::Record::XML',
+    Net::Z3950::RecordSyntax::APPLICATION_XML() => 'Net::Z3950::Record::XML',
+);
+
+
+# PRIVATE to the _insert_records(), _add_segment() and _stream_record()
+# methods
+#
+# Puts $record, a Net::Z3950::APDU::NamePlusRecord, into the next slot
+# of the cache described by $context -- or, if it's a fragment, adds
+# it to the record being reassembled, which goes in the slot when its
+# final fragment arrives.  $present is true if the record came in a
+# present response rather than piggy-backed on a search response.
+#
+sub _insert_record {
+    my $this = shift();
+    my($context, $record, $present) = @_;
+
+    # Any more records than we asked for are ignored
+    my $slot = $context->{slots}->[$context->{next}];
+    return if !defined $slot;
+
+    {
+	# Merely a redundant sanity check
+	my $type = 'Net::Z3950::APDU::NamePlusRecord';
+	if (!$record->isa($type)) {
+	    die "expected $type, got " . ref($record);
+	}
+    }
+
+    ### We're ignoring databaseName -- do we have any use for it?
+    my $which = $record->which();
+    my $rec;
+    if ($which == Net::Z3950::NamePlusRecord::DatabaseRecord) {
+	$rec = $record->databaseRecord();
+    } elsif ($which == Net::Z3950::NamePlusRecord::SurrogateDiagnostic) {
+	$rec = $record->surrogateDiagnostic();
+    } elsif ($which == Net::Z3950::NamePlusRecord::StartingFragment) {
+	my $frag = $record->startingFragment();
+	my $class = ref($frag) || $_fragmentClasses{$context->{syntax}}
+	    or die "can't reassemble record of syntax $context->{syntax}";
+	# Only opaque records can be reassembled, not structures
+	die "can't reassemble fragmented $class record"
+	    if ref $frag && !$frag->isa('Net::Z3950::Record::Opaque');
+	# A copy, since the fragment's data may be a read-only string
+	my $data = ref $frag ? ${ $frag->rawdata_ref() } : $frag;
+	$context->{fragment} = [ $class, $data ];
+	return;
+    } else {
+	my $frag;
+	if ($which == Net::Z3950::NamePlusRecord::IntermediateFragment) {
+	    $frag = $record->intermediateFragment();
+	} elsif ($which == Net::Z3950::NamePlusRecord::FinalFragment) {
+	    $frag = $record->finalFragment();
 	} else {
-	    ### Should deal with segmentation fragments
 	    die "expected DatabaseRecord, got record-type $which";
 	}
+	my $fragment = $context->{fragment}
+	    or die "rs '$this->{rsName}' got a fragment of no record";
+	$fragment->[1] .= ref $frag ? ${ $frag->rawdata_ref() } : $frag;
+	return if $which != Net::Z3950::NamePlusRecord::FinalFragment;
+	delete $context->{fragment};
+	$rec = bless \$fragment->[1], $fragment->[0];
     }
 
-    return 1;
+    $context->{next}++;
+    my $key = $context->{key};
+    my $records = $this->{records}->{$key};
+    $this->_check_slot($records->[$slot], $slot) if $present;
+    if ($which == Net::Z3950::NamePlusRecord::SurrogateDiagnostic) {
+	$records->[$slot] = $rec;
+	return;
+    }
+
+    $rec = $this->_tweak($rec, $context->{syntax});
+    $records->[$slot] = $rec;
+    my $bytes = $this->_note_size($rec);
+    $this->_cache_add($key, $slot, $bytes) if $context->{limited};
+    $context->{store}->_store($slot, $rec) if defined $context->{store};
+    $this->{snapshot}->{$key}->[$slot] = _copy_record($rec)
+	if defined $this->{snapshot};
+    &{ $context->{callback} }($this, $slot, $rec)
+	if defined $context->{callback};
 }
 
 
-# PRIVATE to _insert_records()
+# PRIVATE to _insert_record()
 sub _tweak {
-    my($this, $rec) = @_;
+    my($this, $rec, $syntax) = @_;
 
     # Ninety-nine times out of a hundred, all we need to do here is
     # return the $rec argument directly, so that the application gets
@@ -500,7 +1205,7 @@ sub _tweak {
     # the benefit of those misbegotten monstrosities, we wrap such
     # unwanted USMARC records in an otherwise empty OPAC-record
     # structure.  <sigh>
-    if ($this->preferredRecordSyntax() == Net::Z3950::RecordSyntax::OPAC &&
+    if ($syntax == Net::Z3950::RecordSyntax::OPAC &&
 	$rec->isa("Net::Z3950::Record::USMARC")) {
 	return bless {
 	    bibliographicRecord => $rec,
@@ -519,7 +1224,7 @@ sub preferredRecordSyntax {
 }
 
 
-# PRIVATE to the _add_records() and _insert_records() methods
+# PRIVATE to the _add_records() and _insert_record() methods
 sub _check_slot {
     my $this = shift();
     my($rec, $which) = @_;
@@ -547,24 +1252,178 @@ sub _check_slot {
 }
 
 
+# PRIVATE to the Net::Z3950::Connection class's _dispatch() method
+#
+# This result set was made from a Search response replayed from the
+# manager's search cache, whose entry $entry also holds copies of the
+# records fetched so far for that search.  Take copies of our own, so
+# that nothing done to them here can reach the cache.  Records
+# fetched from now on are added to the entry in turn.  No search has
+# been run on this connection, so any other records can't be fetched
+# until it has: see _checkRequired1().
+#
+sub _adopt_cached {
+    my $this = shift();
+    my($entry) = @_;
+
+    my $limited = $this->_cache_limited();
+    my $batch = $this->{cacheStamp} + 1;
+    my $store = $this->_record_store();
+    foreach my $key (sort keys %{ $entry->{records} }) {
+	my $cache = $entry->{records}->{$key};
+	$this->_register_key($key);
+	my $records = $this->{records}->{$key};
+	for (my $slot = 1; $slot < @$cache; $slot++) {
+	    next if !defined $cache->[$slot] || ref $records->[$slot];
+	    my $rec = $records->[$slot] = _copy_record($cache->[$slot]);
+	    my $bytes = $this->_note_size($rec);
+	    $this->_cache_add($key, $slot, $bytes) if $limited;
+	    $store->_store($slot, $rec) if defined $store;
+	}
+    }
+
+    $this->_cache_evict($batch) if $limited;
+    $this->{snapshot} = $entry->{records};
+    $this->{detached} = 1;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _dispatch() method
+#
+# The search that made this result set has been put in the manager's
+# search cache, whose entry keeps its records in the record caches
+# %$snapshot.  Copy the records fetched so far -- but not diagnostics,
+# which may have been transient, nor requested-markers, which mean
+# nothing there -- and arrange for records fetched later to be copied
+# as they arrive.  The cache has copies rather than the records
+# themselves, so that neither it nor this result set can change the
+# other's, and evicting records from this result set's cache leaves
+# them in the search cache.
+#
+sub _snapshot_into {
+    my $this = shift();
+    my($snapshot) = @_;
+
+    foreach my $key (keys %{ $this->{records} }) {
+	my $records = $this->{records}->{$key};
+	for (my $slot = 1; $slot < @$records; $slot++) {
+	    my $rec = $records->[$slot];
+	    $snapshot->{$key}->[$slot] = _copy_record($rec)
+		if ref $rec && $rec->isa('Net::Z3950::Record');
+	}
+    }
+
+    $this->{snapshot} = $snapshot;
+}
+
+
+# PRIVATE to the _snapshot_into(), _adopt_cached() and _insert_record()
+# methods
+#
+# Returns a copy of the record $rec that shares no data with it at the
+# top level.  Lazy records are handles on C structures which can't be
+# copied, so they are translated into ordinary ones.
+#
+sub _copy_record {
+    my($rec) = @_;
+
+    return bless [ @$rec ], 'Net::Z3950::Record::GRS1'
+	if $rec->isa('Net::Z3950::Record::GRS1::Lazy');
+    return bless { %$rec }, 'Net::Z3950::Record::OPAC'
+	if $rec->isa('Net::Z3950::Record::OPAC::Lazy');
+
+    my $type = reftype($rec);
+    return bless \(my $data = $$rec), ref $rec if $type eq 'SCALAR';
+    return bless [ @$rec ], ref $rec if $type eq 'ARRAY';
+    return bless { %$rec }, ref $rec if $type eq 'HASH';
+    return $rec;
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _dispatch() and
+# _request_timed_out() methods
+#
+# The search sent by _checkRequired1() for this detached result set
+# has been answered by $apdu, or has timed out if $apdu is undefined.
+# If it failed, the records that were waiting for it to be sent are
+# given its diagnostic; those already asked for will get the server's
+# own diagnostics in response.  If it timed out, it's sent again when
+# more records are wanted.
+#
+sub _researched {
+    my $this = shift();
+    my($apdu) = @_;
+
+    delete $this->{researching};
+    if (!defined $apdu) {
+	$this->{detached} = 1;
+	return;
+    }
+    return if $apdu->searchStatus();
+
+    my $diag = $apdu->records();
+    if (!ref $diag || !$diag->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
+	$diag = bless {
+	    diagnosticSetId => '1.2.840.10003.4.1', # BIB-1 diagnostic set
+	    condition => 3, # unsupported search -- near enough
+	    addinfo => 'search for cached result set failed',
+	}, 'Net::Z3950::APDU::DefaultDiagFormat';
+    }
+    foreach my $records (values %{ $this->{records} }) {
+	foreach my $rec (@$records) {
+	    $rec = $diag
+		if defined $rec && !ref $rec && $rec == CALLER_REQUESTED;
+	}
+    }
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _request_timed_out()
+#
+# The present request whose reference ID is $refId has timed out, and
+# its response will be discarded if it ever arrives; so the records it
+# asked for that are still awaited are marked as never having been
+# requested, and asking for them again sends a new request.  That
+# request has the same reference ID, so the context of any segments or
+# streamed records already taken from this response must go too, or
+# the new response's records would be inserted after them.
+#
+sub _expire_records {
+    my $this = shift();
+    my($refId) = @_;
+
+    delete $this->{streams}->{$refId};
+    my($rsName, $index, @ranges) = _unbind_refId($refId);
+    my $records = $this->{records}->{$this->{cacheKeys}->[$index]};
+    for (my $i = 0; $i < @ranges; $i += 2) {
+	foreach my $slot ($ranges[$i] .. $ranges[$i]+$ranges[$i+1]-1) {
+	    my $rec = $records->[$slot];
+	    $records->[$slot] = undef
+		if defined $rec && !ref $rec && $rec == RS_REQUESTED;
+	}
+    }
+}
+
+
 # PRIVATE to the _send_presentRequest() and _add_records() methods
 #
 # These functions encapsulate the scheme used for binding a result-set
-# name, the first record requested and the number of records requested
-# into a single opaque string, which we then use as a reference Id so
-# that it gets passed back to us when the present response arrives
-# (otherwise there's no way to know from the response what we asked
-# for, and therefore where in the result set to insert the records.)
+# name, the index of the cache the records are for, and the ranges of
+# records requested (each a first record and a number of records)
+# into a single opaque string, which we then use
+# as a reference Id so that it gets passed back to us when the present
+# response arrives (otherwise there's no way to know from the response
+# what we asked for, and therefore where in the result set to insert
+# the records.)  Result-set names never contain "-".
 #
 sub _bind_refId {
-    my($rsName, $first, $howmany) = @_;
-    return $rsName . '-' . $first . '-' . $howmany;
+    my($rsName, @ranges) = @_;
+    return join('-', $rsName, @ranges);
 }
 
 sub _unbind_refId {
     my($refId) = @_;
-    $refId =~ /(.*)-(.*)-(.*)/;
-    return ($1, $2, $3);
+    return split /-/, $refId;
 }
 
 
@@ -611,7 +1470,7 @@ PLEASE USE record() INSTEAD.>
 
 =cut
 
-# We'd like to do this by just returning {records}->{$esn} of course, but
+# We'd like to do this by just returning {records}->{$key} of course, but
 # we can't do that because (A) it's 1-based, and (B) we need undefined
 # slots where errors occur rather than error-information APDUs.  So we
 # make a copy.
@@ -628,8 +1487,7 @@ sub records {
     warn "DEPRECATED method records() called on $this";
 
     my $size = $this->size();
-    my $esn = $this->option('elementSetName');
-    my $records = $this->{records}->{$esn};
+    my $records = $this->{records}->{$this->_cache_key()};
 
     # Issue requests for any records not already available or requested.
     for (my $i = 0; $i < $size; $i++) {
@@ -652,10 +1510,9 @@ sub records {
 	# OK, we have at least one slot in $records which is not a
 	# reference either to a legitimate record or to an error
 	# APDU, so we need to wait for another server response.
-	my $conn = $this->{conn};
-	my $c2 = $conn->manager()->wait();
-	die "wait() yielded wrong connection"
-	    if $c2 ne $conn;
+	# Events on other connections are kept for later.
+	$this->{conn}->expect(Net::Z3950::Op::Get, "get")
+	    or last;
     }
 
     my @res;
@@ -685,12 +1542,12 @@ sub delete {
 
     my $errmsg = '';
     my $refId = _bind_refId($this->{rsName}, "delete", 0);
-    my $dr = Net::Z3950::makeDeleteRSRequest($refId,
-					     $this->{rsName},
-					     $errmsg);
-    die "can't make delete-RS request: $errmsg" if !defined $dr;
     my $conn = $this->{conn};
-    $conn->_enqueue($dr);
+    Net::Z3950::makeDeleteRSRequest($conn->{ctx}, $refId,
+				    $this->{rsName},
+				    $errmsg)
+	or die "can't make delete-RS request: $errmsg";
+    $conn->_enqueue($refId);
 
     ### The remainder of this method enforces synchronousness
     if (!$conn->expect(Net::Z3950::Op::DeleteRS, "deleteRS")) {
@@ -701,6 +1558,122 @@ sub delete {
 }
 
 
+=head2 sort()
+
+	$sorted = $rs->sort('1=4 <i', '1=31 >');
+	if (!defined $sorted) {
+		print "can't sort: ", $rs->errmsg(), "\n";
+	}
+
+Requests the server to sort the result set corresponding to C<$rs>,
+making a new result set, so that its records can be fetched in order
+without fetching them all first.  Each argument is a sort key,
+consisting of a field and flags separated by white space.  The field
+is either a string such as C<title>, which the server interprets, or
+a set of BIB-1 attributes such as C<1=4>, several of which are joined
+with commas.  The flags are C<E<lt>> for ascending order or
+C<E<gt>> for descending, and C<i> for a case-insensitive or C<s> for
+a case-sensitive comparison.  The first key is the most significant.
+
+In synchronous mode, returns the sorted result set, or an undefined
+value if the sort failed, in which case the C<errcode()> and
+C<addinfo()> methods say why.  In asynchronous mode, returns an
+undefined value at once: when the sort is done, the connection's
+C<op()> is C<Net::Z3950::Op::Sort>, and its C<resultSet()> method
+returns the sorted result set, or an undefined value with the
+connection's C<errcode()> and C<addinfo()> set.
+
+The sorted result set starts with the options of I<$rs>.  Unless the
+C<namedResultSets> option is set, the server sorts I<$rs> in place,
+and I<$rs> itself should no longer be used.
+
+=cut
+
+sub sort {
+    my $this = shift();
+    my(@keys) = @_;
+
+    # The server knows nothing of a result set made from a cached
+    # search, so the search must go first, as in _checkRequired1()
+    my $conn = $this->{conn};
+    if ($this->{detached}) {
+	$this->{detached} = 0;
+	$this->{researching} = 1;
+	$conn->_research($this->{rsName});
+    }
+
+    # The sorted result set takes the next name, like a new search's
+    my $rss = $conn->{resultSets};
+    my $nrss = @$rss;
+    my $errmsg = '';
+    my $refId = _bind_refId($this->{rsName}, "sort", $nrss);
+    my $named = $this->option('namedResultSets');
+    Net::Z3950::makeSortRequest($conn->{ctx}, $refId,
+				$named ? $this->{rsName} : 'default',
+				$named ? $nrss : 'default',
+				join(' ', @keys), $errmsg)
+	or die "can't make sort request: $errmsg";
+    $rss->[$nrss] = 0;		# placeholder
+    $conn->_enqueue($refId);
+    return undef
+	if $this->option('async');
+
+    if (!$conn->expect(Net::Z3950::Op::Sort, "sort") ||
+	!defined $conn->{resultSet}) {
+	# Error code and addinfo are in the connection: copy them across
+	$this->{errcode} = $conn->{errcode};
+	$this->{addinfo} = $conn->{addinfo};
+	return undef;
+    }
+
+    return $conn->{resultSet};
+}
+
+
+# PRIVATE to the Net::Z3950::Connection class's _dispatch() method
+#
+# Returns the result set $rsName made by sorting this one, as reported
+# by $sortResponse; or, if the sort failed, sets the connection's
+# error indicators and returns undef.  The new result set is made as
+# though from a search response, which is faked up from this one's.
+#
+sub _sorted {
+    my $this = shift();
+    my($rsName, $sortResponse) = @_;
+
+    if ($sortResponse->sortStatus() == Net::Z3950::SortStatus::Failure) {
+	my $conn = $this->{conn};
+	my $diags = $sortResponse->diagnostics();
+	my $diag = defined $diags ? $diags->[0] : undef;
+	if (ref $diag && $diag->isa('Net::Z3950::APDU::DefaultDiagFormat')) {
+	    ### $diag->diagnosticSetId() is not used
+	    $conn->{errcode} = $diag->condition();
+	    $conn->{addinfo} = $diag->addinfo();
+	} else {
+	    $conn->{errcode} = 207; # cannot sort according to sequence
+	    $conn->{addinfo} = "no diagnostic records supplied by server";
+	}
+	return undef;
+    }
+
+    # A partial sort is still a result set, with all the records in it
+    my $count = $sortResponse->resultCount();
+    my $searchResponse = bless {
+	%{ $this->{searchResponse} },
+	referenceId => $rsName,
+	resultCount => defined $count ? $count : $this->size(),
+	numberOfRecordsReturned => 0,
+	records => undef,
+    }, ref $this->{searchResponse};
+
+    my $sorted = _new Net::Z3950::ResultSet($this->{conn}, $rsName,
+					    $searchResponse);
+    $sorted->{options} = { %{ $this->{options} } }
+	if defined $this->{options};
+    return $sorted;
+}
+
+
 =head2 errcode(), addinfo(), errmsg()
 
 	if (!defined $rs->record($i)) {
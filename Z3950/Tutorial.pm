@@ -234,9 +234,14 @@ For CCL searches sent directly to the server (query type C<ccl>), the
 exact interpretation of the qualifiers is the server's
 responsibility.  For searches compiled on the client side (query side
 C<ccl2rpn>) the interpretation of the qualifiers in terms of type-1
-attributes is determined by the contents of a file called
-I<### not yet implemented>.
-The format of this file is described in the Yaz documentation.
+attributes is determined by the contents of a file called F<ccl.qual>
+in the current directory, or whatever file the manager's
+C<cclQualifiers> option names.  The format of this file is described
+in the Yaz documentation.  It is loaded once, when first needed, and
+shared by all of the manager's connections; if it changes, it is
+loaded again before the next search or scan.  A program can also load
+another file explicitly using the manager's C<loadQualifiers()>
+method.
 
 B<CQL Queries>
 
@@ -268,11 +273,19 @@ which database is to be searched.
 
 =head2 Retrieval
 
-By default, records are requested from the server one at a time;
-this can be quite slow when retrieving several records. There are two
-ways of improving this. First, the C<present()> method can be used to
-explicitly precharge the cache. Its parameters are a start record and
-record count. In the following example, the present() is optional and
+By default, the first record is requested from the server on its own;
+but when C<record()> is called for each record in turn, the module
+notices this, and doubles the number of records it asks for each time
+it goes back to the server, up to a limit based on the
+C<preferredMessageSize> option and the sizes of the records received
+so far.  In synchronous mode it also asks for the next batch of
+records while the application is still working through the current
+one.  This can be turned off by setting the C<adaptivePrefetch>
+option to 0, in which case records are requested one at a time, which
+can be quite slow when retrieving several records.  There are two
+ways of taking control of this yourself.  First, the C<present()>
+method can be used to explicitly precharge the cache.  Its parameters
+are a start record and record count. In the following example, the present() is optional and
 merely makes the code run faster:
 
 	$rs->present(11, 5) or die ".....";
@@ -282,7 +295,8 @@ merely makes the code run faster:
 	}
 
 The second way is with the C<prefetch> option. Setting this to a 
-positive integer makes the C<record()> method fetch the next N
+positive integer overrides the adaptive behaviour described above,
+and makes the C<record()> method fetch the next N
 records and place them in the cache if the the current record
 isn't already there. So the following code would cause two bouts of
 network activity, each retrieving 10 records.
@@ -293,6 +307,27 @@ network activity, each retrieving 10 records.
 	    ...
 	}
 
+A third way avoids the separate request for the first records
+altogether, by asking the server to return them along with the search
+response.  The C<smallSetUpperBound>, C<largeSetLowerBound> and
+C<mediumSetPresentNumber> options control how many records are
+returned this way, and the C<smallSetElementSetName> and
+C<mediumSetElementSetName> options control their element set: they
+are cached as if they had been fetched by C<record()> using that
+element set, and C<record()> returns them even if C<elementSetName>
+is different, provided the record syntax is the same, rather than
+fetching them again.  So the following code fetches a search and its
+first ten records in a single round trip:
+
+	$conn->option(largeSetLowerBound => 1000000);
+	$conn->option(mediumSetPresentNumber => 10);
+	$conn->option(mediumSetElementSetName => 'B');
+	$rs = $conn->search('@attr 1=4 dinosaur');
+	foreach my $i (1..10) {
+	    my $rec = $rs->record($i);
+	    ...
+	}
+
 In asynchronous mode, C<present()> and C<prefetch> merely cause the
 records to be scheduled for retrieval.
 
@@ -328,6 +363,24 @@ C<Net::Z3950::RecordSyntax::TEXT_HTML>
 (As always, C<option()> may also be invoked with no ``value''
 parameter to return the current value of the option.)
 
+=head2 Sorting
+
+Rather than fetching a whole result set to sort its records yourself,
+you can ask the server to sort it, and then fetch only as many of the
+sorted records as you need:
+
+	$sorted = $rs->sort('1=4 <i') or die $rs->errmsg();
+	print $sorted->record($_)->render() foreach 1 .. 10;
+
+Each argument to C<sort()> is a sort key: a field, here given as the
+BIB-1 use attribute for title, followed by flags - C<E<lt>> or
+C<E<gt>> for ascending or descending order, and C<i> or C<s> for a
+case-insensitive or case-sensitive comparison.  The sorted records
+go into a new result set, which is fetched from like any other.
+Servers that support sorting generally need the C<namedResultSets>
+option to be set; without it, the original result set is sorted in
+place, and should not be used again.
+
 =head2 Scanning
 
 B<### Note to self - write this section!>
@@ -510,6 +563,22 @@ itself for details.
 
 Both options default to one megabyte.
 
+A server that supports segmentation can send records that don't fit
+in a single message of the preferred size if a present request
+allows it to, by means of the C<maxSegmentCount>, C<maxSegmentSize>
+and C<maxRecordSize> options.  It then sends some of the records in
+Segment APDUs ahead of the present response, splitting any record
+too large for one segment into fragments, which Net::Z3950 puts back
+together.  So C<preferredMessageSize> can be kept small, so that
+records start to arrive quickly, and very large records can still be
+fetched:
+
+	$mgr = new Net::Z3950::Manager(
+		preferredMessageSize => 32*1024,
+		maxSegmentCount => 1000,
+		maxSegmentSize => 32*1024,
+		maxRecordSize => 16*1024*1024);
+
 B<Implementation Identification>
 
 The C<implementationId>, C<implementationName> and
@@ -611,6 +680,86 @@ undefined value.  B<Can not be set on a per-connection basis.>
 C<0>
 (Determines whether a given connection is in asynchronous mode.)
 
+=item C<connectTimeout>
+
+C<undef>
+The maximum number of seconds to allow for looking up a server's
+hostname and forging the TCP/IP connection to it.  If this elapses,
+the connection fails with C<$!> set to ETIMEDOUT, and (for an
+asynchronous connection) C<wait()> returns it with an error.  By
+default there is no limit beyond the operating system's own.
+
+=item C<requestTimeout>
+
+C<undef>
+The maximum number of seconds to wait for the response to any one
+request - an Init, search, present, scan, sort or delete - counted
+from when the request is made.  If it elapses, the operation fails
+with error 100 and additional information saying that it timed out: its
+callback, if it has one, is called with no APDU; otherwise C<wait()>
+returns the connection with C<op()> set to C<Net::Z3950::Op::Error>
+and C<errop()> saying which operation failed.  Other operations and
+other connections are not affected, and a response that turns up
+later is discarded.  A timed-out Init always fails the connection,
+as with C<connectTimeout>.  By default there is no limit.
+
+=item C<requestTimeoutAction>
+
+C<'error'>
+What else to do when a request times out.  C<error> does nothing
+more, leaving the connection open for further requests.  C<abandon>
+drops the connection, so that requests still outstanding on it fail
+in turn as their own timeouts elapse; and C<close> does the same,
+but first sends the server a Close request so that it can stop
+working on our behalf.  If the Close can't be sent at once, the
+connection is dropped all the same, and the error's C<addinfo()>
+says why.
+
+=item C<asyncResolve>
+
+C<0>
+(Indicates that servers' hostnames should be looked up on a
+background thread rather than stalling all connections while the
+lookup happens.  A lookup that never completes holds up only its own
+connection, so this is best used together with C<connectTimeout>.
+Only plain hostnames, optionally prefixed with C<tcp:>, are looked up
+in this way.)
+
+=item C<poolConnections>
+
+C<0>
+If set to 1, closing a connection that was successfully initialised,
+and has no requests outstanding, keeps its session open in the
+manager's pool rather than closing it.  A new connection to the same
+host and port, with the same C<user>, C<pass>, C<group>, C<charset>,
+C<language>, C<preferredMessageSize>, C<maximumRecordSize>,
+C<implementationId>, C<implementationName> and
+C<implementationVersion>, then takes over that session: its Init
+response is delivered as usual, but without a round trip to the
+server.  The new connection names its result sets from scratch, so
+the server may still hold result sets made by the session's previous
+user, until searches with the same names replace them; a server that
+limits the number of result sets in a session counts these too.
+Idle sessions are closed when the server closes them or after
+C<poolIdleTimeout> seconds.
+
+=item C<poolIdleTimeout>
+
+C<60>
+(Indicates the number of seconds for which an idle session is kept in
+the pool before being closed.)
+
+=item C<eventLoop>
+
+C<'Event'>
+The event loop used to multiplex between the manager's connections.
+The default, C<Event>, uses the Event module.  C<epoll> selects a
+native loop, written in C and available only on Linux, which reads,
+decodes and writes without calling back into Perl, and so scales much
+better to hundreds of connections; see L<Net::Z3950::EventLoop> for
+its limitations.  B<Must be set on the manager before any connections
+are made.>
+
 =item C<preferredMessageSize>
 
 C<1024*1024>
@@ -692,6 +841,43 @@ C<'b'>
 
 C<'GRS-1'>
 
+=item C<searchCacheTTL>
+
+C<undef>
+(If set, the manager remembers each search's response, and the records
+subsequently fetched from the result set it made, for this many
+seconds.  A search during that time for the same query of the same
+type, on the same server and database, with the same Init
+credentials and character set and the same record syntax and
+small- and medium-set element set names, is answered from this
+cache without a round trip, as are requests for
+any records already fetched in the same element set and record
+syntax.  Runs of white space in the query do not count.  The search
+is sent to the server only if records are wanted that were not
+cached.  The manager's C<clearSearchCache()> method empties the
+cache.)
+
+=item C<searchCacheSize>
+
+C<100>
+(Indicates the maximum number of searches kept in the manager's search
+cache.  When there are more, the least recently used are dropped.)
+
+=item C<cclQualifiers>
+
+C<ccl.qual>
+(Indicates the file from which the manager loads the CCL qualifiers
+used to compile C<ccl2rpn> queries.  It is read only when the manager
+first needs it; see also the manager's C<loadQualifiers()> method.)
+
+=item C<queryCacheSize>
+
+C<256>
+(Indicates the maximum number of compiled C<prefix> and C<ccl2rpn>
+queries kept by the manager, so that a query string searched for
+again need not be parsed again.  When there are more, the least
+recently used are dropped.  Zero turns the cache off.)
+
 =item C<responsePosition>
 
 C<1>
@@ -709,9 +895,149 @@ a scan.)
 C<20>
 (Indicates the number of terms to return from a scan.)
 
+=item C<maxSegmentCount>
+
+C<0>
+(Indicates the maximum number of Segment APDUs that the server may
+send in answer to a present request.  Zero leaves the parameter out
+of the request, as do the defaults of the next two options.)
+
+=item C<maxSegmentSize>
+
+C<0>
+(Indicates the largest segment that the server may send.)
+
+=item C<maxRecordSize>
+
+C<0>
+(Indicates the size of the largest record that the server may send
+in fragments across several segments.)
+
 =item C<elementSetName>
 
 C<'b'>
+(Each result set keeps a separate cache of records for each
+combination of C<elementSetName> and C<preferredRecordSyntax>, so
+either may be changed between calls to C<record()> without searching
+again, and records already fetched in the old combination are still
+there when it's changed back.)
+
+=item C<adaptivePrefetch>
+
+C<1>
+(Indicates that when records are read in sequence, and the
+C<prefetch> option is not set, the number of records fetched in each
+Present request should grow as described in the section on
+retrieving records, and that the next batch should be requested
+ahead of time.)
+
+=item C<presentRanges>
+
+C<16>
+(Indicates the maximum number of separate ranges of records to ask
+for in a single Present request, using its C<additionalRanges>
+parameter, when the application has asked for records scattered
+across the result set.  If the server turns out to ignore all but
+the first range, the connection falls back to one range per request.
+Set to 1 to never send more than one range.)
+
+=item C<cacheMaxRecords>
+
+C<undef>
+The maximum number of records that each result set keeps in its
+cache.  When more arrive, those least recently returned by
+C<record()> are dropped, and fetched again if they're asked for
+later.  Diagnostics are not counted.  By default the cache grows
+without limit, which is fine until you try to read a million
+records.
+
+=item C<cacheMaxBytes>
+
+C<undef>
+As C<cacheMaxRecords>, but limits the total size of the cached
+records' raw data (estimated, for GRS-1 and OPAC records).  If both
+are set, both limits apply.  The records from the most recent
+response are never dropped, so a single response may take the cache
+over either limit.  The C<ResultSet> class's C<cacheStats()> method
+reports how well the cache is doing.
+
+=item C<recordStore>
+
+C<undef>
+(If set to the name of a file, every opaque record - MARC, MAB,
+SUTRS, XML or HTML - fetched into a result set is also written to a
+record store of that name, which later runs can open read-only with
+C<Net::Z3950::RecordStore-E<gt>open()> and read records from without
+a connection.  Set it on the result set itself, or on the connection
+before searching if there is only one search, since every result set
+with the option set writes to the store it names.  See
+C<Net::Z3950::RecordStore>.)
+
+=item C<recordCallback>
+
+C<undef>
+(If set to a reference to a function, that function is called as
+C<&$cb($rs, $n, $rec)> for each record I<$rec> fetched into a result
+set I<$rs>, where I<$n> is its position, as soon as it arrives - with
+C<streamRecords>, while the rest of its response is still being
+decoded.  It's meant for writing records out as they come, and must
+not itself call C<wait()> or anything else that waits for the
+network.  If it dies while records are being streamed, the error is
+raised only once the rest of the response has been dealt with, so
+that its records are still all fetched.)
+
+=item C<pipelining>
+
+C<0>
+(Indicates that, once the Init response has arrived, several requests
+may be sent on a connection without waiting for the responses to
+earlier ones, up to the limit set by the C<maxOutstanding> option.
+Off by default, because some servers discard any request which
+arrives while they are still working on another: then each request
+waits for the response to the one before.)
+
+=item C<maxOutstanding>
+
+C<8>
+(Indicates the maximum number of requests that may be awaiting
+responses on a connection at any one time when C<pipelining> is on.
+Further requests are encoded straight away but held back until a
+response makes room for them.)
+
+=item C<lazyRecords>
+
+C<0>
+If set to 1, GRS-1 and OPAC records are kept in their decoded C form
+until the application first looks inside them, at which point (and
+only then) they are translated into Perl structures.  This saves a lot
+of work when an application fetches many such records but inspects
+only a few of them.  B<Can not be set on a per-result-set basis.>
+
+=item C<sharedRecords>
+
+C<0>
+If set to 1, records whose content is a single opaque string (SUTRS,
+MARC, XML, HTML, MAB) are not copied out of the buffer into which
+their APDU was decoded: instead, the record's string points directly
+into that buffer, which is kept alive until the last such record is
+destroyed.  Together with C<rawdata_ref()>, this lets large records
+be handed on without ever being copied.  Such records' strings are
+read-only.  The buffer holds the whole of the decoded APDU, so
+keeping any one of its records keeps all of that response's records
+in memory: an application that keeps only a few records out of each
+response should copy them out with C<rawdata()>, and the
+C<cacheMaxBytes> limit counts only the records' own lengths.
+B<Can not be set on a per-result-set basis.>
+
+=item C<streamRecords>
+
+C<0>
+If set to 1, the records of each present response are handed to their
+result set one at a time, as each is decoded, rather than once the
+whole response has been turned into a list of records.  The list is
+never built, which saves memory when large pages of records are
+fetched, and a C<recordCallback> sees each record as soon as it has
+arrived.  B<Can not be set on a per-result-set basis.>
 
 =item C<namedResultSets>
 
@@ -738,6 +1064,21 @@ top of it) - it's only the I<documentation> that's not yet here.
 
 B<### Note to self - write this section!>
 
+For the commonest reason to go asynchronous - sending the same search
+to several servers at once - you don't need to know any of it, as the
+manager's C<federated_search()> method does all the work:
+
+	$fed = $mgr->federated_search([ 'z3950.loc.gov:7090/Voyager',
+					'bagel.indexdata.dk/gils' ],
+				      'computer', count => 20, deadline => 10);
+	while (my($rec, $target, $n) = $fed->next()) {
+		print $target->name(), " $n: ", $rec->render();
+	}
+
+Records come back as each server sends them, and a server that fails
+or misses its deadline simply drops out.  See
+C<Net::Z3950::Federation> for details.
+
 
 =head1 NOW WHAT?
 
@@ -748,8 +1089,9 @@ individual classes that make up the module -
 C<Net::Z3950> itself,
 C<Net::Z3950::Manager>,
 C<Net::Z3950::Connection>,
-C<Net::Z3950::ResultSet> and
-C<Net::Z3950::Record>.
+C<Net::Z3950::ResultSet>,
+C<Net::Z3950::Record> and
+C<Net::Z3950::Federation>.
 
 
 =head1 AUTHOR
@@ -29,14 +29,16 @@ foreach my $spec (@servers) {
 
 
 #$Event::DebugLevel = 5;
-$mgr->wait();
-print "Finished.\n";
-use Errno qw(ECONNREFUSED);
-if ($! == ECONNREFUSED) {
-    ###	At present, a single connection failing to connect makes the
-    #   whole concurrent session end.  Need to consider the interface.
-    print "(Possible premature exit due to $!)\n";
+while (my $conn = $mgr->wait()) {
+    # Everything but a failure is handled by a callback
+    print $conn->name(), " - failed: ", $conn->errmsg(),
+	  defined $conn->addinfo() ? " (" . $conn->addinfo() . ")" : "", "\n";
+    $conn->close();
 }
+print "Finished.\n";
+
+# For the common case of one search sent to many servers, see also
+# Net::Z3950::Manager's federated_search() method.
 
 
 sub done_init {
@@ -8,7 +8,7 @@
 # Change 1..1 below to 1..last_test_to_print .
 # (It may become useful if the test is moved to ./t subdirectory.)
 
-BEGIN { $| = 1; print "1..23\n"; }
+BEGIN { $| = 1; print "1..29\n"; }
 END {print "not ok 1\n" unless $loaded;}
 use Net::Z3950;
 $loaded = 1;
@@ -52,6 +52,192 @@ if (Net::Z3950::diagbib1_str(1) eq 'Permanent system error' &&
     print "not ok 3\n";
 }
 
+# Check the ISO 2709 parser on a record with a directory.  The 500
+# field has indicators but no subfields, so it's not rendered.
+my $marc = iso2709('001' => "ctl123",
+		   '245' => "10\x1FaTitle\x1FbSub",
+		   '500' => "  ",
+		   '650' => " 0\x1FaOne",
+		   '650' => " 0\x1FaTwo");
+my $usmarc = bless \$marc, 'Net::Z3950::Record::USMARC';
+my @subjects = $usmarc->subfield('650', 'a');
+my @control = $usmarc->subfield('001', 'a');
+if ($usmarc->nfields() == 5 &&
+    $usmarc->field('245') eq "10\x1FaTitle\x1FbSub" &&
+    $usmarc->field('001') eq "ctl123" &&
+    join('|', @subjects) eq 'One|Two' &&
+    @control == 0 &&
+    !defined $usmarc->field('100')) {
+    print "ok 4\n";
+} else {
+    print "not ok 4\n";
+}
+
+my $leader = substr($marc, 0, 24);
+if ($usmarc->render() eq "LDR $leader\n" .
+			 "001     ctl123\n" .
+			 "245 10 _aTitle\n" .
+			 "       _bSub\n" .
+			 "650  0 _aOne\n" .
+			 "650  0 _aTwo") {
+    print "ok 5\n";
+} else {
+    print "not ok 5\nrec='", $usmarc->render(), "'\n";
+}
+
+# MAB records may have no directory, just a sequence of fields each
+# beginning with its tag
+my $mabLeader = "00000nM2.01200024------h";
+my $mabrec = $mabLeader .
+    "001 123\x1E331 Title\x1E100 \x1FpName\x1FdDates\x1E\x1D";
+my $mab = bless \$mabrec, 'Net::Z3950::Record::MAB';
+if ($mab->nfields() == 3 &&
+    $mab->field('331') eq " Title" &&
+    $mab->subfield('100', 'd') eq "Dates" &&
+    $mab->render() eq "### $mabLeader\n" .
+		      "001 123\n" .
+		      "331 Title\n" .
+		      "100 \$pName\$dDates\n") {
+    print "ok 6\n";
+} else {
+    print "not ok 6\nrec='", $mab->render(), "'\n";
+}
+
+# A truncated record yields only the fields that fit, and one too
+# short to have a leader yields nothing at all
+my $short = substr($marc, 0, index($marc, "Sub"));
+my $tiny = substr($marc, 0, 20);
+my $truncated = bless \$short, 'Net::Z3950::Record::USMARC';
+my $fragment = bless \$tiny, 'Net::Z3950::Record::USMARC';
+if ($truncated->nfields() == 1 &&
+    !defined $truncated->field('245') &&
+    $truncated->render() eq "LDR $leader\n" .
+			    "001     ctl123" &&
+    $fragment->nfields() == 0 &&
+    !defined Net::Z3950::marcRender($tiny, 0)) {
+    print "ok 7\n";
+} else {
+    print "not ok 7\n";
+}
+
+# Write a record store and read it back.  The GRS-1 record can't be
+# stored, position 4 is never written, and a record stored twice
+# keeps its first version.
+my $storeName = "test-store.$$";
+my $sutrsText = "A plain-text record\n";
+my $grs1 = bless [], 'Net::Z3950::Record::GRS1';
+my $writer = Net::Z3950::RecordStore->_create($storeName, 4);
+$writer->_store(1, $usmarc);
+$writer->_store(2, $grs1);
+$writer->_store(3, bless \$sutrsText, 'Net::Z3950::Record::SUTRS');
+$writer->_store(1, $mab);
+undef $writer;
+my $store = Net::Z3950::RecordStore->open($storeName);
+my($first, $third, $second, $fourth);
+if (defined $store) {
+    $first = $store->record(1);
+    $third = $store->record(3);
+    $second = $store->record(2);
+    $fourth = $store->record(4);
+}
+if (defined $store &&
+    $store->size() == 4 &&
+    ref $first eq 'Net::Z3950::Record::USMARC' &&
+    $first->rawdata() eq $marc &&
+    $first->field('001') eq "ctl123" &&
+    ref $third eq 'Net::Z3950::Record::SUTRS' &&
+    $third->rawdata() eq $sutrsText &&
+    !defined $second &&
+    !defined $fourth &&
+    $store->errcode() == 14) {
+    print "ok 8\n";
+} else {
+    print "not ok 8\n";
+}
+undef $store;
+unlink($storeName, "$storeName.idx");
+
+# Fill a result set's record cache past its limits, without a server:
+# the result set is made from a faked-up search response, and records
+# are put in the cache as though they had arrived from the server.
+# Each record is 10 bytes but the last two.  The least recently used
+# records are evicted first, but not one that record() has used since
+# (whose old place in the LRU list is then stale), nor one in a range
+# that's being waited for, nor any that arrived in the response just
+# inserted.  Evicted records are asked for again.  Also checks that
+# the prefetch window grows while reading sequentially, that records
+# in another record syntax are cached separately, and that sorting
+# makes a new result set with the same options.
+my $cmgr = new Net::Z3950::Manager(async => 1,
+	cacheMaxRecords => 4, cacheMaxBytes => 100,
+	preferredRecordSyntax => "SUTRS", preferredMessageSize => 400);
+my $cconn = bless {
+    mgr => $cmgr,
+    options => {},
+    resultSets => [],
+    idleWatcher => Event->idle(repeat => 1, parked => 1, cb => sub {}),
+}, 'Net::Z3950::Connection';
+my $crs = _new Net::Z3950::ResultSet($cconn, 0, bless {
+    referenceId => 0,
+    searchStatus => 1,
+    resultCount => 20,
+    numberOfRecordsReturned => 0,
+}, 'Net::Z3950::APDU::SearchResponse');
+my $ckey = $crs->_cache_key();
+my $crecords = $crs->{records}->{$ckey};
+my @cslots;
+$crs->_insert_records(sutrs_response(1..3), [ 1..3 ], $ckey);
+my $s1 = $crs->cacheStats();
+my $hit = $crs->record(1);
+$crs->_insert_records(sutrs_response(4, 5), [ 4, 5 ], $ckey);
+push @cslots, join(",", grep { ref $crecords->[$_] } 1..20);
+{
+    local $crs->{pinned} = [ $ckey, 3, 3 ];
+    $crs->_insert_records(sutrs_response(6), [ 6 ], $ckey);
+}
+push @cslots, join(",", grep { ref $crecords->[$_] } 1..20);
+$crs->_insert_records(sutrs_response("7" x 80), [ 7 ], $ckey);
+push @cslots, join(",", grep { ref $crecords->[$_] } 1..20);
+my $s2 = $crs->cacheStats();
+$crs->_insert_records(sutrs_response("8" x 200), [ 8 ], $ckey);
+push @cslots, join(",", grep { ref $crecords->[$_] } 1..20);
+my $s3 = $crs->cacheStats();
+my @windows = map { $crs->_window($_) } (0, 1, 1, 1, 0);
+my $missed = $crs->record(2);
+my $s4 = $crs->cacheStats();
+$crs->option(preferredRecordSyntax => "USMARC");
+my $other = $crs->record(8);
+my $okey = $crs->_cache_key();
+$crs->option(preferredRecordSyntax => "SUTRS");
+$crs->option(elementSetName => "F");
+my $sorted = $crs->_sorted(1, bless {
+    sortStatus => Net::Z3950::SortStatus::Success,
+    resultCount => 20,
+}, 'Net::Z3950::APDU::SortResponse');
+my $unsorted = $crs->_sorted(2, bless {
+    sortStatus => Net::Z3950::SortStatus::Failure,
+}, 'Net::Z3950::APDU::SortResponse');
+if ($s1->{records} == 3 && $s1->{bytes} == 30 && $s1->{evictions} == 0 &&
+    ref $hit && $hit->rawdata() eq "record 01\n" &&
+    "@cslots" eq "1,3,4,5 3,4,5,6 5,6,7 8" &&
+    $s2->{records} == 3 && $s2->{bytes} == 100 && $s2->{evictions} == 4 &&
+    $s3->{records} == 1 && $s3->{bytes} == 200 && $s3->{evictions} == 7 &&
+    "@windows" eq "1 2 4 4 1" &&
+    !defined $missed && $crs->errcode() == 0 &&
+    $crecords->[2] == Net::Z3950::ResultSet::CALLER_REQUESTED &&
+    $s4->{hits} == 1 && $s4->{misses} == 1 &&
+    !defined $other && $okey ne $ckey &&
+    ref $crs->{records}->{$okey}->[8] eq "" &&
+    ref $crecords->[8] eq 'Net::Z3950::Record::SUTRS' &&
+    defined $sorted && $sorted->size() == 20 &&
+    $sorted->option('elementSetName') eq "F" &&
+    !defined $unsorted && $cconn->{errcode} == 207) {
+    print "ok 9\n";
+} else {
+    print "not ok 9\nslots: @cslots; windows: @windows\n";
+}
+$cconn->close();
+
 # Create Net::Z3950 manager
 my $mgr = new Net::Z3950::Manager(async => 1,
 	smallSetUpperBound => 0, largeSetLowerBound => 10000,
@@ -59,36 +245,36 @@ my $mgr = new Net::Z3950::Manager(async => 1,
 	preferredRecordSyntax => "GRS-1"
 #	preferredRecordSyntax => "USMARC"
 			     )
-    or (print "not ok 4\n"), exit;
-print "ok 4\n";
+    or (print "not ok 10\n"), exit;
+print "ok 10\n";
 
 # Forge connection to the local "yaz-ztest" server
 ### You need to be connected to the internet for this to work, of course.
 my $conn1 = $mgr->connect('bagel.indexdata.dk', 210)
-    or (print "not ok 5 ($!)\n"), exit;
-print "ok 5\n";
+    or (print "not ok 11 ($!)\n"), exit;
+print "ok 11\n";
 
 # no-op for historical reasons
-print "ok 6\n";
+print "ok 12\n";
 
 # First init response
 my $conn = $mgr->wait()
-    or (print "not ok 7\n"), exit;
-print "ok 7\n";
+    or (print "not ok 13\n"), exit;
+print "ok 13\n";
 
 # Is the nominated connection one that we created?
-check_connection(8, $conn);
+check_connection(14, $conn);
 
 # Which operation fired?  Should be an Init
-check_op(9, $conn->op(), Net::Z3950::Op::Init);
+check_op(15, $conn->op(), Net::Z3950::Op::Init);
 
 # Was the connection accepted?
 my $r = $conn->initResponse();
 if (!$r->result()) {
-    print "not ok 10\n";
+    print "not ok 16\n";
     exit;
 }
-print "ok 10\n";
+print "ok 16\n";
 
 # We shouldn't really print this stuff if a test script.
 if (0) {
@@ -108,19 +294,19 @@ $conn1->startSearch(-prefix => '@or mineral machine');
 
 # First search response
 $conn = $mgr->wait()
-    or (print "not ok 11\n"), exit;
-print "ok 11\n";
+    or (print "not ok 17\n"), exit;
+print "ok 17\n";
 
 # Is the nominated connection one that we created?
-check_connection(12, $conn);
+check_connection(18, $conn);
 
 # Which operation fired?  Should be an Search
-check_op(13, $conn->op(), Net::Z3950::Op::Search);
+check_op(19, $conn->op(), Net::Z3950::Op::Search);
 
 # Fetch result set
 my $rs = $conn->resultSet()
-    or error(14, $conn);
-print "ok 14\n";
+    or error(20, $conn);
+print "ok 20\n";
 
 # No test -- this "just works"
 my $size = $rs->size();
@@ -195,8 +381,8 @@ my $sq = $rs->subqueryCount();
 $size == 18            and
 $sq->{'mineral'} == 18 and
 $sq->{'machine'} == 0
-    or (print "not ok 15\n"), exit;
-print "ok 15\n";
+    or (print "not ok 21\n"), exit;
+print "ok 21\n";
 
 $rec->render() eq qq[6 fields:
 (1,1) 1.2.840.10003.13.2
@@ -206,31 +392,31 @@ $rec->render() eq qq[6 fields:
 (4,1) "ESDD0048"
 (1,16) "199101"
 ]
-    or (print "not ok 16\nrec='", $rec->render(), "'\n"), exit;
-print "ok 16\n";
+    or (print "not ok 22\nrec='", $rec->render(), "'\n"), exit;
+print "ok 22\n";
 
 # Testing scan
 $conn->startScan('mineral');
 $conn = $mgr->wait()
-    or (print "not ok 17\n"), exit;
-print "ok 17\n";
+    or (print "not ok 23\n"), exit;
+print "ok 23\n";
 
 # Which operation fired?  Should be a Scan
-check_op(18, $conn->op(), Net::Z3950::Op::Scan);
+check_op(24, $conn->op(), Net::Z3950::Op::Scan);
 my $sr = $conn->scanResponse();
 
 if ($sr->scanStatus() != 0 ||
     $sr->positionOfTerm() != 1 ||
     $sr->stepSize() != 0 ||
     $sr->numberOfEntriesReturned() != 20) {
-    print "not ok 19\n";
+    print "not ok 25\n";
     print "scanResponse APDU:\n";
     foreach my $key (sort keys %$sr) {
 	print "$key -> $sr->{$key}\n";
     }
     exit;
 }
-print "ok 19\n";
+print "ok 25\n";
 
 my $term0 = $sr->entries()->[0]->termInfo();
 my $term19 = $sr->entries()->[19]->termInfo();
@@ -238,7 +424,7 @@ if ($term0->term()->general() ne "mineral" ||
     $term0->globalOccurrences() != 18 ||
     $term19->term()->general() ne "national" ||
     $term19->globalOccurrences() != 2) {
-    print "not ok 20\n";
+    print "not ok 26\n";
     print "scanResponse entries:\n";
     foreach my $entry (@{$sr->entries()}) {
 	foreach my $key (keys %{$entry}) {
@@ -247,26 +433,26 @@ if ($term0->term()->general() ne "mineral" ||
 	}
     }
 }
-print "ok 20\n";
+print "ok 26\n";
 
 # Check scan's error-reporting
 my $oldDB = $conn->option(databaseName => "nonExistentDB");
 $conn->startScan('fruit');
 $conn->option(databaseName => $oldDB);
 $conn = $mgr->wait()
-    or (print "not ok 21\n"), exit;
-print "ok 21\n";
+    or (print "not ok 27\n"), exit;
+print "ok 27\n";
 
-check_op(22, $conn->op(), Net::Z3950::Op::Scan);
+check_op(28, $conn->op(), Net::Z3950::Op::Scan);
 my $sr = $conn->scanResponse();
 
 if ($sr->scanStatus() != 6 ||
     $sr->diag()->condition() != 109 ||
     $sr->diag()->addinfo() ne "nonExistentDB") {
-    print "not ok 23\n";
+    print "not ok 29\n";
     { use Data::Dumper; print Dumper($sr); }
 }
-print "ok 23\n";
+print "ok 29\n";
 
 print "\ntests complete\n";
 exit;
@@ -296,6 +482,47 @@ sub check_op {
 }
 
 
+# Builds an ISO 2709 record with a directory from a list of tag/data
+# pairs, adding the field and record separators.
+#
+sub iso2709 {
+    my @fields = @_;
+    my($dir, $data) = ("", "");
+
+    while (@fields) {
+	my($tag, $value) = splice(@fields, 0, 2);
+	$value .= "\x1E";
+	$dir .= sprintf("%s%04d%05d", $tag, length($value), length($data));
+	$data .= $value;
+    }
+
+    my $base = 24 + length($dir) + 1;
+    my $len = $base + length($data) + 1;
+    return sprintf("%05dnam  22%05d   4500", $len, $base) .
+	"$dir\x1E$data\x1D";
+}
+
+
+# Fakes up a search response carrying a SUTRS record for each of the
+# arguments: a number $n makes the 10-byte record "record 0$n\n", and
+# anything else is the record's text.
+#
+sub sutrs_response {
+    my @texts = map { /^\d$/ ? "record 0$_\n" : $_ } @_;
+
+    my @records = map {
+	bless {
+	    which => Net::Z3950::NamePlusRecord::DatabaseRecord,
+	    databaseRecord => bless(\(my $text = $_),
+				    'Net::Z3950::Record::SUTRS'),
+	}, 'Net::Z3950::APDU::NamePlusRecord';
+    } @texts;
+    return bless {
+	records => bless(\@records, 'Net::Z3950::APDU::NamePlusRecordList'),
+    }, 'Net::Z3950::APDU::SearchResponse';
+}
+
+
 # Called on failure for test $testno; according to Perl-module test
 # harness "best practice", this should just print "not ok $testno" and
 # exit, but in Real Life(tm), we want any additional error information
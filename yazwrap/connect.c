@@ -54,9 +54,9 @@ int yaz_socket(COMSTACK cs)
     return cs_fileno(cs);
 }
 
-/* just a wrapper for now, but who knows - perhaps it may do more later */
-
+/* Also forgets the stream callback, if any, registered for `cs' */
 int yaz_close(COMSTACK cs)
 {
+    decodeStream(cs, 0);
     return cs_close(cs);
 }
@@ -0,0 +1,324 @@
+/* $Header$ */
+
+/*
+ * yazwrap/evloop.c -- a native event loop built on epoll.
+ *
+ * With hundreds of connections, having Event.pm call back into Perl
+ * every time a socket becomes readable or writable costs more than
+ * the work itself.  So this loop owns the connections' COMSTACKs:
+ * it writes their queued requests and reads and decodes their
+ * responses itself, and hands back to Perl only the results -- the
+ * decoded APDUs, and errors.  It can also watch plain file
+ * descriptors, such as the resolver's pipe, for readability.
+ *
+ * Each registered connection or descriptor is identified by a small
+ * integer, which is its index in the loop's table of entries.  On
+ * systems without epoll, evloopCreate() always fails.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include "ywpriv.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#define EVLOOP_MAX_EVENTS 64	/* events handled per epoll_wait() */
+
+typedef struct evEntry {
+    int fd;			/* -1 if the entry is free */
+    COMSTACK cs;		/* null for a plain file descriptor */
+    CONNCTX ctx;
+    int flags;			/* for decodeAPDUs() */
+    int events;			/* EVLOOP_READ and/or EVLOOP_WRITE */
+    int connected;		/* set after the first successful write */
+    int next;			/* next free entry, if this one is free */
+} evEntry;
+
+struct evLoop {
+    int epfd;
+    evEntry *entries;
+    int nentries;		/* number of entries used or freed */
+    int maxentries;		/* allocated size of `entries' */
+    int free;			/* first free entry, or -1 */
+};
+
+#ifdef __linux__
+
+static int addEntry(EVLOOP loop, int fd, COMSTACK cs, CONNCTX ctx,
+		    int flags);
+static int setEvents(EVLOOP loop, int id, int events);
+static void handleWrite(EVLOOP loop, int id, AV *out);
+static void handleRead(EVLOOP loop, int id, AV *out);
+static void report(AV *out, int id, int type, SV *sv, int n, int err);
+
+
+/* Returns a null pointer if the loop can't be created */
+EVLOOP evloopCreate(void)
+{
+    EVLOOP loop;
+
+    New(0, loop, 1, struct evLoop);
+    if ((loop->epfd = epoll_create(EVLOOP_MAX_EVENTS)) < 0) {
+	Safefree(loop);
+	return 0;
+    }
+
+    loop->entries = 0;
+    loop->nentries = loop->maxentries = 0;
+    loop->free = -1;
+    return loop;
+}
+
+
+/* The connections' COMSTACKs and contexts belong to their callers */
+void evloopDestroy(EVLOOP loop)
+{
+    close(loop->epfd);
+    if (loop->entries != 0)
+	Safefree(loop->entries);
+    Safefree(loop);
+}
+
+
+/*
+ * Registers the connection `cs', whose outgoing queue is in `ctx' and
+ * whose responses should be decoded according to `flags', for
+ * reading.  Returns its identifier, or -1 on error.
+ */
+int evloopAddConn(EVLOOP loop, COMSTACK cs, CONNCTX ctx, int flags)
+{
+    return addEntry(loop, cs_fileno(cs), cs, ctx, flags);
+}
+
+
+/* As evloopAddConn(), but for a plain file descriptor */
+int evloopAddFd(EVLOOP loop, int fd)
+{
+    return addEntry(loop, fd, 0, 0, 0);
+}
+
+
+/* Returns 1, or 0 if `id' is not registered */
+int evloopRemove(EVLOOP loop, int id)
+{
+    evEntry *ent;
+
+    if (id < 0 || id >= loop->nentries || loop->entries[id].fd < 0)
+	return 0;
+
+    ent = &loop->entries[id];
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ent->fd, 0);
+    ent->fd = -1;
+    ent->next = loop->free;
+    loop->free = id;
+    return 1;
+}
+
+
+/*
+ * Sets what the loop should do with entry `id': `events' is a bitmask
+ * of EVLOOP_READ and EVLOOP_WRITE.  A connection stops being written
+ * to of its own accord when its queue is empty.  Returns 1, or 0 if
+ * `id' is not registered.
+ */
+int evloopPoll(EVLOOP loop, int id, int events)
+{
+    if (id < 0 || id >= loop->nentries || loop->entries[id].fd < 0)
+	return 0;
+
+    return setEvents(loop, id, events);
+}
+
+
+/*
+ * Waits for up to `timeout' milliseconds (-1 for ever) for something
+ * to happen, deals with it, and returns a reference to an array of
+ * results, each a reference to an array whose first two elements are
+ * the entry's identifier and one of:
+ *
+ *	EVLOOP_DECODED, followed by a reference to an array of APDUs
+ *		(or undef), the reason code from decodeAPDUs() and the
+ *		value of `errno'.
+ *	EVLOOP_WRITTEN, followed by the number of bytes written and
+ *		the value of `errno'.  This is reported only for the
+ *		first write to a connection and for errors.
+ *	EVLOOP_READABLE, for a plain file descriptor.
+ *
+ * The array is empty if nothing happened that Perl needs to know
+ * about.  Returns a null pointer (which comes out as undef), with
+ * `errno' set, if epoll_wait() fails.
+ */
+SV *evloopRun(EVLOOP loop, int timeout)
+{
+    struct epoll_event ev[EVLOOP_MAX_EVENTS];
+    AV *out = newAV();
+    int i, n;
+
+    if ((n = epoll_wait(loop->epfd, ev, EVLOOP_MAX_EVENTS, timeout)) < 0) {
+	if (errno == EINTR)
+	    return newRV_noinc((SV*) out);
+	SvREFCNT_dec((SV*) out);
+	return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+	int id = ev[i].data.u32;
+	evEntry *ent = &loop->entries[id];
+	int oldlen = av_len(out);
+
+	if (ent->fd < 0)
+	    continue;
+
+	if (ent->cs == 0) {
+	    report(out, id, EVLOOP_READABLE, 0, 0, 0);
+	    continue;
+	}
+
+	if ((ev[i].events & (EPOLLOUT|EPOLLERR)) &&
+	    (ent->events & EVLOOP_WRITE)) {
+	    handleWrite(loop, id, out);
+	    /* Don't try to read from a connection that just failed */
+	    if (av_len(out) > oldlen && !ent->connected)
+		continue;
+	}
+
+	if ((ev[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) &&
+	    (ent->events & EVLOOP_READ))
+	    handleRead(loop, id, out);
+    }
+
+    return newRV_noinc((SV*) out);
+}
+
+
+static int addEntry(EVLOOP loop, int fd, COMSTACK cs, CONNCTX ctx,
+		    int flags)
+{
+    evEntry *ent;
+    struct epoll_event ev;
+    int id;
+
+    if (loop->free >= 0) {
+	id = loop->free;
+	loop->free = loop->entries[id].next;
+    } else {
+	if (loop->nentries == loop->maxentries) {
+	    loop->maxentries = loop->maxentries ? loop->maxentries * 2 : 16;
+	    Renew(loop->entries, loop->maxentries, evEntry);
+	}
+	id = loop->nentries++;
+    }
+
+    ent = &loop->entries[id];
+    ent->fd = fd;
+    ent->cs = cs;
+    ent->ctx = ctx;
+    ent->flags = flags;
+    ent->events = EVLOOP_READ;
+    ent->connected = 0;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.u32 = id;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	ent->fd = -1;
+	ent->next = loop->free;
+	loop->free = id;
+	return -1;
+    }
+
+    return id;
+}
+
+
+static int setEvents(EVLOOP loop, int id, int events)
+{
+    evEntry *ent = &loop->entries[id];
+    struct epoll_event ev;
+
+    ent->events = events;
+    ev.events = 0;
+    if (events & EVLOOP_READ)
+	ev.events |= EPOLLIN;
+    if (events & EVLOOP_WRITE)
+	ev.events |= EPOLLOUT;
+    ev.data.u64 = 0;
+    ev.data.u32 = id;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ent->fd, &ev);
+    return 1;
+}
+
+
+static void handleWrite(EVLOOP loop, int id, AV *out)
+{
+    evEntry *ent = &loop->entries[id];
+    int n = 0;
+
+    if (contextPending(ent->ctx) > 0) {
+	if ((n = yaz_write(ent->cs, ent->ctx)) < 0) {
+	    report(out, id, EVLOOP_WRITTEN, 0, n, errno);
+	    return;
+	}
+	if (n > 0 && !ent->connected) {
+	    ent->connected = 1;
+	    report(out, id, EVLOOP_WRITTEN, 0, n, 0);
+	}
+    }
+
+    if (contextPending(ent->ctx) == 0)
+	setEvents(loop, id, ent->events & ~EVLOOP_WRITE);
+}
+
+
+/* A partial APDU is nothing to report */
+static void handleRead(EVLOOP loop, int id, AV *out)
+{
+    evEntry *ent = &loop->entries[id];
+    int reason = 0;
+    SV *apdus;
+
+    apdus = decodeAPDUs(ent->cs, ent->flags, &reason);
+    if (apdus == 0 && reason == REASON_INCOMPLETE)
+	return;
+
+    report(out, id, EVLOOP_DECODED, apdus, reason, errno);
+}
+
+
+/* `sv', if not null, is the third element and the reference is ours */
+static void report(AV *out, int id, int type, SV *sv, int n, int err)
+{
+    AV *av = newAV();
+
+    av_push(av, newSViv(id));
+    av_push(av, newSViv(type));
+    if (type == EVLOOP_DECODED)
+	av_push(av, sv != 0 ? sv : newSV(0));
+    if (type != EVLOOP_READABLE) {
+	av_push(av, newSViv(n));
+	av_push(av, newSViv(err));
+    }
+
+    av_push(out, newRV_noinc((SV*) av));
+}
+
+#else /* !__linux__ */
+
+EVLOOP evloopCreate(void)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+void evloopDestroy(EVLOOP loop) {}
+int evloopAddConn(EVLOOP loop, COMSTACK cs, CONNCTX ctx, int flags)
+{
+    return -1;
+}
+int evloopAddFd(EVLOOP loop, int fd) { return -1; }
+int evloopRemove(EVLOOP loop, int id) { return 0; }
+int evloopPoll(EVLOOP loop, int id, int events) { return 0; }
+SV *evloopRun(EVLOOP loop, int timeout) { return 0; }
+
+#endif /* __linux__ */
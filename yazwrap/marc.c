@@ -0,0 +1,351 @@
+/* $Header$ */
+
+/*
+ * yazwrap/marc.c -- ISO 2709 record parsing for Net::Z3950::Record.
+ *
+ * This file provides a small, allocation-free parser for the ISO 2709
+ * exchange format shared by USMARC, UNIMARC and the other MARC
+ * flavours, so that applications can pull a few fields out of a
+ * record without first building a MARC::Record object.  It has
+ * nothing to do with Yaz, but this is where our C code lives.
+ */
+
+#include <string.h>
+#include "ywpriv.h"
+
+#define ISO2709_RS '\035'	/* record separator */
+#define ISO2709_FS '\036'	/* field separator */
+#define ISO2709_IDFS '\037'	/* subfield delimiter */
+#define LEADER_LEN 24
+
+/*
+ * Iterator over the fields of a record.  Most records have a
+ * directory, which tells us where each field is; but MAB records are
+ * sometimes sent without one, as a sequence of separator-terminated
+ * fields each beginning with its tag, and in this case `dir' is -1.
+ */
+typedef struct marcParser {
+    const char *buf;
+    int len;
+    int base;			/* offset of first field's data */
+    int entlen;			/* length of a directory entry */
+    int lenlen;			/* length of entry's field-length part */
+    int poslen;			/* length of entry's field-position part */
+    int dir;			/* offset of next directory entry, or -1 */
+    int pos;			/* offset of next field if no directory */
+} marcParser;
+
+typedef struct fieldInfo {
+    char tag[4];
+    const char *data;		/* indicators and subfields, if any */
+    int len;			/* not including the field separator */
+} fieldInfo;
+
+static int parseInit(marcParser *mp, databuf rec);
+static int parseNext(marcParser *mp, fieldInfo *mf);
+static int leaderNumber(const char *buf, int start, int len, int dflt);
+static int isControl(marcParser *mp, fieldInfo *mf);
+static void renderMARC(marcParser *mp, SV *out);
+static void renderMAB(marcParser *mp, SV *out);
+
+
+/*
+ * Returns the number of fields in the record `rec', or -1 if it's
+ * too short to be an ISO 2709 record at all.
+ */
+int marcNFields(databuf rec)
+{
+    marcParser mp;
+    fieldInfo mf;
+    int n = 0;
+
+    if (!parseInit(&mp, rec))
+	return -1;
+
+    while (parseNext(&mp, &mf))
+	n++;
+
+    return n;
+}
+
+
+/*
+ * Returns a reference to an array of the contents of every field in
+ * `rec' whose tag is `tag', in the order they occur, with the field
+ * separators removed.  For data fields, each element begins with the
+ * indicators and contains the subfields, delimiters and all.
+ */
+SV *marcField(databuf rec, char *tag)
+{
+    marcParser mp;
+    fieldInfo mf;
+    AV *av = newAV();
+
+    if (parseInit(&mp, rec)) {
+	while (parseNext(&mp, &mf)) {
+	    if (!strcmp(mf.tag, tag))
+		av_push(av, newSVpvn(mf.data, mf.len));
+	}
+    }
+
+    return newRV_noinc((SV*) av);
+}
+
+
+/*
+ * Returns a reference to an array of the values of every subfield
+ * coded `code' in every field of `rec' whose tag is `tag'.
+ */
+SV *marcSubfield(databuf rec, char *tag, char *code)
+{
+    marcParser mp;
+    fieldInfo mf;
+    AV *av = newAV();
+
+    if (parseInit(&mp, rec)) {
+	while (parseNext(&mp, &mf)) {
+	    const char *cp, *end;
+
+	    if (strcmp(mf.tag, tag) || isControl(&mp, &mf))
+		continue;
+
+	    end = mf.data + mf.len;
+	    cp = memchr(mf.data, ISO2709_IDFS, mf.len);
+	    while (cp != 0) {
+		const char *next;
+
+		cp++;
+		next = memchr(cp, ISO2709_IDFS, end-cp);
+		if (cp < end && *cp == *code)
+		    av_push(av, newSVpvn(cp+1, (next ? next : end) - (cp+1)));
+		cp = next;
+	    }
+	}
+    }
+
+    return newRV_noinc((SV*) av);
+}
+
+
+/*
+ * Returns a human-readable rendering of `rec', or a null pointer
+ * (which comes out as undef) if it's too short to be a record.  If
+ * `mab' is false, the rendering is in the same format as MARC::Record's
+ * as_formatted() method, which is what we used to use; otherwise it's
+ * in the format that we've always used for MAB records.
+ */
+SV *marcRender(databuf rec, int mab)
+{
+    marcParser mp;
+    SV *out;
+
+    if (!parseInit(&mp, rec))
+	return 0;
+
+    out = newSVpvn("", 0);
+    SvGROW(out, rec.len + rec.len/4);
+    if (mab)
+	renderMAB(&mp, out);
+    else
+	renderMARC(&mp, out);
+
+    return out;
+}
+
+
+static int parseInit(marcParser *mp, databuf rec)
+{
+    const char *buf = rec.data;
+    int ndir;
+
+    if (rec.len < LEADER_LEN)
+	return 0;
+
+    mp->buf = buf;
+    mp->len = rec.len;
+    mp->base = leaderNumber(buf, 12, 5, -1);
+    mp->lenlen = leaderNumber(buf, 20, 1, 4);
+    mp->poslen = leaderNumber(buf, 21, 1, 5);
+    mp->entlen = 3 + mp->lenlen + mp->poslen + leaderNumber(buf, 22, 1, 0);
+    mp->pos = LEADER_LEN;
+
+    /*
+     * The directory runs from the end of the leader to the field
+     * separator just before the base address, and must consist of a
+     * whole number of entries: if it doesn't, then we assume there's
+     * no directory.
+     */
+    ndir = mp->base - 1 - LEADER_LEN;
+    if (mp->base > LEADER_LEN && mp->base <= rec.len &&
+	buf[mp->base-1] == ISO2709_FS &&
+	mp->lenlen > 0 && mp->poslen > 0 && ndir % mp->entlen == 0) {
+	mp->dir = LEADER_LEN;
+    } else {
+	mp->dir = -1;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Sets `*mf' to describe the next field of `mp', and returns 1; or
+ * returns 0 if there are no more fields.  Fields whose directory
+ * entries point outside the record are silently skipped.
+ */
+static int parseNext(marcParser *mp, fieldInfo *mf)
+{
+    const char *buf = mp->buf;
+
+    if (mp->dir < 0) {
+	const char *cp, *end;
+
+	while (mp->pos < mp->len && buf[mp->pos] != ISO2709_RS) {
+	    cp = buf + mp->pos;
+	    end = memchr(cp, ISO2709_FS, mp->len - mp->pos);
+	    if (end == 0)
+		end = buf + mp->len;
+	    mp->pos = end - buf + 1;
+	    if (end - cp < 3)
+		continue;	/* too short to have a tag */
+
+	    memcpy(mf->tag, cp, 3);
+	    mf->tag[3] = 0;
+	    mf->data = cp + 3;
+	    mf->len = end - (cp + 3);
+	    return 1;
+	}
+	return 0;
+    }
+
+    while (mp->dir + mp->entlen < mp->base) {
+	const char *ent = buf + mp->dir;
+	int flen = leaderNumber(ent, 3, mp->lenlen, -1);
+	int fpos = leaderNumber(ent, 3 + mp->lenlen, mp->poslen, -1);
+
+	mp->dir += mp->entlen;
+	if (flen < 1 || fpos < 0 || mp->base + fpos + flen > mp->len)
+	    continue;
+
+	memcpy(mf->tag, ent, 3);
+	mf->tag[3] = 0;
+	mf->data = buf + mp->base + fpos;
+	mf->len = flen;
+	if (mf->data[mf->len-1] == ISO2709_FS)
+	    mf->len--;
+	return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns the decimal number in the `len' characters of `buf' from
+ * offset `start', or `dflt' if they're not all digits.
+ */
+static int leaderNumber(const char *buf, int start, int len, int dflt)
+{
+    int i, n = 0;
+
+    for (i = start; i < start+len; i++) {
+	if (buf[i] < '0' || buf[i] > '9')
+	    return dflt;
+	n = n*10 + buf[i]-'0';
+    }
+
+    return n;
+}
+
+
+/* Control fields (001-009) have neither indicators nor subfields */
+static int isControl(marcParser *mp, fieldInfo *mf)
+{
+    return (mp->dir >= 0 && mf->tag[0] == '0' && mf->tag[1] == '0' &&
+	    mf->tag[2] >= '0' && mf->tag[2] <= '9');
+}
+
+
+static void renderMARC(marcParser *mp, SV *out)
+{
+    fieldInfo mf;
+    const char *cp, *end;
+
+    sv_catpvn(out, "LDR ", 4);
+    sv_catpvn(out, mp->buf, LEADER_LEN);
+
+    while (parseNext(mp, &mf)) {
+	int first = 1;
+
+	if (isControl(mp, &mf)) {
+	    sv_catpvf(out, "\n%s     ", mf.tag);
+	    sv_catpvn(out, mf.data, mf.len);
+	    continue;
+	}
+
+	end = mf.data + mf.len;
+	cp = memchr(mf.data, ISO2709_IDFS, mf.len);
+	while (cp != 0 && cp+1 < end) {
+	    const char *next = memchr(cp+1, ISO2709_IDFS, end-(cp+1));
+
+	    if (first) {
+		/*
+		 * Tag and indicators, padded to six characters.  A data
+		 * field with no subfields gets no line at all, as in
+		 * MARC::Record, which drops such fields.
+		 */
+		int nind = cp - mf.data;
+		if (nind > 2)
+		    nind = 2;
+		sv_catpvf(out, "\n%s ", mf.tag);
+		sv_catpvn(out, mf.data, nind);
+		sv_catpvn(out, "  ", 2 - nind);
+		first = 0;
+	    } else {
+		sv_catpvn(out, "\n      ", 7);
+	    }
+	    sv_catpvn(out, " _", 2);
+	    sv_catpvn(out, cp+1, (next ? next : end) - (cp+1));
+	    cp = next;
+	}
+    }
+}
+
+
+/*
+ * MAB records have always been rendered as their leader followed by
+ * each field verbatim, one per line, with subfield delimiters (or
+ * the "$$" that some databases use instead) shown as "$".
+ */
+static void renderMAB(marcParser *mp, SV *out)
+{
+    const char *cp = mp->buf + LEADER_LEN;
+    const char *end = mp->buf + mp->len;
+
+    sv_catpvn(out, "### ", 4);
+    sv_catpvn(out, mp->buf, LEADER_LEN);
+    sv_catpvn(out, "\n", 1);
+
+    if (end > cp && end[-1] == ISO2709_RS)
+	end--;
+
+    while (cp < end) {
+	const char *fs = memchr(cp, ISO2709_FS, end-cp);
+	const char *fend = fs ? fs : end;
+
+	while (cp < fend) {
+	    const char *run = cp;
+
+	    while (cp < fend && *cp != ISO2709_IDFS &&
+		   !(*cp == '$' && cp+1 < fend && cp[1] == '$'))
+		cp++;
+	    sv_catpvn(out, run, cp-run);
+	    if (cp < fend) {
+		sv_catpvn(out, "$", 1);
+		cp += (*cp == '$') ? 2 : 1;
+	    }
+	}
+	sv_catpvn(out, "\n", 1);
+	cp = fend + 1;
+    }
+}
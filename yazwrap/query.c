@@ -0,0 +1,357 @@
+/* $Header$ */
+
+/*
+ * yazwrap/query.c -- compiled-query cache and shared CCL qualifiers.
+ *
+ * Each manager has a query cache, which holds the CCL qualifier set
+ * that its connections' CCL2RPN searches and scans are compiled with,
+ * and the type-1 queries most recently compiled from prefix and
+ * CCL2RPN query strings.  A query that is found in the cache is not
+ * parsed again: the cached tree, which lives in its entry's own ODR
+ * stream, is encoded straight into the request, which never modifies
+ * it.  Entries are kept in a hash table, and on a list from most to
+ * least recently used, so that the least recently used can be
+ * dropped when there are too many.
+ *
+ * The qualifier set is loaded from its file when first needed, and
+ * again whenever the file changes, which we check at most once a
+ * second.  Modification times are only to the second, so a file
+ * rewritten within the second it was loaded in is also recognised by
+ * its size or, if it was replaced by renaming, its inode.  CCL2RPN
+ * queries compiled with the old set are then forgotten.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <yaz/proto.h>
+#include <yaz/pquery.h>		/* prefix query compiler */
+#include <yaz/ccl.h>		/* CCL query compiler */
+#include <yaz/yaz-ccl.h>	/* CCL-to-RPN query converter */
+#include "ywpriv.h"
+
+typedef struct queryEntry {
+    int queryType;		/* QUERYTYPE_PREFIX or QUERYTYPE_CCL2RPN */
+    char *query;
+    unsigned hash;
+    ODR odr;			/* stream holding `rpn' */
+    Z_RPNQuery *rpn;
+    struct queryEntry *chain;	/* next in the same hash bucket */
+    struct queryEntry *newer;	/* neighbours in order of use */
+    struct queryEntry *older;
+} queryEntry;
+
+struct queryCache {
+    CCL_bibset bibset;		/* 0 until first needed */
+    char *qualPath;		/* file the qualifiers are loaded from */
+    struct stat qualStat;	/* its status when loaded */
+    time_t qualChecked;		/* when we last looked at it */
+    int max;			/* most entries kept: 0 to cache nothing */
+    int n;			/* number of entries */
+    int nbuckets;
+    queryEntry **buckets;
+    queryEntry *newest;
+    queryEntry *oldest;
+};
+
+static int loadQualifiers(QUERYCACHE qc);
+static int fileChanged(const struct stat *was, const struct stat *now);
+static Z_RPNQuery *compile(QUERYCACHE qc, ODR odr, int queryType,
+			   char *query, char **errmsgp);
+static unsigned hashQuery(int queryType, const char *query);
+static void unlinkEntry(QUERYCACHE qc, queryEntry *qe);
+static void linkNewest(QUERYCACHE qc, queryEntry *qe);
+static void dropEntry(QUERYCACHE qc, queryEntry *qe);
+
+
+/*
+ * Makes a query cache whose CCL qualifiers will be loaded from the
+ * file `qualPath' when first needed, and which keeps up to `max'
+ * compiled queries.
+ */
+QUERYCACHE queryCacheCreate(char *qualPath, int max)
+{
+    QUERYCACHE qc;
+    int i;
+
+    New(0, qc, 1, struct queryCache);
+    qc->bibset = 0;
+    qc->qualPath = savepv(qualPath);
+    memset(&qc->qualStat, 0, sizeof qc->qualStat);
+    qc->qualChecked = 0;
+    qc->max = max < 0 ? 0 : max;
+    qc->n = 0;
+    qc->nbuckets = qc->max + 1;
+    New(0, qc->buckets, qc->nbuckets, queryEntry*);
+    for (i = 0; i < qc->nbuckets; i++)
+	qc->buckets[i] = 0;
+    qc->newest = qc->oldest = 0;
+    return qc;
+}
+
+
+void queryCacheDestroy(QUERYCACHE qc)
+{
+    while (qc->oldest != 0)
+	dropEntry(qc, qc->oldest);
+    if (qc->bibset != 0)
+	ccl_qual_rm(&qc->bibset);
+    Safefree(qc->qualPath);
+    Safefree(qc->buckets);
+    Safefree(qc);
+}
+
+
+/*
+ * Loads the CCL qualifiers from the file `qualPath' now, and watches
+ * that file from now on.  Returns 1, or 0 if the file can't be read,
+ * with `errno' set and `*errmsgp' pointed at a message; the old
+ * qualifiers, if any, are then kept.
+ */
+int queryCacheLoad(QUERYCACHE qc, char *qualPath, char **errmsgp)
+{
+    char *old = qc->qualPath;
+
+    qc->qualPath = savepv(qualPath);
+    if (!loadQualifiers(qc)) {
+	int err = errno;
+	Safefree(qc->qualPath);
+	qc->qualPath = old;
+	errno = err;
+	*errmsgp = "can't read CCL qualifier file";
+	return 0;
+    }
+
+    Safefree(old);
+    qc->qualChecked = time(0);
+    return 1;
+}
+
+
+/*
+ * Returns the type-1 query compiled from `query', whose type is
+ * QUERYTYPE_PREFIX or QUERYTYPE_CCL2RPN, from the cache if it's
+ * there; otherwise compiles it and caches the result.  If the cache
+ * keeps nothing, the query is compiled into `odr' instead.  Returns a
+ * null pointer on error, with `*errmsgp' pointed at a message.
+ */
+Z_RPNQuery *queryCompile(QUERYCACHE qc, ODR odr, int queryType,
+			 char *query, char **errmsgp)
+{
+    queryEntry *qe;
+    unsigned hash;
+    ODR own;
+    Z_RPNQuery *rpn;
+
+    /* This may forget cached queries compiled with old qualifiers */
+    if (queryType == QUERYTYPE_CCL2RPN && queryQualifiers(qc, errmsgp) == 0)
+	return 0;
+
+    if (qc->max == 0)
+	return compile(qc, odr, queryType, query, errmsgp);
+
+    hash = hashQuery(queryType, query);
+    for (qe = qc->buckets[hash % qc->nbuckets]; qe != 0; qe = qe->chain) {
+	if (qe->hash == hash && qe->queryType == queryType &&
+	    !strcmp(qe->query, query)) {
+	    unlinkEntry(qc, qe);
+	    linkNewest(qc, qe);
+	    return qe->rpn;
+	}
+    }
+
+    if ((own = odr_createmem(ODR_ENCODE)) == 0)
+	return compile(qc, odr, queryType, query, errmsgp);
+    if ((rpn = compile(qc, own, queryType, query, errmsgp)) == 0) {
+	odr_destroy(own);
+	return 0;
+    }
+
+    New(0, qe, 1, queryEntry);
+    qe->queryType = queryType;
+    qe->query = savepv(query);
+    qe->hash = hash;
+    qe->odr = own;
+    qe->rpn = rpn;
+    qe->chain = qc->buckets[hash % qc->nbuckets];
+    qc->buckets[hash % qc->nbuckets] = qe;
+    linkNewest(qc, qe);
+    if (++qc->n > qc->max)
+	dropEntry(qc, qc->oldest);
+
+    return rpn;
+}
+
+
+/*
+ * Returns the current CCL qualifiers, loading them if they haven't
+ * been, or reloading them if their file has changed since.  A missing
+ * file means no qualifiers, as it always has; but once we have some,
+ * we keep them if the file goes away or can't be read.  Returns a
+ * null pointer on error, with `*errmsgp' pointed at a message.
+ */
+CCL_bibset queryQualifiers(QUERYCACHE qc, char **errmsgp)
+{
+    time_t now = time(0);
+    struct stat sb;
+
+    if (qc->bibset != 0 && now == qc->qualChecked)
+	return qc->bibset;
+    qc->qualChecked = now;
+
+    if (stat(qc->qualPath, &sb) < 0) {
+	if (qc->bibset == 0 && errno != ENOENT) {
+	    *errmsgp = "can't read CCL qualifier file";
+	    return 0;
+	}
+    } else if (qc->bibset == 0 || fileChanged(&qc->qualStat, &sb)) {
+	if (!loadQualifiers(qc) && qc->bibset == 0) {
+	    *errmsgp = "can't read CCL qualifier file";
+	    return 0;
+	}
+    }
+
+    if (qc->bibset == 0)
+	qc->bibset = ccl_qual_mk();
+    return qc->bibset;
+}
+
+
+/*
+ * Replaces the qualifiers with those in the file `qc->qualPath', and
+ * forgets the queries compiled with the old ones.  Returns 0, with
+ * `errno' set, if the file can't be opened.
+ */
+static int loadQualifiers(QUERYCACHE qc)
+{
+    CCL_bibset bibset;
+    struct stat sb;
+    queryEntry *qe, *next;
+    FILE *fp;
+
+    if ((fp = fopen(qc->qualPath, "r")) == 0)
+	return 0;
+    bibset = ccl_qual_mk();
+    ccl_qual_file(bibset, fp);
+    if (fstat(fileno(fp), &sb) == 0)
+	qc->qualStat = sb;
+    else
+	memset(&qc->qualStat, 0, sizeof qc->qualStat);
+    fclose(fp);
+
+    if (qc->bibset != 0)
+	ccl_qual_rm(&qc->bibset);
+    qc->bibset = bibset;
+
+    for (qe = qc->oldest; qe != 0; qe = next) {
+	next = qe->newer;
+	if (qe->queryType == QUERYTYPE_CCL2RPN)
+	    dropEntry(qc, qe);
+    }
+
+    return 1;
+}
+
+
+/*
+ * Returns true if the file whose status was `was' when the qualifiers
+ * were loaded from it has changed since, by the look of `now'.
+ */
+static int fileChanged(const struct stat *was, const struct stat *now)
+{
+    return now->st_mtime != was->st_mtime ||
+	now->st_size != was->st_size ||
+	now->st_ino != was->st_ino ||
+	now->st_dev != was->st_dev;
+}
+
+
+/*
+ * Compiles `query' into `odr'.  CCL2RPN queries are compiled with the
+ * current qualifiers, which the caller has made sure we have.
+ */
+static Z_RPNQuery *compile(QUERYCACHE qc, ODR odr, int queryType,
+			   char *query, char **errmsgp)
+{
+    Z_RPNQuery *rpn;
+    struct ccl_rpn_node *node;
+    oident attrset;
+    int oidbuf[20];		/* more than enough */
+    int error, pos;
+
+    if (queryType == QUERYTYPE_PREFIX) {
+	if ((rpn = p_query_rpn(odr, PROTO_Z3950, query)) == 0)
+	    *errmsgp = "can't compile PQN query";
+	return rpn;
+    }
+
+    if ((node = ccl_find_str(qc->bibset, query, &error, &pos)) == 0) {
+	*errmsgp = (char*) ccl_err_msg(error);
+	return 0;
+    }
+    rpn = ccl_rpn_query(odr, node);
+    ccl_rpn_delete(node);
+    if (rpn == 0) {
+	*errmsgp = "can't encode Type-1 query";
+	return 0;
+    }
+
+    attrset.proto = PROTO_Z3950;
+    attrset.oclass = CLASS_ATTSET;
+    attrset.value = VAL_BIB1;	/* ### should be configurable! */
+    rpn->attributeSetId = odr_oiddup(odr, oid_ent_to_oid(&attrset, oidbuf));
+    return rpn;
+}
+
+
+static unsigned hashQuery(int queryType, const char *query)
+{
+    unsigned hash = (unsigned) queryType;
+
+    while (*query != '\0')
+	hash = hash * 33 + (unsigned char) *query++;
+    return hash;
+}
+
+
+static void unlinkEntry(QUERYCACHE qc, queryEntry *qe)
+{
+    if (qe->newer != 0)
+	qe->newer->older = qe->older;
+    else
+	qc->newest = qe->older;
+    if (qe->older != 0)
+	qe->older->newer = qe->newer;
+    else
+	qc->oldest = qe->newer;
+}
+
+
+static void linkNewest(QUERYCACHE qc, queryEntry *qe)
+{
+    qe->newer = 0;
+    qe->older = qc->newest;
+    if (qc->newest != 0)
+	qc->newest->newer = qe;
+    else
+	qc->oldest = qe;
+    qc->newest = qe;
+}
+
+
+static void dropEntry(QUERYCACHE qc, queryEntry *qe)
+{
+    queryEntry **qep = &qc->buckets[qe->hash % qc->nbuckets];
+
+    while (*qep != qe)
+	qep = &(*qep)->chain;
+    *qep = qe->chain;
+    unlinkEntry(qc, qe);
+    qc->n--;
+
+    odr_destroy(qe->odr);
+    Safefree(qe->query);
+    Safefree(qe);
+}
@@ -3,9 +3,11 @@
 /*
  * yazwrap/receive.c -- wrapper functions for Yaz's client API.
  *
- * This file provides a single function, decodeAPDU(), which pulls an
- * APDU off the network, decodes it (using YAZ) and converts it from
- * Yaz's C structures into broadly equivalent Perl functions.
+ * This file provides the function decodeAPDU(), which pulls an APDU
+ * off the network, decodes it (using YAZ) and converts it from Yaz's
+ * C structures into broadly equivalent Perl functions; and its
+ * batch-mode sibling decodeAPDUs(), which does the same for every
+ * complete APDU that's already been read.
  */
 
 #include <assert.h>
@@ -14,13 +16,133 @@
 #include "ywpriv.h"
 
 
+/*
+ * A decode arena is an ODR stream whose decoded structures are kept
+ * alive for as long as there are lazy records or shared record
+ * buffers (see below) that refer into it.  While nothing has claimed
+ * it, the arena is kept for re-use in `spareArena'; as soon as
+ * something has, it belongs to the records, and is freed when the
+ * last of them is.
+ */
+typedef struct decodeArena {
+    ODR odr;
+    int refcount;		/* number of records using it */
+} decodeArena;
+
+/*
+ * A lazy record is a decoded but not-yet-translated GRS-1 or OPAC
+ * record, wrapped in a thin Perl handle.  When the Perl layer first
+ * looks inside it, we translate it (once) into the usual blessed
+ * structure and cache that.
+ */
+#define LAZY_GRS1 1
+#define LAZY_OPAC 2
+struct lazyRecord {
+    decodeArena *arena;
+    int flags;			/* DECODE_* flags in force when made */
+    int which;			/* LAZY_GRS1 or LAZY_OPAC */
+    void *data;			/* Z_GenericRecord* or Z_OPACRecord* */
+    SV *cache;			/* translated referent, once we have it */
+};
+
+static decodeArena *spareArena = 0;
+/* Non-null while translating with DECODE_LAZY or DECODE_SHARED */
+static decodeArena *curArena = 0;
+static int curFlags = 0;
+static void releaseArena(decodeArena *arena);
+
+/*
+ * The decode context holds what we would otherwise look up afresh
+ * for every object we make: the stash of each class, and a shared,
+ * pre-hashed key for each hash member.  Both are found by the address
+ * of the class or member name, which is always a string literal in
+ * this file, so no name is hashed or measured more than once.  It
+ * also holds the OID of each record syntax that we know, which YAZ
+ * would otherwise build for every opaque record we translate.  It's
+ * set up when the first APDU is decoded; lazy records can't be made
+ * before then, so it's always ready for lazyMaterialise().
+ */
+#define DC_SLOTS 256		/* several times the number of names used */
+typedef struct internSlot {
+    const char *name;		/* null if the slot is free */
+    void *value;		/* HV* stash or SV* key, once we have it */
+    U32 hash;			/* of the key */
+} internSlot;
+
+static struct {
+    int initialised;
+    internSlot stashes[DC_SLOTS];
+    internSlot keys[DC_SLOTS];
+    int lastSyntax;		/* index of the last record syntax seen */
+} dc;
+
+static struct {
+    oid_value val;
+    char *class;
+    int oid[OID_SIZE];		/* filled in by initDecodeContext() */
+} recordSyntaxes[] = {
+    { VAL_USMARC,		"Net::Z3950::Record::USMARC" },
+    { VAL_UKMARC,		"Net::Z3950::Record::UKMARC" },
+    { VAL_NORMARC,		"Net::Z3950::Record::NORMARC" },
+    { VAL_LIBRISMARC,		"Net::Z3950::Record::LIBRISMARC" },
+    { VAL_DANMARC,		"Net::Z3950::Record::DANMARC" },
+    { VAL_UNIMARC,		"Net::Z3950::Record::UNIMARC" },
+    { VAL_HTML,			"Net::Z3950::Record::HTML" },
+    { VAL_TEXT_XML,		"Net::Z3950::Record::XML" },
+    { VAL_APPLICATION_XML,	"Net::Z3950::Record::XML" },
+    { VAL_MAB,			"Net::Z3950::Record::MAB" },
+    { VAL_NOP }			/* end marker */
+    /* ### etc. */
+};
+
+static void initDecodeContext(void);
+static internSlot *intern(internSlot *table, const char *name);
+
+/*
+ * Under DECODE_STREAM, the records of a present response are not
+ * gathered into a NamePlusRecordList.  Instead, each is passed as
+ * soon as it's translated to the callback registered for the
+ * connection by decodeStream(), along with the response's reference
+ * ID and the record's 0-based position in the response; and the
+ * response's `streamed' member says how many were passed.  If the
+ * callback dies, we stop there, and decodeAPDUs() dies in turn once
+ * we've tidied up.
+ */
+typedef struct streamTarget {
+    COMSTACK cs;
+    SV *cb;
+    struct streamTarget *next;
+} streamTarget;
+
+static streamTarget *streamTargets = 0;
+/* Non-null while translating an APDU whose records are to be streamed */
+static SV *curStream = 0;
+static int streamFailed = 0;
+static SV *streamCallback(COMSTACK cs);
+static int streamRecords(Odr_oct *referenceId, Z_NamePlusRecordList *x);
+static void streamCroak(SV *sv);
+
+/*
+ * Magic attached to each shared record buffer, so that the arena it
+ * points into is released when the buffer's SV is freed.
+ */
+static int sharedFree(pTHX_ SV *sv, MAGIC *mg)
+{
+    releaseArena((decodeArena*) mg->mg_ptr);
+    return 0;
+}
+static MGVTBL sharedVtbl = { 0, 0, 0, 0, sharedFree };
+
+static SV *decodeOne(COMSTACK cs, int flags, int *reasonp);
 static SV *translateAPDU(Z_APDU *apdu, int *reasonp);
 static SV *translateInitResponse(Z_InitResponse *res, int *reasonp);
 static SV *translateSearchResponse(Z_SearchResponse *res, int *reasonp);
 static SV *translateScanResponse(Z_ScanResponse *res, int *reasonp);
 static SV *translatePresentResponse(Z_PresentResponse *res, int *reasonp);
+static SV *translateSegment(Z_Segment *res, int *reasonp);
 static SV *translateDeleteRSResponse(Z_DeleteResultSetResponse *res,
 				     int *reasonp);
+static SV *translateSortResponse(Z_SortResponse *res, int *reasonp);
 static SV *translateClose(Z_Close *res, int *reasonp);
 static SV *translateRecords(Z_Records *x);
 static SV *translateNamePlusRecordList(Z_NamePlusRecordList *x);
@@ -52,6 +174,8 @@ static SV *translateSearchInfoReport(Z_SearchInfoReport *x);
 static SV *translateSearchInfoReport_s(Z_SearchInfoReport_s *x);
 static SV *translateQueryExpression(Z_QueryExpression *x);
 static SV *translateQueryExpressionTerm(Z_QueryExpressionTerm *x);
+static SV *newLazy(char *class, int which, void *data);
+static SV *newBuffer(char *class, char *data, int len);
 static SV *newObject(char *class, SV *referent);
 static void setNumber(HV *hv, char *name, IV val);
 static void setString(HV *hv, char *name, char *val);
@@ -72,12 +196,26 @@ static void setMember(HV *hv, char *name, SV *val);
  *	just fine.
  */
 SV *decodeAPDU(COMSTACK cs, int *reasonp)
+{
+    return decodeOne(cs, 0, reasonp);
+}
+
+
+/*
+ * `flags' is a bitmask of the DECODE_* values in "yazwrap.h".  When
+ * DECODE_LAZY or DECODE_SHARED is set, we decode into an arena rather
+ * than our private ODR stream, so that records can refer back into it
+ * after we return.
+ */
+static SV *decodeOne(COMSTACK cs, int flags, int *reasonp)
 {
     static char *buf = 0;	/* apparently, static is OK */
     static int size = 0;	/* apparently, static is OK */
     int nbytes;
-    static ODR odr = 0;
+    static ODR privodr = 0;
+    ODR odr;
     Z_APDU *apdu;
+    SV *sv;
 
     switch (cs_look(cs)) {
     case CS_CONNECT:
@@ -114,6 +252,17 @@ SV *decodeAPDU(COMSTACK cs, int *reasonp)
 	break;
     }
 
+    if (flags & (DECODE_LAZY|DECODE_SHARED)) {
+	if (spareArena == 0) {
+	    New(0, spareArena, 1, decodeArena);
+	    spareArena->odr = 0;
+	    spareArena->refcount = 0;
+	}
+	odr = spareArena->odr;
+    } else {
+	odr = privodr;
+    }
+
     if (odr)
 	odr_reset(odr);
     else {
@@ -125,6 +274,10 @@ SV *decodeAPDU(COMSTACK cs, int *reasonp)
 	     */
 	    fatal("impossible odr_createmem() failure");
 	}
+	if (flags & (DECODE_LAZY|DECODE_SHARED))
+	    spareArena->odr = odr;
+	else
+	    privodr = odr;
     }
 
     odr_setbuf(odr, buf, nbytes, 0);
@@ -137,8 +290,72 @@ SV *decodeAPDU(COMSTACK cs, int *reasonp)
 	return 0;
     }
 
-    /* ### we should find a way to request another call if cs_more() */
-    return translateAPDU(apdu, reasonp);
+    if (!dc.initialised)
+	initDecodeContext();
+    curStream = (flags & DECODE_STREAM) ? streamCallback(cs) : 0;
+    if (!(flags & (DECODE_LAZY|DECODE_SHARED))) {
+	sv = translateAPDU(apdu, reasonp);
+	curStream = 0;
+	return sv;
+    }
+
+    curArena = spareArena;
+    curFlags = flags;
+    sv = translateAPDU(apdu, reasonp);
+    curArena = 0;
+    curFlags = 0;
+    curStream = 0;
+    if (spareArena->refcount != 0) {
+	/* Now owned by its records: use a new one next time */
+	spareArena = 0;
+    }
+    return sv;
+}
+
+
+/*
+ * When the server pipelines its responses, a single read() may pull
+ * several complete APDUs into the COMSTACK's buffer, but the socket
+ * will not select() as readable again until yet more data arrives.
+ * So we keep decoding for as long as cs_more() tells us there's
+ * something left in the buffer, and return a reference to an array
+ * of all the APDUs we got.
+ *
+ * If not even one APDU could be decoded, we return a null pointer
+ * with *reasonp set, exactly as decodeAPDU() does.  Otherwise, the
+ * array is returned and *reasonp is zero -- unless something went
+ * wrong after the first APDU, in which case *reasonp says what, and
+ * the caller should deal with it after dispatching the APDUs it did
+ * get.  (REASON_INCOMPLETE here just means that the tail-end of the
+ * buffer is the start of an APDU we don't have all of yet.)
+ */
+SV *decodeAPDUs(COMSTACK cs, int flags, int *reasonp)
+{
+    AV *av;
+    SV *apdu;
+
+    apdu = decodeOne(cs, flags, reasonp);
+    if (streamFailed)
+	streamCroak(apdu);
+    if (apdu == 0)
+	return 0;
+
+    av = newAV();
+    av_push(av, apdu);
+    *reasonp = 0;
+    while (cs_more(cs)) {
+	apdu = decodeOne(cs, flags, reasonp);
+	if (streamFailed) {
+	    SvREFCNT_dec((SV*) av);
+	    streamCroak(apdu);
+	}
+	if (apdu == 0)
+	    break;
+	av_push(av, apdu);
+	*reasonp = 0;
+    }
+
+    return newRV_noinc((SV*) av);
 }
 
 
@@ -180,9 +397,13 @@ static SV *translateAPDU(Z_APDU *apdu, int *reasonp)
 	return translateScanResponse(apdu->u.scanResponse, reasonp);
     case Z_APDU_presentResponse:
 	return translatePresentResponse(apdu->u.presentResponse, reasonp);
+    case Z_APDU_segmentRequest:
+	return translateSegment(apdu->u.segmentRequest, reasonp);
     case Z_APDU_deleteResultSetResponse:
 	return translateDeleteRSResponse(apdu->u.deleteResultSetResponse,
 					 reasonp);
+    case Z_APDU_sortResponse:
+	return translateSortResponse(apdu->u.sortResponse, reasonp);
     case Z_APDU_close:
 	return translateClose(apdu->u.close, reasonp);
     default:
@@ -306,6 +527,39 @@ static SV *translateDeleteRSResponse(Z_DeleteResultSetResponse *res,
     return sv;
 }
 
+static SV *translateSortResponse(Z_SortResponse *res, int *reasonp)
+{
+    SV *sv;
+    HV *hv;
+
+    sv = newObject("Net::Z3950::APDU::SortResponse", (SV*) (hv = newHV()));
+
+    if (res->referenceId) {
+	setBuffer(hv, "referenceId",
+		  (char*) res->referenceId->buf, res->referenceId->len);
+    }
+
+    setNumber(hv, "sortStatus", (IV) *res->sortStatus);
+    if (res->resultSetStatus)
+	setNumber(hv, "resultSetStatus", (IV) *res->resultSetStatus);
+    if (res->resultCount)
+	setNumber(hv, "resultCount", (IV) *res->resultCount);
+
+    if (res->num_diagnostics > 0) {
+	/* Same representation as a Z_DiagRecs */
+	AV *av;
+	int i;
+
+	setMember(hv, "diagnostics",
+		  newObject("Net::Z3950::APDU::DiagRecs", (SV*) (av = newAV())));
+	for (i = 0; i < res->num_diagnostics; i++)
+	    av_push(av, translateDiagRec(res->diagnostics[i]));
+    }
+
+    /* otherInfo (OPT) not translated (complex data type) */
+    return sv;
+}
+
 static SV *translateClose(Z_Close *res, int *reasonp)
 {
     SV *sv;
@@ -343,8 +597,46 @@ static SV *translatePresentResponse(Z_PresentResponse *res, int *reasonp)
 	      (IV) *res->numberOfRecordsReturned);
     setNumber(hv, "nextResultSetPosition", (IV) *res->nextResultSetPosition);
     setNumber(hv, "presentStatus", (IV) *res->presentStatus);
-    if (res->records)
+    if (res->records && curStream != 0 &&
+	res->records->which == Z_Records_DBOSD) {
+	setNumber(hv, "streamed", (IV) streamRecords(res->referenceId,
+			res->records->u.databaseOrSurDiagnostics));
+    } else if (res->records) {
 	setMember(hv, "records", translateRecords(res->records));
+    }
+
+    /* otherInfo (OPT) not translated (complex data type) */
+
+    return sv;
+}
+
+
+/*
+ * Under segmentation, a present response may be preceded by any
+ * number of these, each holding some of its records.  A record that
+ * doesn't fit in one segment is split into fragments, which are
+ * reassembled by the Perl layer.
+ */
+static SV *translateSegment(Z_Segment *res, int *reasonp)
+{
+    SV *sv;
+    HV *hv;
+    Z_NamePlusRecordList list;
+
+    sv = newObject("Net::Z3950::APDU::Segment", (SV*) (hv = newHV()));
+
+    if (res->referenceId)
+	setBuffer(hv, "referenceId",
+		  (char*) res->referenceId->buf, res->referenceId->len);
+    setNumber(hv, "numberOfRecordsReturned",
+	      (IV) *res->numberOfRecordsReturned);
+
+    list.num_records = res->num_segmentRecords;
+    list.records = res->segmentRecords;
+    if (curStream != 0)
+	setNumber(hv, "streamed", (IV) streamRecords(res->referenceId, &list));
+    else
+	setMember(hv, "segmentRecords", translateNamePlusRecordList(&list));
 
     /* otherInfo (OPT) not translated (complex data type) */
 
@@ -567,8 +859,14 @@ static SV *translateExternal(Z_External *x)
     case Z_External_sutrs:
 	return translateSUTRS(x->u.sutrs);
     case Z_External_grs1:
+	if (curFlags & DECODE_LAZY)
+	    return newLazy("Net::Z3950::Record::GRS1::Lazy",
+			   LAZY_GRS1, (void*) x->u.grs1);
 	return translateGenericRecord(x->u.grs1);
     case Z_External_OPAC:
+	if (curFlags & DECODE_LAZY)
+	    return newLazy("Net::Z3950::Record::OPAC::Lazy",
+			   LAZY_OPAC, (void*) x->u.opac);
 	return translateOPACRecord(x->u.opac);
     case Z_External_octet:
 	/* This is used for any opaque data-block (i.e. just a hunk of
@@ -596,8 +894,7 @@ static SV *translateSUTRS(Z_SUTRS *x)
      * analogue, but with additional, record-syntax-specific,
      * functionality.
      */
-    return newObject("Net::Z3950::Record::SUTRS",
-		     newSVpvn((char*) x->buf, x->len));
+    return newBuffer("Net::Z3950::Record::SUTRS", (char*) x->buf, x->len);
 }
 
 
@@ -683,7 +980,12 @@ static SV *translateElementData(Z_ElementData *x)
 	setMember(hv, "oid", translateOID(x->u.oid));
 	break;
     case Z_ElementData_subtree:
-	setMember(hv, "subtree", translateGenericRecord(x->u.subtree));
+	if (curFlags & DECODE_LAZY)
+	    setMember(hv, "subtree",
+		      newLazy("Net::Z3950::Record::GRS1::Lazy",
+			      LAZY_GRS1, (void*) x->u.subtree));
+	else
+	    setMember(hv, "subtree", translateGenericRecord(x->u.subtree));
 	break;
     default:
 	fatal("illegal/unsupported `which' (%d) in Z_ElementData", x->which);
@@ -847,45 +1149,41 @@ static SV *translateCircRecord(Z_CircRecord *x)
  */
 static SV *translateOctetAligned(Odr_oct *x, Odr_oid *direct_reference)
 {
-    struct {
-	oid_value val;
-	char *name;
-    } rs[] = {
-	{ VAL_USMARC,		"Net::Z3950::Record::USMARC" },
-	{ VAL_UKMARC,		"Net::Z3950::Record::UKMARC" },
-	{ VAL_NORMARC,		"Net::Z3950::Record::NORMARC" },
-	{ VAL_LIBRISMARC,	"Net::Z3950::Record::LIBRISMARC" },
-	{ VAL_DANMARC,		"Net::Z3950::Record::DANMARC" },
-	{ VAL_UNIMARC,		"Net::Z3950::Record::UNIMARC" },
-	{ VAL_UNIMARC,		"Net::Z3950::Record::UNIMARC" },
-	{ VAL_HTML,		"Net::Z3950::Record::HTML" },
-	{ VAL_TEXT_XML,		"Net::Z3950::Record::XML" },
-	{ VAL_APPLICATION_XML,	"Net::Z3950::Record::XML" },
-	{ VAL_MAB,              "Net::Z3950::Record::MAB" },
-	{ VAL_NOP }		/* end marker */
-	/* ### etc. */
-    };
+    /* Responses are almost always all in one syntax, so try that first */
+    int i = dc.lastSyntax;
 
-    int i;
-    for (i = 0; rs[i].val != VAL_NOP; i++) {
-	static struct oident ent = { PROTO_Z3950, CLASS_RECSYN };
-	int *oid;
-	ent.value = rs[i].val;
-	oid = oid_getoidbyent(&ent);
-	if (!oid_oidcmp(oid, direct_reference))
-	    break;
+    if (oid_oidcmp(recordSyntaxes[i].oid, direct_reference)) {
+	for (i = 0; recordSyntaxes[i].val != VAL_NOP; i++) {
+	    if (!oid_oidcmp(recordSyntaxes[i].oid, direct_reference))
+		break;
+	}
+	if (recordSyntaxes[i].val == VAL_NOP)
+	    fatal("can't translate record of unknown RS");
+	dc.lastSyntax = i;
     }
 
-    if (rs[i].val == VAL_NOP)
-	fatal("can't translate record of unknown RS");
-
-    return newObject(rs[i].name, newSVpvn((char*) x->buf, x->len));
+    return newBuffer(recordSyntaxes[i].class, (char*) x->buf, x->len);
 }
 
 
+/*
+ * An externally tagged fragment is translated like any other record,
+ * but holds only part of the record's data; any other fragment is
+ * represented as a plain string.
+ */
 static SV *translateFragmentSyntax(Z_FragmentSyntax *x)
 {
-    return 0;			/* ### not yet implemented */
+    switch (x->which) {
+    case Z_FragmentSyntax_externallyTagged:
+	return translateExternal(x->u.externallyTagged);
+    case Z_FragmentSyntax_notExternallyTagged:
+	return newSVpvn((char*) x->u.notExternallyTagged->buf,
+			x->u.notExternallyTagged->len);
+    default:
+	break;
+    }
+    fatal("illegal `which' in Z_FragmentSyntax");
+    return 0;			/* NOTREACHED; inhibit gcc -Wall warning */
 }
 
 
@@ -943,14 +1241,11 @@ static SV *translateOID(Odr_oid *x)
      * blessed scalar string of "."-separated elements.
      */
     char buf[1000];
+    char *cp = buf;
     int i;
 
-    *buf = '\0';
-    for (i = 0; x[i] >= 0; i++) {
-	sprintf(buf + strlen(buf), "%d", (int) x[i]);
-	if (x[i+1] >= 0)
-	    strcat(buf, ".");
-    }
+    for (i = 0; x[i] >= 0 && cp < buf + sizeof buf - 24; i++)
+	cp += sprintf(cp, i == 0 ? "%d" : ".%d", (int) x[i]);
 
     /*
      * ### We'd like to return a blessed scalar (string) here, but of
@@ -959,9 +1254,9 @@ static SV *translateOID(Odr_oid *x)
      *	bless _that_.  Better to do without the blessing, I think.
      */
     if (1) {
-	return newSVpv(buf, 0);
+	return newSVpvn(buf, cp - buf);
     } else {
-	return newObject("Net::Z3950::APDU::OID", newSVpv(buf, 0));
+	return newObject("Net::Z3950::APDU::OID", newSVpvn(buf, cp - buf));
     }
 }
 
@@ -1082,19 +1377,247 @@ static SV *translateQueryExpressionTerm(Z_QueryExpressionTerm *x)
 }
 
 
+/*
+ * Wraps the decoded record `data' in a lazy-record handle, which is
+ * represented in Perl as a blessed reference to a scalar holding the
+ * address of the C structure.  The handle holds a reference to the
+ * current arena, which must therefore be set.
+ */
+static SV *newLazy(char *class, int which, void *data)
+{
+    lazyRecord *lr;
+
+    assert(curArena != 0);
+    New(0, lr, 1, lazyRecord);
+    lr->arena = curArena;
+    lr->flags = curFlags;
+    lr->which = which;
+    lr->data = data;
+    lr->cache = 0;
+    curArena->refcount++;
+
+    return newObject(class, newSViv(PTR2IV(lr)));
+}
+
+
+/*
+ * Returns a new reference to the fully translated form of the lazy
+ * record `lr', translating it first if this is the first time we've
+ * been asked.  Any subrecords within it are themselves made lazy.
+ */
+SV *lazyMaterialise(lazyRecord *lr)
+{
+    if (lr->cache == 0) {
+	SV *sv;
+
+	curArena = lr->arena;
+	curFlags = lr->flags;
+	if (lr->which == LAZY_GRS1)
+	    sv = translateGenericRecord((Z_GenericRecord*) lr->data);
+	else
+	    sv = translateOPACRecord((Z_OPACRecord*) lr->data);
+	curArena = 0;
+	curFlags = 0;
+
+	/* Keep the referent itself, and discard the reference */
+	lr->cache = SvRV(sv);
+	SvREFCNT_inc(lr->cache);
+	SvREFCNT_dec(sv);
+    }
+
+    return newRV_inc(lr->cache);
+}
+
+
+/*
+ * Cheap enough that we don't need to translate the record to find out
+ */
+int lazyCount(lazyRecord *lr)
+{
+    if (lr->which == LAZY_GRS1)
+	return ((Z_GenericRecord*) lr->data)->num_elements;
+    return ((Z_OPACRecord*) lr->data)->num_holdingsData;
+}
+
+
+/*
+ * Called from the handle's DESTROY method.  When the last record
+ * using an arena goes away, so does the arena.
+ */
+void lazyFree(lazyRecord *lr)
+{
+    decodeArena *arena = lr->arena;
+
+    if (lr->cache != 0)
+	SvREFCNT_dec(lr->cache);
+    Safefree(lr);
+    releaseArena(arena);
+}
+
+
+/*
+ * Registers `cb' as the callback to which records decoded from `cs'
+ * under DECODE_STREAM are passed, replacing any registered before; or
+ * forgets the callback if `cb' is null or undefined, as yaz_close()
+ * does.
+ */
+void decodeStream(COMSTACK cs, SV *cb)
+{
+    streamTarget **stp, *st;
+
+    for (stp = &streamTargets; *stp != 0; stp = &(*stp)->next) {
+	if ((*stp)->cs == cs)
+	    break;
+    }
+
+    if ((st = *stp) != 0) {
+	SvREFCNT_dec(st->cb);
+	if (cb == 0 || !SvOK(cb)) {
+	    *stp = st->next;
+	    Safefree(st);
+	    return;
+	}
+    } else {
+	if (cb == 0 || !SvOK(cb))
+	    return;
+	New(0, st, 1, streamTarget);
+	st->cs = cs;
+	st->next = streamTargets;
+	streamTargets = st;
+    }
+
+    st->cb = newSVsv(cb);
+}
+
+
+/* Returns the callback registered for `cs', or a null pointer */
+static SV *streamCallback(COMSTACK cs)
+{
+    streamTarget *st;
+
+    for (st = streamTargets; st != 0; st = st->next) {
+	if (st->cs == cs)
+	    return st->cb;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Translates the records of a present response one at a time, passing
+ * each to the current stream callback and then letting it go.
+ * Returns the number passed.
+ */
+static int streamRecords(Odr_oct *referenceId, Z_NamePlusRecordList *x)
+{
+    SV *refId;
+    int i;
+
+    refId = referenceId == 0 ? newSV(0) :
+	newSVpvn((char*) referenceId->buf, referenceId->len);
+
+    for (i = 0; i < x->num_records && !streamFailed; i++) {
+	dSP;
+
+	ENTER;
+	SAVETMPS;
+	PUSHMARK(SP);
+	XPUSHs(refId);
+	XPUSHs(sv_2mortal(newSViv(i)));
+	XPUSHs(sv_2mortal(translateNamePlusRecord(x->records[i])));
+	PUTBACK;
+	call_sv(curStream, G_DISCARD|G_EVAL);
+	if (SvTRUE(ERRSV))
+	    streamFailed = 1;
+	FREETMPS;
+	LEAVE;
+    }
+
+    SvREFCNT_dec(refId);
+    return i;
+}
+
+
+/*
+ * Called once the statics are tidy after a stream callback has died:
+ * frees `sv', the APDU whose records it was passed, if there is one,
+ * and dies with the callback's error.
+ */
+static void streamCroak(SV *sv)
+{
+    streamFailed = 0;
+    if (sv != 0)
+	SvREFCNT_dec(sv);
+    croak(Nullch);		/* propagates $@ */
+}
+
+
+static void releaseArena(decodeArena *arena)
+{
+    if (--arena->refcount == 0 && arena != spareArena) {
+	odr_destroy(arena->odr);
+	Safefree(arena);
+    }
+}
+
+
+/*
+ * Makes an object of class `class' representing an opaque record
+ * whose content is the `len' bytes at `data'.  Usually that means
+ * copying the data into a new string; but under DECODE_SHARED, the
+ * string instead points directly into the current arena, which must
+ * then live as long as the string does, and the string is made
+ * read-only so that Perl never tries to extend or free the buffer.
+ * (YAZ allocates a spare byte after each decoded octet string, and
+ * NUL-terminates it, so the buffer is a well-formed Perl string.)
+ */
+static SV *newBuffer(char *class, char *data, int len)
+{
+    SV *sv, *referent;
+
+    if (!(curFlags & DECODE_SHARED))
+	return newObject(class, newSVpvn(data, len));
+
+    referent = newSV(0);
+    (void) SvUPGRADE(referent, SVt_PVMG);
+    SvPV_set(referent, data);
+    SvCUR_set(referent, len);
+    SvLEN_set(referent, 0);	/* => Perl doesn't own the buffer */
+    SvPOK_only(referent);
+    sv_magicext(referent, 0, PERL_MAGIC_ext, &sharedVtbl,
+		(char*) curArena, 0);
+    curArena->refcount++;
+
+    sv = newObject(class, referent);
+    SvREADONLY_on(referent);	/* can't do this before blessing it */
+    return sv;
+}
+
+
 /*
  * Creates a new Perl object of type `class'; the newly-created scalar
  * that is a reference to the blessed thingy `referent' is returned.
  */
 static SV *newObject(char *class, SV *referent)
 {
+    internSlot *slot = intern(dc.stashes, class);
     HV *stash;
     SV *sv;
 
     sv = newRV_noinc((SV*) referent);
-    stash = gv_stashpv(class, 0);
-    if (stash == 0)
-	fatal("attempt to create object of undefined class '%s'", class);
+    if (slot != 0 && slot->value != 0) {
+	stash = (HV*) slot->value;
+    } else {
+	stash = gv_stashpv(class, 0);
+	if (stash == 0)
+	    fatal("attempt to create object of undefined class '%s'", class);
+	if (slot != 0) {
+	    /* Hold on to it, in case the package is ever deleted */
+	    SvREFCNT_inc((SV*) stash);
+	    slot->value = stash;
+	}
+    }
     sv_bless(sv, stash);
     return sv;
 }
@@ -1127,6 +1650,66 @@ static void setMember(HV *hv, char *name, SV *val)
      * the reference via this hash is the only reference to it in
      * general.
      */
-    if (!hv_store(hv, name, (U32) strlen(name), val, (U32) 0))
+    internSlot *slot = intern(dc.keys, name);
+
+    if (slot == 0) {
+	if (!hv_store(hv, name, (U32) strlen(name), val, (U32) 0))
+	    fatal("couldn't store member in hash");
+	return;
+    }
+
+    if (slot->value == 0) {
+	I32 len = (I32) strlen(name);
+	PERL_HASH(slot->hash, name, len);
+	slot->value = newSVpvn_share(name, len, slot->hash);
+    }
+    if (!hv_store_ent(hv, (SV*) slot->value, val, slot->hash))
 	fatal("couldn't store member in hash");
 }
+
+
+/*
+ * Works out the OID of each record syntax in `recordSyntaxes'.  The
+ * stashes and keys are filled in by intern()'s callers as each name
+ * is first used, since not every class need be defined by the time
+ * we decode the first APDU.
+ */
+static void initDecodeContext(void)
+{
+    static struct oident ent = { PROTO_Z3950, CLASS_RECSYN };
+    int i, *oid;
+
+    for (i = 0; recordSyntaxes[i].val != VAL_NOP; i++) {
+	ent.value = recordSyntaxes[i].val;
+	if ((oid = oid_getoidbyent(&ent)) != 0)
+	    oid_oidcpy(recordSyntaxes[i].oid, oid);
+	else
+	    recordSyntaxes[i].oid[0] = -1;	/* matches nothing */
+    }
+    dc.lastSyntax = 0;
+    dc.initialised = 1;
+}
+
+
+/*
+ * Returns the slot of `table' for `name', which must be a string
+ * literal, claiming a free one if there's none yet; or a null pointer
+ * if the table is full, in which case the caller must do without.
+ */
+static internSlot *intern(internSlot *table, const char *name)
+{
+    UV i = (PTR2UV(name) >> 2) % DC_SLOTS;
+    int n;
+
+    for (n = 0; n < DC_SLOTS; n++, i = (i + 1) % DC_SLOTS) {
+	if (table[i].name == name)
+	    return &table[i];
+	if (table[i].name == 0) {
+	    table[i].name = name;
+	    table[i].value = 0;
+	    return &table[i];
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,311 @@
+/* $Header$ */
+
+/*
+ * yazwrap/resolve.c -- asynchronous hostname lookups.
+ *
+ * cs_create_host() looks up the server's name with a blocking call,
+ * which stalls every other connection while a slow nameserver makes
+ * up its mind.  So instead we do the lookups on a small pool of
+ * threads, each of which reports a completed lookup by writing a byte
+ * down a pipe that the Perl code watches with Event.  The caller then
+ * connects to the numeric address, which cs_create_host() can handle
+ * without blocking.
+ *
+ * The worker threads never touch the Perl interpreter, so the memory
+ * they share with it comes from malloc() rather than New().
+ *
+ * A child process inherits none of the threads, but does inherit the
+ * pipe, which its parent's workers go on writing to; see forkChild()
+ * for how it's given a resolver of its own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "ywpriv.h"
+
+#define RESOLVER_THREADS 4
+
+typedef struct lookup {
+    int id;
+    char *host;
+    char addr[INET6_ADDRSTRLEN]; /* numeric address, once resolved */
+    int error;			/* getaddrinfo() error code, or 0 */
+    struct lookup *next;
+} lookup;
+
+/* Everything below is protected by `lock' */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static lookup *todo = 0, **todoTail = &todo;
+static lookup *done = 0, **doneTail = &done;
+static lookup *busy = 0;	/* lookups being done by a worker */
+static int ntodo = 0;		/* number of lookups in `todo' */
+static int nthreads = 0;	/* number of worker threads */
+static int nidle = 0;		/* number of them waiting for work */
+static int notify[2] = { -1, -1 }; /* read and write ends of the pipe */
+
+static void *worker(void *unused);
+static void lookupHost(lookup *lu);
+static void enqueue(lookup ***tailp, lookup *lu);
+static void setNonBlocking(int fd);
+static void forkPrepare(void);
+static void forkParent(void);
+static void forkChild(void);
+
+
+/*
+ * Returns the file descriptor which becomes readable when a lookup
+ * has completed, creating it if necessary; or -1 if it can't be
+ * created, in which case the caller should resolve synchronously.
+ */
+int resolverFd(void)
+{
+    static int registered = 0;
+
+    if (notify[0] >= 0)
+	return notify[0];
+
+    if (pipe(notify) < 0)
+	return -1;
+
+    /* Neither end may block: workers must not wait for the reader */
+    setNonBlocking(notify[0]);
+    setNonBlocking(notify[1]);
+    if (!registered) {
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+	registered = 1;
+    }
+    return notify[0];
+}
+
+
+/*
+ * Starts looking up `host' and returns a positive number identifying
+ * the lookup, which resolveNext() will return when it's done; or 0
+ * if the lookup can't be started, with `errno' set.
+ */
+int resolveStart(char *host)
+{
+    static int lastId = 0;
+    lookup *lu;
+    pthread_t tid;
+
+    if (resolverFd() < 0)
+	return 0;
+    if ((lu = malloc(sizeof *lu)) == 0)
+	return 0;
+    if ((lu->host = strdup(host)) == 0) {
+	free(lu);
+	return 0;
+    }
+
+    if (++lastId <= 0)
+	lastId = 1;
+    lu->id = lastId;
+    lu->addr[0] = 0;
+    lu->error = 0;
+
+    pthread_mutex_lock(&lock);
+    if (ntodo >= nidle && nthreads < RESOLVER_THREADS &&
+	pthread_create(&tid, 0, worker, 0) == 0) {
+	pthread_detach(tid);
+	nthreads++;
+    }
+    if (nthreads == 0) {
+	/* No worker, and none could be started */
+	pthread_mutex_unlock(&lock);
+	free(lu->host);
+	free(lu);
+	errno = EAGAIN;
+	return 0;
+    }
+    enqueue(&todoTail, lu);
+    ntodo++;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    return lastId;
+}
+
+
+/*
+ * Returns a reference to a three-element array describing a completed
+ * lookup: its identifier, the numeric address (undef if the lookup
+ * failed) and an error message (undef if it succeeded).  Returns a
+ * null pointer (which comes out as undef) if no lookup has completed
+ * since the last call.
+ */
+SV *resolveNext(void)
+{
+    char junk[64];
+    lookup *lu;
+    AV *av;
+
+    /* The bytes carry no information: they're only there to wake us */
+    while (read(notify[0], junk, sizeof junk) > 0)
+	;
+
+    pthread_mutex_lock(&lock);
+    if ((lu = done) != 0) {
+	if ((done = lu->next) == 0)
+	    doneTail = &done;
+    }
+    pthread_mutex_unlock(&lock);
+    if (lu == 0)
+	return 0;
+
+    av = newAV();
+    av_push(av, newSViv(lu->id));
+    if (lu->error == 0) {
+	av_push(av, newSVpv(lu->addr, 0));
+	av_push(av, newSVsv(&PL_sv_undef));
+    } else {
+	av_push(av, newSVsv(&PL_sv_undef));
+	av_push(av, newSVpv(gai_strerror(lu->error), 0));
+    }
+
+    free(lu->host);
+    free(lu);
+    return newRV_noinc((SV*) av);
+}
+
+
+static void *worker(void *unused)
+{
+    lookup *lu, **lup;
+    char c = 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+	while (todo == 0) {
+	    nidle++;
+	    pthread_cond_wait(&wakeup, &lock);
+	    nidle--;
+	}
+
+	lu = todo;
+	if ((todo = lu->next) == 0)
+	    todoTail = &todo;
+	ntodo--;
+	lu->next = busy;
+	busy = lu;
+	pthread_mutex_unlock(&lock);
+
+	lookupHost(lu);
+
+	pthread_mutex_lock(&lock);
+	for (lup = &busy; *lup != lu; lup = &(*lup)->next)
+	    ;
+	*lup = lu->next;
+	enqueue(&doneTail, lu);
+	/* If the pipe is full, the reader has plenty to wake it anyway */
+	(void) write(notify[1], &c, 1);
+    }
+
+    return 0;			/* not reached */
+}
+
+
+/*
+ * Takes the first address that getaddrinfo() offers, which is the
+ * one the system prefers, whether IPv4 or IPv6.
+ */
+static void lookupHost(lookup *lu)
+{
+    struct addrinfo hints, *res;
+    void *addr;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((lu->error = getaddrinfo(lu->host, 0, &hints, &res)) != 0)
+	return;
+
+    if (res->ai_family == AF_INET6)
+	addr = &((struct sockaddr_in6*) res->ai_addr)->sin6_addr;
+    else
+	addr = &((struct sockaddr_in*) res->ai_addr)->sin_addr;
+    if (inet_ntop(res->ai_family, addr, lu->addr, sizeof lu->addr) == 0)
+	lu->error = EAI_FAMILY;
+    freeaddrinfo(res);
+}
+
+
+static void enqueue(lookup ***tailp, lookup *lu)
+{
+    lu->next = 0;
+    **tailp = lu;
+    *tailp = &lu->next;
+}
+
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+
+/*
+ * pthread_atfork() handlers.  The lock is held across fork(), so that
+ * the child gets the queues in a consistent state.  The child has
+ * none of the worker threads, so lookups pending at the time of the
+ * fork fail with EAI_AGAIN rather than never completing, and new
+ * workers are started as they're needed.  It also gets a pipe of its
+ * own, so that its parent's workers can't wake it, under the same
+ * file descriptors so that the event loop's watcher stays valid.
+ */
+static void forkPrepare(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+static void forkParent(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+static void forkChild(void)
+{
+    lookup *lu;
+    int fds[2];
+    char c = 0;
+
+    while ((lu = busy) != 0 || (lu = todo) != 0) {
+	if (lu == busy)
+	    busy = lu->next;
+	else
+	    todo = lu->next;
+	lu->error = EAI_AGAIN;
+	enqueue(&doneTail, lu);
+    }
+    todoTail = &todo;
+    ntodo = nthreads = nidle = 0;
+    pthread_cond_init(&wakeup, 0);
+
+    if (pipe(fds) == 0) {
+	dup2(fds[0], notify[0]);
+	dup2(fds[1], notify[1]);
+	close(fds[0]);
+	close(fds[1]);
+	setNonBlocking(notify[0]);
+	setNonBlocking(notify[1]);
+	if (done != 0)
+	    (void) write(notify[1], &c, 1);
+    } else {
+	/* Better no resolver than one shared with the parent */
+	close(notify[0]);
+	close(notify[1]);
+	notify[0] = notify[1] = -1;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
@@ -10,49 +10,113 @@
  */
 
 #include <unistd.h>
+#include <sys/uio.h>
 #include <yaz/proto.h>
 #include <yaz/pquery.h>		/* prefix query compiler */
 #include <yaz/ccl.h>		/* CCL query compiler */
 #include <yaz/yaz-ccl.h>	/* CCL-to-RPN query converter */
+#include <yaz/sortspec.h>	/* sort-specification parser */
 #include <yaz/otherinfo.h>
 #include <yaz/charneg.h>
 #include "ywpriv.h"
 
+/* Most requests gathered into one writev() call; well below IOV_MAX */
+#define WRITEV_MAX 16
+
 
 Z_ReferenceId *make_ref_id(Z_ReferenceId *buf, databuf refId);
 static Odr_oid *record_syntax(ODR odr, int preferredRecordSyntax);
-static databuf encode_apdu(ODR odr, Z_APDU *apdu, char **errmsgp);
-static int prepare_odr(ODR *odrp, char **errmsgp);
-static databuf nodata(char *msg);
+static int encode_apdu(CONNCTX ctx, Z_APDU *apdu, char **errmsgp);
+static void recycle_odr(CONNCTX ctx, ODR odr);
+static int nodata(char *msg);
 
 
 /*
- * Errors are indicated by returning a databuf with a null data member,
- * with *errmsgp pointed at an error message whose memory is managed by
- * this module.
+ * A new context has an empty queue; its encoder is created now, and
+ * handed over to the queue along with each request encoded in it, so
+ * there's no state shared between connections.  Returns a null pointer
+ * if it can't allocate.
  */
-databuf makeInitRequest(databuf referenceId,
-			int preferredMessageSize,
-			int maximumRecordSize,
-			mnchar *user,
-			mnchar *password,
-			mnchar *groupid,
-			mnchar *implementationId,
-			mnchar *implementationName,
-			mnchar *implementationVersion,
-			mnchar *charset,
-			mnchar *language,
-			char **errmsgp)
+CONNCTX contextCreate(void)
+{
+    CONNCTX ctx;
+
+    New(0, ctx, 1, struct connCtx);
+    if ((ctx->odr = odr_createmem(ODR_ENCODE)) == 0) {
+	Safefree(ctx);
+	return 0;
+    }
+
+    ctx->queue = 0;
+    ctx->nqueue = ctx->maxqueue = 0;
+    ctx->head = ctx->released = ctx->pending = 0;
+    ctx->nspare = 0;
+    return ctx;
+}
+
+
+void contextDestroy(CONNCTX ctx)
+{
+    int i;
+
+    odr_destroy(ctx->odr);
+    for (i = 0; i < ctx->nqueue; i++)
+	odr_destroy(ctx->queue[i].odr);
+    for (i = 0; i < ctx->nspare; i++)
+	odr_destroy(ctx->spare[i]);
+    if (ctx->queue != 0)
+	Safefree(ctx->queue);
+    Safefree(ctx);
+}
+
+
+/* Returns the number of bytes released for writing but not yet written */
+int contextPending(CONNCTX ctx)
+{
+    return ctx->pending;
+}
+
+
+/*
+ * Allows the first queued request that is still being held back to be
+ * written.  Returns 1, or 0 if there was no such request.
+ */
+int contextRelease(CONNCTX ctx)
 {
-    static ODR odr = 0;
+    if (ctx->released == ctx->nqueue)
+	return 0;
+
+    ctx->pending += ctx->queue[ctx->released++].len;
+    return 1;
+}
+
+
+/*
+ * Errors are indicated by returning 0, with *errmsgp pointed at an
+ * error message whose memory is managed by this module.
+ */
+int makeInitRequest(CONNCTX ctx,
+		    databuf referenceId,
+		    int preferredMessageSize,
+		    int maximumRecordSize,
+		    mnchar *user,
+		    mnchar *password,
+		    mnchar *groupid,
+		    mnchar *implementationId,
+		    mnchar *implementationName,
+		    mnchar *implementationVersion,
+		    mnchar *charset,
+		    mnchar *language,
+		    char **errmsgp)
+{
+    ODR odr = ctx->odr;
     Z_APDU *apdu;
     Z_InitRequest *req;
     Z_ReferenceId zr;
     Z_IdAuthentication auth;
     Z_IdPass id;
 
-    if (!prepare_odr(&odr, errmsgp))
-	return nodata((char*) 0);
+    odr_reset(odr);
     apdu = zget_APDU(odr, Z_APDU_initRequest);
     req = apdu->u.initRequest;
 
@@ -68,9 +132,11 @@ databuf makeInitRequest(databuf referenceId,
     ODR_MASK_SET(req->options, Z_Options_namedResultSets);
     ODR_MASK_SET(req->options, Z_Options_triggerResourceCtrl); /* ### */
     ODR_MASK_SET(req->options, Z_Options_scan);
-    ODR_MASK_SET(req->options, Z_Options_sort);	/* ### */
+    ODR_MASK_SET(req->options, Z_Options_sort);
     ODR_MASK_SET(req->options, Z_Options_extendedServices); /* ### */
     ODR_MASK_SET(req->options, Z_Options_delSet); /* ### */
+    ODR_MASK_SET(req->options, Z_Options_level_1Segmentation);
+    ODR_MASK_SET(req->options, Z_Options_level_2Segmentation);
 
     ODR_MASK_SET(req->protocolVersion, Z_ProtocolVersion_1);
     ODR_MASK_SET(req->protocolVersion, Z_ProtocolVersion_2);
@@ -129,7 +195,7 @@ databuf makeInitRequest(databuf referenceId,
     if (implementationVersion != 0)
 	req->implementationVersion = implementationVersion;
 
-    return encode_apdu(odr, apdu, errmsgp);
+    return encode_apdu(ctx, apdu, errmsgp);
 }
 
 
@@ -139,35 +205,31 @@ databuf makeInitRequest(databuf referenceId,
  * record syntax, an unsupported query type, a bad search command or
  * failure to encode the APDU.  Oh well.
  */
-databuf makeSearchRequest(databuf referenceId,
-			  int smallSetUpperBound,
-			  int largeSetLowerBound,
-			  int mediumSetPresentNumber,
-			  char *resultSetName,
-			  char *databaseName,
-			  char *smallSetElementSetName,
-			  char *mediumSetElementSetName,
-			  int preferredRecordSyntax,
-			  int queryType,
-			  char *query,
-			  char **errmsgp)
+int makeSearchRequest(CONNCTX ctx,
+		      QUERYCACHE qc,
+		      databuf referenceId,
+		      int smallSetUpperBound,
+		      int largeSetLowerBound,
+		      int mediumSetPresentNumber,
+		      char *resultSetName,
+		      char *databaseName,
+		      char *smallSetElementSetName,
+		      char *mediumSetElementSetName,
+		      int preferredRecordSyntax,
+		      int queryType,
+		      char *query,
+		      char **errmsgp)
 {
-    static ODR odr = 0;
+    ODR odr = ctx->odr;
     Z_APDU *apdu;
     Z_SearchRequest *req;
     Z_ReferenceId zr;
     Z_ElementSetNames smallES, mediumES;
-    oident attrset;
-    int oidbuf[20];		/* more than enough */
     Z_Query zquery;
     Odr_oct ccl_query;
-    struct ccl_rpn_node *rpn;
-    int error, pos;
-    static CCL_bibset bibset;
     Z_External *ext;
 
-    if (!prepare_odr(&odr, errmsgp))
-	return nodata((char*) 0);
+    odr_reset(odr);
     apdu = zget_APDU(odr, Z_APDU_searchRequest);
     req = apdu->u.searchRequest;
 
@@ -200,10 +262,12 @@ databuf makeSearchRequest(databuf referenceId,
 
     switch (queryType) {
     case QUERYTYPE_PREFIX:
+    case QUERYTYPE_CCL2RPN:
 	/* ### Is type-1 always right?  What about type-101 when under v2? */
         zquery.which = Z_Query_type_1;
-        if ((zquery.u.type_1 = p_query_rpn (odr, PROTO_Z3950, query)) == 0)
-	    return nodata(*errmsgp = "can't compile PQN query");
+	zquery.u.type_1 = queryCompile(qc, odr, queryType, query, errmsgp);
+	if (zquery.u.type_1 == 0)
+	    return nodata(*errmsgp);
         break;
 
     case QUERYTYPE_CCL:
@@ -213,29 +277,6 @@ databuf makeSearchRequest(databuf referenceId,
         ccl_query.len = strlen(query);
         break;
 
-    case QUERYTYPE_CCL2RPN:
-        zquery.which = Z_Query_type_1;
-	if (bibset == 0) {
-	    FILE *fp;
-	    bibset = ccl_qual_mk();
-	    if ((fp = fopen("ccl.qual", "r")) != 0) {
-		ccl_qual_file(bibset, fp);
-		fclose(fp);
-	    } else if (errno != ENOENT) {
-		return nodata(*errmsgp = "can't read CCL qualifier file");
-	    }
-	}
-        if ((rpn = ccl_find_str(bibset, query, &error, &pos)) == 0)
-	    return nodata(*errmsgp = (char*) ccl_err_msg(error));
-        if ((zquery.u.type_1 = ccl_rpn_query(odr, rpn)) == 0)
-	    return nodata(*errmsgp = "can't encode Type-1 query");
-        attrset.proto = PROTO_Z3950;
-        attrset.oclass = CLASS_ATTSET;
-        attrset.value = VAL_BIB1; /* ### should be configurable! */
-        zquery.u.type_1->attributeSetId = oid_ent_to_oid(&attrset, oidbuf);
-        ccl_rpn_delete (rpn);
-        break;
-
     case QUERYTYPE_CQL:
         zquery.which = Z_Query_type_104;
         ext = (Z_External*) odr_malloc(odr, sizeof(*ext));
@@ -251,7 +292,7 @@ databuf makeSearchRequest(databuf referenceId,
 	return nodata(*errmsgp = "unknown queryType");
     }
 
-    return encode_apdu(odr, apdu, errmsgp);
+    return encode_apdu(ctx, apdu, errmsgp);
 }
 
 
@@ -259,24 +300,24 @@ databuf makeSearchRequest(databuf referenceId,
  * in the source package of the YAZ C toolkit available
  * at http://www.indexdata.dk/yaz/
  */
-databuf makeScanRequest(databuf referenceId,
-                        char *databaseName,
-                        int stepSize,
-                        int numberOfTermsRequested,
-                        int preferredPositionInResponse,
-                        int queryType,
-                        char *query,
-			char **errmsgp)                    
+int makeScanRequest(CONNCTX ctx,
+		    QUERYCACHE qc,
+		    databuf referenceId,
+		    char *databaseName,
+		    int stepSize,
+		    int numberOfTermsRequested,
+		    int preferredPositionInResponse,
+		    int queryType,
+		    char *query,
+		    char **errmsgp)
 {
-    static ODR odr = 0;
+    ODR odr = ctx->odr;
     Z_APDU *apdu;
     Z_ScanRequest *req;
     Z_ReferenceId zr;
-    static CCL_bibset bibset;
     int oid[OID_SIZE];
 
-    if (!prepare_odr(&odr, errmsgp))
-        return nodata((char*) 0);
+    odr_reset(odr);
 
     apdu = zget_APDU(odr, Z_APDU_scanRequest);
     req = apdu->u.scanRequest;
@@ -293,20 +334,12 @@ databuf makeScanRequest(databuf referenceId,
         oident bib1;
         int error, pos;
         struct ccl_rpn_node *rpn;
+        CCL_bibset bibset;
 
+        if ((bibset = queryQualifiers(qc, errmsgp)) == 0)
+            return nodata(*errmsgp);
         rpn = ccl_find_str (bibset,  query, &error, &pos);
-        if (bibset == 0) {
-            FILE *fp;
-            bibset = ccl_qual_mk();
-            if ((fp = fopen("ccl.qual", "r")) != 0) {
-                ccl_qual_file(bibset, fp);
-                fclose(fp);
-            } else if (errno != ENOENT) {
-                return nodata (*errmsgp = "can't read CCL qualifier file");
-            }
-        }
-        rpn = ccl_find_str (bibset,  query, &error, &pos);
-        if (error) {
+        if (rpn == 0) {
             return nodata (*errmsgp = (char *) ccl_err_msg(error));
         }
         bib1.proto = PROTO_Z3950;
@@ -333,27 +366,32 @@ databuf makeScanRequest(databuf referenceId,
         yaz_pqf_destroy (pqf_parser);
     }
 
-    return encode_apdu(odr, apdu, errmsgp);
+    return encode_apdu(ctx, apdu, errmsgp);
 }
 
 
-databuf makePresentRequest(databuf referenceId,
-			   char *resultSetId,
-			   int resultSetStartPoint,
-			   int numberOfRecordsRequested,
-			   char *elementSetName,
-			   int preferredRecordSyntax,
-			   char **errmsgp)
+int makePresentRequest(CONNCTX ctx,
+		       databuf referenceId,
+		       char *resultSetId,
+		       int resultSetStartPoint,
+		       int numberOfRecordsRequested,
+		       intlist additionalRanges,
+		       char *elementSetName,
+		       int preferredRecordSyntax,
+		       int maxSegmentCount,
+		       int maxRecordSize,
+		       int maxSegmentSize,
+		       char **errmsgp)
 {
-    static ODR odr = 0;
+    ODR odr = ctx->odr;
     Z_APDU *apdu;
     Z_PresentRequest *req;
     Z_ReferenceId zr;
     Z_RecordComposition rcomp;
     Z_ElementSetNames esname;
+    int i;
 
-    if (!prepare_odr(&odr, errmsgp))
-	return nodata((char*) 0);
+    odr_reset(odr);
     apdu = zget_APDU(odr, Z_APDU_presentRequest);
     req = apdu->u.presentRequest;
 
@@ -362,7 +400,25 @@ databuf makePresentRequest(databuf referenceId,
 	req->resultSetId = resultSetId;
     *req->resultSetStartPoint = resultSetStartPoint;
     *req->numberOfRecordsRequested = numberOfRecordsRequested;
-    req->num_ranges = 0;	/* ### would be nice to support this */
+
+    /*
+     * The first range is given by resultSetStartPoint and
+     * numberOfRecordsRequested; the server returns the records of all
+     * the ranges, in order, as a single list.
+     */
+    req->num_ranges = additionalRanges.n / 2;
+    if (req->num_ranges > 0) {
+	req->additionalRanges = (Z_Range**)
+	    odr_malloc(odr, req->num_ranges * sizeof(Z_Range*));
+	for (i = 0; i < req->num_ranges; i++) {
+	    Z_Range *range = (Z_Range*) odr_malloc(odr, sizeof(*range));
+	    range->startingPosition =
+		odr_intdup(odr, additionalRanges.vals[2*i]);
+	    range->numberOfRecords =
+		odr_intdup(odr, additionalRanges.vals[2*i+1]);
+	    req->additionalRanges[i] = range;
+	}
+    }
     req->recordComposition = &rcomp;
     rcomp.which = Z_RecordComp_simple;	/* ### espec suppport would be nice */
     rcomp.u.simple = &esname;
@@ -372,23 +428,34 @@ databuf makePresentRequest(databuf referenceId,
 	 record_syntax(odr, preferredRecordSyntax)) == 0)
 	return nodata(*errmsgp = "can't convert record syntax");
 
-    return encode_apdu(odr, apdu, errmsgp);
+    /*
+     * Any of these allows the server to send the response in Segment
+     * APDUs, splitting records between them if need be.
+     */
+    if (maxSegmentCount > 0)
+	req->maxSegmentCount = odr_intdup(odr, maxSegmentCount);
+    if (maxRecordSize > 0)
+	req->maxRecordSize = odr_intdup(odr, maxRecordSize);
+    if (maxSegmentSize > 0)
+	req->maxSegmentSize = odr_intdup(odr, maxSegmentSize);
+
+    return encode_apdu(ctx, apdu, errmsgp);
 }
 
 
-databuf makeDeleteRSRequest(databuf referenceId,
-			    char *resultSetId,
-			    char **errmsgp)
+int makeDeleteRSRequest(CONNCTX ctx,
+			databuf referenceId,
+			char *resultSetId,
+			char **errmsgp)
 {
-    static ODR odr = 0;
+    ODR odr = ctx->odr;
     Z_APDU *apdu;
     Z_DeleteResultSetRequest *req;
     Z_ReferenceId zr;
     Z_ResultSetId *rsList[1];
     int x;
 
-    if (!prepare_odr(&odr, errmsgp))
-	return nodata((char*) 0);
+    odr_reset(odr);
     apdu = zget_APDU(odr, Z_APDU_deleteResultSetRequest);
     req = apdu->u.deleteResultSetRequest;
 
@@ -399,7 +466,69 @@ databuf makeDeleteRSRequest(databuf referenceId,
     req->resultSetList = &rsList[0];
     rsList[0] = resultSetId;
 
-    return encode_apdu(odr, apdu, errmsgp);
+    return encode_apdu(ctx, apdu, errmsgp);
+}
+
+
+/*
+ * Asks the server to sort the result set `inputResultSetName' into a
+ * new one called `sortedResultSetName', which may be the same.  The
+ * sort keys are given by `sortSpec', in the notation understood by
+ * YAZ's yaz_sort_spec(): a sequence of space-separated pairs, each a
+ * field (or "1=4"-style use attributes) and flags such as "<" for
+ * ascending, ">" for descending, and "i" for case-insensitive.
+ */
+int makeSortRequest(CONNCTX ctx,
+		    databuf referenceId,
+		    char *inputResultSetName,
+		    char *sortedResultSetName,
+		    char *sortSpec,
+		    char **errmsgp)
+{
+    ODR odr = ctx->odr;
+    Z_APDU *apdu;
+    Z_SortRequest *req;
+    Z_ReferenceId zr;
+    char *rsList[1];
+
+    odr_reset(odr);
+    apdu = zget_APDU(odr, Z_APDU_sortRequest);
+    req = apdu->u.sortRequest;
+
+    req->referenceId = make_ref_id(&zr, referenceId);
+    req->num_inputResultSetNames = 1;
+    req->inputResultSetNames = &rsList[0];
+    rsList[0] = inputResultSetName;
+    req->sortedResultSetName = sortedResultSetName;
+    if ((req->sortSequence = yaz_sort_spec(odr, sortSpec)) == 0)
+	return nodata(*errmsgp = "can't parse sort specification");
+
+    return encode_apdu(ctx, apdu, errmsgp);
+}
+
+
+/*
+ * Used to abandon a session, typically when the server has taken too
+ * long to answer: we don't wait for the server's Close in reply.
+ */
+int makeCloseRequest(CONNCTX ctx,
+		     databuf referenceId,
+		     int closeReason,
+		     char **errmsgp)
+{
+    ODR odr = ctx->odr;
+    Z_APDU *apdu;
+    Z_Close *req;
+    Z_ReferenceId zr;
+
+    odr_reset(odr);
+    apdu = zget_APDU(odr, Z_APDU_close);
+    req = apdu->u.close;
+
+    req->referenceId = make_ref_id(&zr, referenceId);
+    *req->closeReason = closeReason;
+
+    return encode_apdu(ctx, apdu, errmsgp);
 }
 
 
@@ -436,76 +565,121 @@ static Odr_oid *record_syntax(ODR odr, int preferredRecordSyntax)
 
 
 /*
- * Memory management strategy: every APDU we're asked to allocate
- * obliterates the previous one by overwriting our static ODR buffer,
- * so the caller _must_ ensure that it copies or otherwise consumes
- * the return value before the next call is made.  (This strategy
- * would normally stink, but it's actually not error-prone in this
- * context, since we know that the Perl XS code is about to copy the
- * data onto its stack.)
+ * Memory management strategy: each APDU is built and encoded in the
+ * context's current ODR stream, which is then moved onto the end of
+ * the outgoing queue with the encoded bytes still in it, and replaced
+ * by a spare stream (or a new one if there are none).  So the bytes
+ * are never copied, and they're freed -- or rather, their stream is
+ * reset for re-use -- once yaz_write() has sent all of them.
  */
-static databuf encode_apdu(ODR odr, Z_APDU *apdu, char **errmsgp)
+static int encode_apdu(CONNCTX ctx, Z_APDU *apdu, char **errmsgp)
 {
-    databuf res;
-    int len;
-    res.len = 0;		/* Not needed, but prevents compiler warning */
-    res.data = 0;
-
-    if (!z_APDU(odr, &apdu, 0, (char*) 0)) {
-	*errmsgp = odr_errmsg(odr_geterror(odr));
-	return res;
+    queuedAPDU *qa;
+    ODR next;
+
+    if (!z_APDU(ctx->odr, &apdu, 0, (char*) 0)) {
+	*errmsgp = odr_errmsg(odr_geterror(ctx->odr));
+	return 0;
+    }
+
+    if (ctx->nspare > 0) {
+	next = ctx->spare[--ctx->nspare];
+    } else if ((next = odr_createmem(ODR_ENCODE)) == 0) {
+	*errmsgp = "can't create ODR stream";
+	return 0;
     }
 
-    res.data = odr_getbuf(odr, &len, (int*) 0);
-    res.len = len;
-    return res;
+    if (ctx->nqueue == ctx->maxqueue) {
+	ctx->maxqueue = ctx->maxqueue ? ctx->maxqueue * 2 : 8;
+	Renew(ctx->queue, ctx->maxqueue, queuedAPDU);
+    }
+
+    qa = &ctx->queue[ctx->nqueue++];
+    qa->odr = ctx->odr;
+    qa->data = odr_getbuf(ctx->odr, &qa->len, (int*) 0);
+    ctx->odr = next;
+    return 1;
 }
 
 
-static int prepare_odr(ODR *odrp, char **errmsgp)
+/*
+ * Keeps the stream of a request that has been completely written for
+ * re-use, unless we already have enough spares.
+ */
+static void recycle_odr(CONNCTX ctx, ODR odr)
 {
-    if (*odrp != 0) {
-	odr_reset(*odrp);
-    } else if ((*odrp = odr_createmem(ODR_ENCODE)) == 0) {
-	*errmsgp = "can't create ODR stream";
-	return 0;
+    if (ctx->nspare == CTX_SPARE_ODRS) {
+	odr_destroy(odr);
+	return;
     }
 
-    return 1;
+    odr_reset(odr);
+    ctx->spare[ctx->nspare++] = odr;
 }
 
 
 /*
- * Return a databuf with a null pointer (used as an error indicator)
+ * Return 0, indicating that no data was queued due to an error.
  * (In passing, we also report to stderr what the problem was.)
  */
-static databuf nodata(char *msg)
+static int nodata(char *msg)
 {
-    databuf buf;
-
 #ifndef NDEBUG
     if (msg != 0) {
 	fprintf(stderr, "DEBUG nodata(): %s\n", msg);
     }
 #endif
-    buf.len = 0;		/* Not needed, but prevents compiler warning */
-    buf.data = 0;
-    return buf;
+    return 0;
 }
 
 
 /*
  * Simple wrapper for cs_write() when that comes along.  Also calls
  * cs_look() to detect the completion of a connection when that comes
- * along.
+ * along.  Writes as much as possible of the released requests in the
+ * queue of `ctx', gathering them into a single writev() call, and
+ * returns the number of bytes written, which are removed from the
+ * queue; or -1 on error.
  */
-int yaz_write(COMSTACK cs, databuf buf)
+int yaz_write(COMSTACK cs, CONNCTX ctx)
 {
+    struct iovec iov[WRITEV_MAX];
+    int i, n, niov, left, done;
+
     if (cs_look(cs) == CS_CONNECT) {
 	if (cs_rcvconnect(cs) < 0) {
 	    return -1;
 	}
     }
 
-    return write(cs_fileno(cs), buf.data, buf.len);
+    niov = ctx->released < WRITEV_MAX ? ctx->released : WRITEV_MAX;
+    if (niov == 0)
+	return 0;
+
+    for (i = 0; i < niov; i++) {
+	iov[i].iov_base = ctx->queue[i].data;
+	iov[i].iov_len = ctx->queue[i].len;
+    }
+    iov[0].iov_base = ctx->queue[0].data + ctx->head;
+    iov[0].iov_len -= ctx->head;
+
+    n = writev(cs_fileno(cs), iov, niov);
+    if (n <= 0)
+	return n;
+
+    /* Recycle the requests that have been completely sent */
+    ctx->pending -= n;
+    left = n + ctx->head;
+    for (done = 0; done < niov && left >= ctx->queue[done].len; done++) {
+	left -= ctx->queue[done].len;
+	recycle_odr(ctx, ctx->queue[done].odr);
+    }
+    ctx->head = left;
+    if (done > 0) {
+	Move(ctx->queue + done, ctx->queue, ctx->nqueue - done, queuedAPDU);
+	ctx->nqueue -= done;
+	ctx->released -= done;
+    }
+
+    return n;
 }
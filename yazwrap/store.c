@@ -0,0 +1,273 @@
+/* $Header$ */
+
+/*
+ * yazwrap/store.c -- read-only access to record stores.
+ *
+ * A record store is a pair of files written by the Perl class
+ * Net::Z3950::RecordStore as a result set's records arrive: the data
+ * file, to which the raw data of each record is appended, followed by
+ * a NUL; and the index file, whose name is that of the data file with
+ * ".idx" added, which holds a header and then one fixed-size entry
+ * for each position in the result set.  All numbers are unsigned,
+ * 32-bit and little-endian:
+ *
+ *	header:	"NZ3950RS", version, size of result set
+ *	entry:	offset (low word, high word), length, class
+ *
+ * An entry whose class is zero is for a record that was never stored;
+ * otherwise the class is the index of the record's Perl class in
+ * RecordStore.pm's table.  We map both files into memory, so that a
+ * record can be returned as a read-only string that points directly
+ * into the map of the data file, with nothing copied or decoded.
+ * The trailing NUL makes each such string well-formed.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ywpriv.h"
+
+#define STORE_MAGIC "NZ3950RS"
+#define STORE_VERSION 1
+#define STORE_ENTRY 16		/* size of the header and of each entry */
+
+struct recordStore {
+    unsigned char *data;	/* map of the data file, or 0 if empty */
+    size_t datalen;
+    unsigned char *idx;		/* map of the index file */
+    size_t idxlen;
+    int size;			/* size of the result set */
+    int nentries;		/* number of entries after the header */
+    int refcount;		/* the handle, plus each string in `data' */
+};
+
+static int mapFile(const char *path, unsigned char **mapp, size_t *lenp);
+static unsigned char *entry(RECSTORE st, int n);
+static size_t entryOffset(const unsigned char *e);
+static unsigned long get32(const unsigned char *p);
+static void releaseStore(RECSTORE st);
+
+/*
+ * Magic attached to each record string, so that the store it points
+ * into stays mapped until the last such string is freed.
+ */
+static int storeFree(pTHX_ SV *sv, MAGIC *mg)
+{
+    releaseStore((RECSTORE) mg->mg_ptr);
+    return 0;
+}
+static MGVTBL storeVtbl = { 0, 0, 0, 0, storeFree };
+
+
+/*
+ * Maps the record store whose data file is `path'.  Returns a handle
+ * to it, or a null pointer with `errno' set if either file can't be
+ * mapped or the index file is not a record-store index (EINVAL).
+ */
+RECSTORE storeOpen(char *path)
+{
+    RECSTORE st;
+    char *idxpath;
+    int ok, err;
+
+    New(0, st, 1, struct recordStore);
+    st->data = st->idx = 0;
+    st->datalen = st->idxlen = 0;
+
+    if (!mapFile(path, &st->data, &st->datalen))
+	goto fail;
+
+    New(0, idxpath, strlen(path) + 5, char);
+    strcpy(idxpath, path);
+    strcat(idxpath, ".idx");
+    ok = mapFile(idxpath, &st->idx, &st->idxlen);
+    Safefree(idxpath);
+    if (!ok)
+	goto fail;
+
+    if (st->idxlen < STORE_ENTRY ||
+	memcmp(st->idx, STORE_MAGIC, 8) != 0 ||
+	get32(st->idx + 8) != STORE_VERSION) {
+	errno = EINVAL;
+	goto fail;
+    }
+
+    st->size = (int) get32(st->idx + 12);
+    st->nentries = st->idxlen / STORE_ENTRY - 1;
+    st->refcount = 1;
+    return st;
+
+ fail:
+    err = errno;
+    if (st->data != 0)
+	munmap(st->data, st->datalen);
+    if (st->idx != 0)
+	munmap(st->idx, st->idxlen);
+    Safefree(st);
+    errno = err;
+    return 0;
+}
+
+
+/*
+ * Called from the handle's DESTROY method.  Record strings already
+ * returned remain valid: the files are unmapped when the last of
+ * them goes.
+ */
+void storeClose(RECSTORE st)
+{
+    releaseStore(st);
+}
+
+
+int storeSize(RECSTORE st)
+{
+    return st->size;
+}
+
+
+/*
+ * Returns the class number of record `n' (1-based), or 0 if that
+ * record is not in the store.
+ */
+int storeClass(RECSTORE st, int n)
+{
+    unsigned char *e = entry(st, n);
+
+    return e == 0 ? 0 : (int) get32(e + 12);
+}
+
+
+/*
+ * Returns an object of class `class' which is a reference to a
+ * read-only string holding the raw data of record `n', pointing into
+ * the store's map; or a null pointer (which comes out as undef) if
+ * that record is not in the store.  We have to do the blessing,
+ * because the string can't be blessed once it's read-only.
+ */
+SV *storeFetch(RECSTORE st, int n, char *class)
+{
+    unsigned char *e = entry(st, n);
+    SV *referent, *sv;
+    HV *stash;
+
+    if (e == 0)
+	return 0;
+    if ((stash = gv_stashpv(class, 0)) == 0)
+	fatal("attempt to create object of undefined class '%s'", class);
+
+    referent = newSV(0);
+    (void) SvUPGRADE(referent, SVt_PVMG);
+    SvPV_set(referent, (char*) st->data + entryOffset(e));
+    SvCUR_set(referent, get32(e + 8));
+    SvLEN_set(referent, 0);	/* => Perl doesn't own the buffer */
+    SvPOK_only(referent);
+    sv_magicext(referent, 0, PERL_MAGIC_ext, &storeVtbl, (char*) st, 0);
+    st->refcount++;
+
+    sv = newRV_noinc(referent);
+    sv_bless(sv, stash);
+    SvREADONLY_on(referent);
+    return sv;
+}
+
+
+/*
+ * Maps the whole of the file `path' read-only.  An empty file can't
+ * be mapped, and doesn't need to be: `*mapp' is left null.
+ */
+static int mapFile(const char *path, unsigned char **mapp, size_t *lenp)
+{
+    struct stat sb;
+    void *map;
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return 0;
+    if (fstat(fd, &sb) < 0)
+	goto fail;
+
+    *lenp = (size_t) sb.st_size;
+    if (*lenp == 0) {
+	close(fd);
+	return 1;
+    }
+
+    map = mmap(0, *lenp, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+	goto fail;
+
+    /* The mapping doesn't need the descriptor */
+    close(fd);
+    *mapp = (unsigned char*) map;
+    return 1;
+
+ fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return 0;
+}
+
+
+/*
+ * Returns a pointer to the index entry of record `n', or a null
+ * pointer if there is no such record in the store.  Entries that
+ * don't fit in the data file, or whose records aren't followed by
+ * a NUL, are treated as missing: they can only come from a writer
+ * that was interrupted.
+ */
+static unsigned char *entry(RECSTORE st, int n)
+{
+    unsigned char *e;
+    size_t offset, len;
+
+    if (n < 1 || n > st->nentries)
+	return 0;
+
+    e = st->idx + (size_t) n * STORE_ENTRY;
+    if (get32(e + 12) == 0)
+	return 0;
+
+    offset = entryOffset(e);
+    len = get32(e + 8);
+    if (offset >= st->datalen || len >= st->datalen - offset ||
+	st->data[offset + len] != '\0')
+	return 0;
+
+    return e;
+}
+
+
+/*
+ * The high word can be non-zero only where size_t has room for it;
+ * the double shift keeps the compiler quiet where it hasn't.
+ */
+static size_t entryOffset(const unsigned char *e)
+{
+    return (size_t) get32(e) | ((size_t) get32(e + 4) << 16 << 16);
+}
+
+
+static unsigned long get32(const unsigned char *p)
+{
+    return (unsigned long) p[0] |
+	((unsigned long) p[1] << 8) |
+	((unsigned long) p[2] << 16) |
+	((unsigned long) p[3] << 24);
+}
+
+
+static void releaseStore(RECSTORE st)
+{
+    if (--st->refcount == 0) {
+	if (st->data != 0)
+	    munmap(st->data, st->datalen);
+	munmap(st->idx, st->idxlen);
+	Safefree(st);
+    }
+}
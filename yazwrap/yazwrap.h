@@ -18,65 +18,103 @@ typedef struct databuf {
 /* Maybe-null char* (don't ask -- see ../typemap if you really care */
 typedef char mnchar;
 
+/* Counted list of integers, e.g. the (start, count) pairs of ranges */
+typedef struct intlist {
+    int *vals;
+    int n;
+} intlist;
+
 /* Home-brew simplified front end functions */
 COMSTACK yaz_connect(char *addr);
 int yaz_close(COMSTACK cs);
 int yaz_socket(COMSTACK cs);
 
+/*
+ * Opaque per-connection context: the encoder used to build requests,
+ * and the queue of encoded requests not yet written to the server.
+ * Requests are held in the queue until released for writing, one at
+ * a time and in order, by contextRelease().
+ */
+typedef struct connCtx *CONNCTX;
+CONNCTX contextCreate(void);
+void contextDestroy(CONNCTX ctx);
+int contextPending(CONNCTX ctx);
+int contextRelease(CONNCTX ctx);
+
+/*
+ * Opaque cache of compiled queries, which also holds the CCL
+ * qualifiers that CCL2RPN queries and scans are compiled with.  The
+ * qualifiers are loaded from `qualPath' when first needed, and
+ * reloaded whenever that file changes; queryCacheLoad() loads them
+ * from a new file at once.  Up to `max' compiled queries are kept.
+ */
+typedef struct queryCache *QUERYCACHE;
+QUERYCACHE queryCacheCreate(char *qualPath, int max);
+void queryCacheDestroy(QUERYCACHE qc);
+int queryCacheLoad(QUERYCACHE qc, char *qualPath, char **errmsgp);
+
 /*
  * Functions representing Z39.50 requests.  Where parameters specified
  * by the standard are not currently supported by this interface,
- * their names are commented.
+ * their names are commented.  Each encodes its request and appends it
+ * to the queue of `ctx', returning 1; or returns 0 on error, with
+ * `*errmsgp' pointed at a message whose memory is managed by the
+ * library.
  */
-databuf makeInitRequest(databuf referenceId,
-			/* protocolVersion */
-			/* options */
-			int preferredMessageSize,
-			int maximumRecordSize,
-			mnchar *user,
-			mnchar *password,
-			mnchar *groupid,
-			mnchar *implementationId,
-			mnchar *implementationName,
-			mnchar *implementationVersion,
-			mnchar *charset,
-			mnchar *language,
-			/* userInformationField */
-			/* otherInfo */
-			char **errmsgp
-			);
+int makeInitRequest(CONNCTX ctx,
+		    databuf referenceId,
+		    /* protocolVersion */
+		    /* options */
+		    int preferredMessageSize,
+		    int maximumRecordSize,
+		    mnchar *user,
+		    mnchar *password,
+		    mnchar *groupid,
+		    mnchar *implementationId,
+		    mnchar *implementationName,
+		    mnchar *implementationVersion,
+		    mnchar *charset,
+		    mnchar *language,
+		    /* userInformationField */
+		    /* otherInfo */
+		    char **errmsgp
+		    );
 
-databuf makeSearchRequest(databuf referenceId,
-			  int smallSetUpperBound,
-			  int largeSetLowerBound,
-			  int mediumSetPresentNumber,
-			  /* replaceIndicator */
-			  char *resultSetName,
-			  /* num_databaseNames */
-			  char *databaseName,
-			  char *smallSetElementSetName,
-			  char *mediumSetElementSetName,
-			  int preferredRecordSyntax,
-			  int queryType,
-			  char *query,
-			  char **errmsgp
-			  /* additionalSearchInfo */
-			  /* otherInfo */
-			  );
-
-databuf makeScanRequest(databuf referenceId,
-                        /* num_databaseNames */
-                        char *databaseName,
-                        /* attributeSet */
-                        /* termListAndStartPoint -> queryType/query */
-                        int stepSize,
-                        int numberOfTermsRequested,
-                        int preferredPositionInResponse,
-                        int queryType,
-                        char *query,
-                        char **errmsgp
-                        /* otherInfo */
-                        );
+int makeSearchRequest(CONNCTX ctx,
+		      QUERYCACHE qc,
+		      databuf referenceId,
+		      int smallSetUpperBound,
+		      int largeSetLowerBound,
+		      int mediumSetPresentNumber,
+		      /* replaceIndicator */
+		      char *resultSetName,
+		      /* num_databaseNames */
+		      char *databaseName,
+		      char *smallSetElementSetName,
+		      char *mediumSetElementSetName,
+		      int preferredRecordSyntax,
+		      int queryType,
+		      char *query,
+		      char **errmsgp
+		      /* additionalSearchInfo */
+		      /* otherInfo */
+		      );
+
+int makeScanRequest(CONNCTX ctx,
+		    QUERYCACHE qc,
+		    databuf referenceId,
+		    /* num_databaseNames */
+		    char *databaseName,
+		    /* attributeSet */
+		    /* termListAndStartPoint -> queryType/query */
+		    int stepSize,
+		    int numberOfTermsRequested,
+		    int preferredPositionInResponse,
+		    int queryType,
+		    char *query,
+		    char **errmsgp
+		    /* otherInfo */
+		    );
 
 /* Constants for use as `querytype' argument to makeSearchRequest() */
 #define QUERYTYPE_PREFIX  39501	/* Yaz's "@attr"-ish forward-Polish notation */
@@ -84,27 +122,47 @@ databuf makeScanRequest(databuf referenceId,
 #define QUERYTYPE_CCL2RPN 39503 /* Convert CCL to RPN (type-1) locally */
 #define QUERYTYPE_CQL     39504 /* Send CQL string to server ``as is'' */
 
-databuf makePresentRequest(databuf referenceId,
-			   char *resultSetId,
-			   int resultSetStartPoint,
-			   int numberOfRecordsRequested,
-			   /* num_ranges */
-			   /* additionalRanges */
-			   char *elementSetName,
-			   int preferredRecordSyntax,
-			   /* maxSegmentCount */
-			   /* maxRecordSize */
-			   /* maxSegmentSize */
-			   /* otherInfo */
-			   char **errmsgp
-			   );
-
-databuf makeDeleteRSRequest(databuf referenceId,
-			    /* delete_function */
-			    char *resultSetId,
-			    /* otherInfo */
-			    char **errmsgp
-			    );
+int makePresentRequest(CONNCTX ctx,
+		       databuf referenceId,
+		       char *resultSetId,
+		       int resultSetStartPoint,
+		       int numberOfRecordsRequested,
+		       intlist additionalRanges, /* (start, count) pairs */
+		       char *elementSetName,
+		       int preferredRecordSyntax,
+		       int maxSegmentCount, /* 0 to omit */
+		       int maxRecordSize, /* 0 to omit */
+		       int maxSegmentSize, /* 0 to omit */
+		       /* otherInfo */
+		       char **errmsgp
+		       );
+
+int makeDeleteRSRequest(CONNCTX ctx,
+			databuf referenceId,
+			/* delete_function */
+			char *resultSetId,
+			/* otherInfo */
+			char **errmsgp
+			);
+
+int makeSortRequest(CONNCTX ctx,
+		    databuf referenceId,
+		    char *inputResultSetName, /* just the one */
+		    char *sortedResultSetName,
+		    char *sortSpec, /* YAZ sort specification */
+		    /* otherInfo */
+		    char **errmsgp
+		    );
+
+int makeCloseRequest(CONNCTX ctx,
+		     databuf referenceId,
+		     int closeReason,
+		     /* diagnosticInformation */
+		     /* resourceReportFormat */
+		     /* resourceReport */
+		     /* otherInfo */
+		     char **errmsgp
+		     );
 
 SV *decodeAPDU(COMSTACK cs, int *reasonp);
 /*
@@ -118,4 +176,56 @@ SV *decodeAPDU(COMSTACK cs, int *reasonp);
 #define REASON_BADAPDU 23954	/* APDU was well-formed but unrecognised */
 #define REASON_ERROR 23955	/* some other error (consult errno) */
 
-int yaz_write(COMSTACK cs, databuf buf);
+/*
+ * Like decodeAPDU(), but returns a reference to an array of all the
+ * APDUs already buffered in `cs'.  If the array is returned with
+ * `*reasonp' non-zero, then an error occurred after the last of them.
+ * `flags' is a bitmask of the following values.
+ */
+SV *decodeAPDUs(COMSTACK cs, int flags, int *reasonp);
+#define DECODE_LAZY 1		/* GRS-1 and OPAC records as lazy handles */
+#define DECODE_SHARED 2		/* Opaque records share the decode buffer */
+#define DECODE_STREAM 4		/* Present records passed to the callback */
+void decodeStream(COMSTACK cs, SV *cb);
+
+/* Opaque handle for a lazily-translated record */
+typedef struct lazyRecord lazyRecord;
+SV *lazyMaterialise(lazyRecord *lr);
+int lazyCount(lazyRecord *lr);
+void lazyFree(lazyRecord *lr);
+
+/* ISO 2709 record parsing, in "marc.c" */
+int marcNFields(databuf rec);
+SV *marcField(databuf rec, char *tag);
+SV *marcSubfield(databuf rec, char *tag, char *code);
+SV *marcRender(databuf rec, int mab);
+
+/* Asynchronous hostname lookups, in "resolve.c" */
+int resolverFd(void);
+int resolveStart(char *host);
+SV *resolveNext(void);
+
+/* Memory-mapped record stores, in "store.c" */
+typedef struct recordStore *RECSTORE;
+RECSTORE storeOpen(char *path);
+void storeClose(RECSTORE st);
+int storeSize(RECSTORE st);
+int storeClass(RECSTORE st, int n);
+SV *storeFetch(RECSTORE st, int n, char *class);
+
+/* Native event loop, in "evloop.c" */
+typedef struct evLoop *EVLOOP;
+EVLOOP evloopCreate(void);
+void evloopDestroy(EVLOOP loop);
+int evloopAddConn(EVLOOP loop, COMSTACK cs, CONNCTX ctx, int flags);
+int evloopAddFd(EVLOOP loop, int fd);
+int evloopRemove(EVLOOP loop, int id);
+int evloopPoll(EVLOOP loop, int id, int events);
+#define EVLOOP_READ 1		/* bits for evloopPoll()'s `events' */
+#define EVLOOP_WRITE 2
+SV *evloopRun(EVLOOP loop, int timeout);
+#define EVLOOP_DECODED 1	/* types of result from evloopRun() */
+#define EVLOOP_WRITTEN 2
+#define EVLOOP_READABLE 3
+
+int yaz_write(COMSTACK cs, CONNCTX ctx);
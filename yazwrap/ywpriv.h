@@ -28,5 +28,42 @@
  */
 
 #include "yazwrap.h"
+#include <yaz/odr.h>
+#include <yaz/proto.h>
+#include <yaz/ccl.h>
+
+#define CTX_SPARE_ODRS 8
+
+/*
+ * The outgoing queue is a list of encoded requests, each still in the
+ * ODR stream it was encoded into, so that nothing is copied between
+ * encoding and writing.  The first `head' bytes of the first request
+ * have already been written.  Only the first `released' requests may
+ * be written: the rest are held back until the caller releases them
+ * (see contextRelease()).  When a request has been completely written
+ * its stream is reset and kept in `spare' for re-use.
+ */
+typedef struct queuedAPDU {
+    ODR odr;			/* stream holding the encoded request */
+    char *data;			/* encoded request, owned by `odr' */
+    int len;			/* length of `data' */
+} queuedAPDU;
+
+struct connCtx {
+    ODR odr;			/* encoder for the next request */
+    queuedAPDU *queue;		/* outgoing queue */
+    int nqueue;			/* number of queued requests */
+    int maxqueue;		/* allocated size of `queue' */
+    int head;			/* bytes of first request already written */
+    int released;		/* number of requests that may be written */
+    int pending;		/* bytes released but not yet written */
+    ODR spare[CTX_SPARE_ODRS];	/* reset streams ready for re-use */
+    int nspare;			/* number of them */
+};
+
+/* Used by "send.c" to compile queries: see "query.c" */
+Z_RPNQuery *queryCompile(QUERYCACHE qc, ODR odr, int queryType,
+			 char *query, char **errmsgp);
+CCL_bibset queryQualifiers(QUERYCACHE qc, char **errmsgp);
 
 void fatal(char *fmt, ...);